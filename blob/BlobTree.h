@@ -41,12 +41,14 @@ protected:
 	uint32_t size;
 
 	template<class Callback>
-	pet::GenericError traverse(RWSession &session, Callback &&);
+	pet::GenericError traverse(RWSession &session, Callback &&, bool single = false);
+
+	inline void prefetch(ROSession &session, Address *table, int32_t level, uint32_t page, uint32_t last);
 public:
 	inline BlobTree(Address fileRoot, uint32_t size);
 
 	pet::FailPointer<void> empty();
-	pet::FailPointer<void> read(uint32_t page);
+	pet::FailPointer<void> read(uint32_t page, uint32_t readAhead = 0);
 	pet::GenericError update(uint32_t page, uint32_t newSize, void*);
 	void release(void*);
 
@@ -57,12 +59,16 @@ public:
 		uint32_t idx;
 		uint32_t maxIdx;
 		bool lastEntryOnLevel;
+		uint32_t pending;
 	};
 
 	typedef pet::DynamicStack<State, Allocator, predLevelCount> Traversor;
 
 	pet::GenericError dispose();
 	pet::GenericError relocate(Address &page);
+
+	template<class Filter>
+	pet::GenericError relocateAll(Filter &&filter);
 };
 
 #include "TreeOperations.h"
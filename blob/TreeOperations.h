@@ -51,23 +51,52 @@ inline void BlobTree<Storage, Allocator, predLevelCount>::release(void* buffer)
 	this->closeReadOnlySession(session);
 }
 
+/**
+ * Hints the storage about the entries of an index table that are going to be needed for
+ * reading the pages following the requested one up to (and including) the _last_ one.
+ * On the lowest index level these are the data pages themselves, above that the index
+ * pages of the following subtrees (the data pages of those are hinted later, when the
+ * reading gets there).
+ */
 template<class Storage, class Allocator, uint32_t predLevelCount>
-pet::FailPointer<void> BlobTree<Storage, Allocator, predLevelCount>::read(uint32_t page)
+inline void BlobTree<Storage, Allocator, predLevelCount>::prefetch(ROSession &session, Address *table, int32_t level, uint32_t page, uint32_t last)
+{
+	const uint32_t first = BlackMagic::getLevelOffset(page, level) + 1;
+	uint32_t end = BlackMagic::base - 1;
+
+	if(page / BlackMagic::sizes[level] == last / BlackMagic::sizes[level])
+		end = BlackMagic::getLevelOffset(last, level);
+
+	for(uint32_t i = first; i <= end; i++)
+		this->Storage::prefetch(session, table[i]);
+}
+
+template<class Storage, class Allocator, uint32_t predLevelCount>
+pet::FailPointer<void> BlobTree<Storage, Allocator, predLevelCount>::read(uint32_t page, uint32_t readAhead)
 {
 	if((page * Storage::pageSize > size) || (root == Storage::InvalidAddress))
 		return 0;
 
 	Address address = root;
+	const uint32_t lastPage = (size - 1) / Storage::pageSize;
+	uint32_t last = page;
+
+	if(page < lastPage)
+		last = (readAhead < lastPage - page) ? (page + readAhead) : lastPage;
 
 	ROSession session(this);
 
-	for(int32_t levels = BlackMagic::getHighestLevel((size - 1) / Storage::pageSize); levels >= 0; levels--) {
+	for(int32_t levels = BlackMagic::getHighestLevel(lastPage); levels >= 0; levels--) {
 		void *ret = this->Storage::read(session, address);
 
 		if(!ret)
 			return 0;
 
 		Address *table = (Address *) ret;
+
+		if(last > page)
+			prefetch(session, table, levels, page, last);
+
 		Address newAddress = table[BlackMagic::getLevelOffset(page, levels)];
 		this->Storage::release(session, table);
 		address = newAddress;
@@ -289,9 +318,20 @@ pet::GenericError BlobTree<Storage, Allocator, predLevelCount>::update(uint32_t
 	return 0;
 }
 
+/**
+ * Visits all the pages of the tree (the index pages after their children), the callback can
+ * return a new address for any of them, in which case the index pages above are updated. The
+ * new addresses of the children are kept on a stack until the index page itself is done, so
+ * that each of them is written only once, for any number of changed children (and none of
+ * the cached pages is modified before that). Returns true if the tree was changed, the traversal
+ * stops with an error if the callback returns an invalid address.
+ *
+ * If _single_ is set, no more pages are visited after the first change, only the index pages
+ * above it are updated (for moving a single page).
+ */
 template<class Storage, class Allocator, uint32_t predLevelCount>
 template<class ElementCallback>
-pet::GenericError BlobTree<Storage, Allocator, predLevelCount>::traverse(RWSession &session, ElementCallback &&callback)
+pet::GenericError BlobTree<Storage, Allocator, predLevelCount>::traverse(RWSession &session, ElementCallback &&callback, bool single)
 {
 	if(!size)
 		return 1;
@@ -300,129 +340,144 @@ pet::GenericError BlobTree<Storage, Allocator, predLevelCount>::traverse(RWSessi
 	int32_t indexLevel = BlackMagic::getHighestLevel(lastPage); 		// see note on top
 	bool update = false;
 
-	Traversor levelStates;
+	struct Change {
+		Address address;
+		uint32_t idx;
+	};
 
-	Address newAddress = Storage::InvalidAddress;
+	Traversor levelStates;
+	pet::DynamicStack<Change, Allocator, predLevelCount> changes;
 
 	if(indexLevel == -1) {
-		newAddress = callback(root, 0, levelStates);
-		update = newAddress != root;
-	} else {
+		Address newAddress = callback(root, 0, levelStates);
 
-		if(levelStates.acquire().failed())
-			return pet::GenericError::outOfMemoryError();
+		if(newAddress == Storage::InvalidAddress)
+			return pet::GenericError::writeError();
 
-		levelStates.current()->idx = 0;
-		levelStates.current()->maxIdx = BlackMagic::getLevelOffset(lastPage, indexLevel);
-		levelStates.current()->lastEntryOnLevel = true;
-		levelStates.current()->address = root;
+		update = newAddress != root;
+		root = newAddress;
+		return update;
+	}
 
-		while(levelStates.current()) {
-			if(indexLevel == 0) {
-				void *ret = this->Storage::read(session, levelStates.current()->address);
+	if(levelStates.acquire().failed())
+		return pet::GenericError::outOfMemoryError();
 
-				if(!ret)
-					return pet::GenericError::readError();
+	levelStates.current()->idx = 0;
+	levelStates.current()->maxIdx = BlackMagic::getLevelOffset(lastPage, indexLevel);
+	levelStates.current()->lastEntryOnLevel = true;
+	levelStates.current()->address = root;
+	levelStates.current()->pending = 0;
 
-				Address *table = (Address *)ret;
+	while(levelStates.current()) {
+		void *ret = this->Storage::read(session, levelStates.current()->address);
 
-				for(levelStates.current()->idx=0; levelStates.current()->idx<=levelStates.current()->maxIdx; levelStates.current()->idx++) {
-					newAddress = callback(table[levelStates.current()->idx], 0, levelStates);
-					if(newAddress != table[levelStates.current()->idx]) {
-						this->Storage::release(session, table);
-						update = true;
-						levelStates.current()->idx++;
-						break;
-					}
-				}
+		if(!ret)
+			return pet::GenericError::readError();
 
-				if(update)
-					break;
+		Address *table = (Address *)ret;
+		bool rewritten = false;
 
-				indexLevel = 1;
+		if(indexLevel == 0) {
+			for(levelStates.current()->idx=0; levelStates.current()->idx<=levelStates.current()->maxIdx; levelStates.current()->idx++) {
+				Address newAddress = callback(table[levelStates.current()->idx], 0, levelStates);
 
-				this->Storage::release(session, table);
+				if(newAddress == Storage::InvalidAddress) {
+					this->Storage::release(session, table);
+					return pet::GenericError::writeError();
+				}
 
-				Address addr = levelStates.current()->address;
-				levelStates.release();
+				if(newAddress != table[levelStates.current()->idx]) {
+					if(changes.acquire().failed()) {
+						this->Storage::release(session, table);
+						return pet::GenericError::outOfMemoryError();
+					}
 
-				newAddress = callback(addr, 1, levelStates);
-				if(newAddress != addr) {
+					changes.current()->address = newAddress;
+					changes.current()->idx = levelStates.current()->idx;
+					levelStates.current()->pending++;
 					update = true;
-					break;
-				}
-			} else {
-				void *ret = this->Storage::read(session, levelStates.current()->address);
 
-				if(!ret)
-					return pet::GenericError::readError();
+					if(single)
+						break;
+				}
+			}
 
-				Address *table = (Address *)ret;
+			indexLevel = 1;
+		} else {
+			if(!(single && update) && levelStates.current()->idx <= levelStates.current()->maxIdx) {
+				Address childAddress = table[levelStates.current()->idx];
+				this->Storage::release(session, table);
 
-				if(levelStates.current()->idx <= levelStates.current()->maxIdx) {
-					Address childAddress = table[levelStates.current()->idx];
-					this->Storage::release(session, table);
+				State *parent = levelStates.current();
 
-					State *parent = levelStates.current();
+				if(levelStates.acquire().failed())
+					return pet::GenericError::outOfMemoryError();
 
-					if(levelStates.acquire().failed())
-						return pet::GenericError::outOfMemoryError();
+				indexLevel--;
 
-					indexLevel--;
+				if(parent->lastEntryOnLevel && parent->idx == parent->maxIdx) {
+					levelStates.current()->lastEntryOnLevel = true;
+					levelStates.current()->maxIdx = BlackMagic::getLevelOffset(lastPage, indexLevel);
+				} else {
+					levelStates.current()->lastEntryOnLevel = false;
+					levelStates.current()->maxIdx = BlackMagic::base - 1;
+				}
 
-					if(parent->lastEntryOnLevel && parent->idx == parent->maxIdx) {
-						levelStates.current()->lastEntryOnLevel = true;
-						levelStates.current()->maxIdx = BlackMagic::getLevelOffset(lastPage, indexLevel);
-					} else {
-						levelStates.current()->lastEntryOnLevel = false;
-						levelStates.current()->maxIdx = BlackMagic::base - 1;
-					}
+				levelStates.current()->idx = 0;
+				levelStates.current()->address = childAddress;
+				levelStates.current()->pending = 0;
 
-					levelStates.current()->idx = 0;
-					levelStates.current()->address = childAddress;
+				parent->idx++;
+				continue;
+			}
 
-					parent->idx++;
-				} else {
-					this->Storage::release(session, table);
-					indexLevel++;
-					Address addr = levelStates.current()->address;
-					levelStates.release();
+			indexLevel++;
+		}
 
-					newAddress = callback(addr, indexLevel, levelStates);
-					if(newAddress != addr) {
-						update = true;
-						break;
-					}
-				}
-			}
+		for(; levelStates.current()->pending; levelStates.current()->pending--) {
+			table[changes.current()->idx] = changes.current()->address;
+			changes.release();
+			rewritten = true;
 		}
-	}
 
-	if(newAddress != Storage::InvalidAddress && update) {
-		while(levelStates.current()) {
-			void *rret = this->Storage::read(session, levelStates.current()->address);
+		/*
+		 * All the children of the index page are done, it can be moved too, and its
+		 * parent has to be updated if its address changed for either reason.
+		 */
+		if(rewritten) {
+			Address written = this->Storage::write(session, table);
 
-			if(!rret)
-				return pet::GenericError::readError();
+			if(written == Storage::InvalidAddress)
+				return pet::GenericError::writeError();
 
-			Address *table = (Address *)rret;
+			levelStates.current()->address = written;
+		} else
+			this->Storage::release(session, table);
 
-			table[levelStates.current()->idx - 1] = newAddress;
+		Address addr = levelStates.current()->address;
+		levelStates.release();
 
-			auto wret = this->Storage::write(session, table);
+		Address newAddress = callback(addr, indexLevel, levelStates);
 
-			if(wret == Storage::InvalidAddress)
-				return pet::GenericError::writeError();
+		if(newAddress == Storage::InvalidAddress)
+			return pet::GenericError::writeError();
 
-			newAddress = wret;
-			levelStates.release();
-		};
+		if(rewritten || newAddress != addr) {
+			update = true;
 
-		root = newAddress;
-		return true;
+			if(levelStates.current()) {
+				if(changes.acquire().failed())
+					return pet::GenericError::outOfMemoryError();
+
+				changes.current()->address = newAddress;
+				changes.current()->idx = levelStates.current()->idx - 1;
+				levelStates.current()->pending++;
+			} else
+				root = newAddress;
+		}
 	}
 
-	return false;
+	return update;
 }
 
 template <class Storage, class Allocator, uint32_t predLevelCount>
@@ -466,7 +521,7 @@ inline pet::GenericError BlobTree<Storage, Allocator, predLevelCount>::relocate(
 		}
 
 		return addr;
-	});
+	}, true);
 
 	if(res.failed()) {
 		this->rollback(session);
@@ -479,3 +534,42 @@ inline pet::GenericError BlobTree<Storage, Allocator, predLevelCount>::relocate(
 		return false;
 	}
 }
+
+/**
+ * Moves all the pages of the tree for which the filter returns true, in a single traversal.
+ * Returns the number of pages moved.
+ */
+template<class Storage, class Allocator, uint32_t predLevelCount>
+template<class Filter>
+inline pet::GenericError BlobTree<Storage, Allocator, predLevelCount>::relocateAll(Filter &&filter)
+{
+	RWSession session(this);
+	this->upgrade(session);
+
+	uint32_t count = 0;
+
+	pet::GenericError res = this->traverse(session, [&](Address addr, uint32_t level, const Traversor&) -> Address {
+		if(filter(addr)) {
+			void* ret = this->Storage::read(session, addr);
+
+			if(!ret)
+				return Storage::InvalidAddress;
+
+			count++;
+			return this->Storage::write(session, ret);
+		}
+
+		return addr;
+	});
+
+	if(res.failed()) {
+		this->rollback(session);
+		return res.rethrow();
+	} else if(res) {
+		this->commit(session);
+		return count;
+	} else {
+		this->closeReadWriteSession(session);
+		return 0;
+	}
+}
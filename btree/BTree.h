@@ -221,6 +221,9 @@ public:
 	pet::GenericError remove(const Key &key, Value *value = 0);
 	inline pet::GenericError purge();
 	inline pet::GenericError relocate(Address&);
+
+	template<class Filter>
+	inline pet::GenericError relocateAll(Filter &&filter);
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////////
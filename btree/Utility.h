@@ -237,4 +237,176 @@ BTree<Storage, Key, IndexKey, Value, Allocator>::relocate(Address &page)
 	}
 }
 
+/**
+ * Moves all the pages of the tree for which the filter returns true, in a single traversal.
+ * The new addresses of the children are kept on a stack until their parent is done, so that
+ * each node is written only once, for any number of moved children, and the cached nodes are
+ * left intact if it fails midway. Returns the number of pages moved.
+ */
+template <class Storage, class Key, class IndexKey, class Value, class Allocator>
+template<class Filter>
+inline pet::GenericError
+BTree<Storage, Key, IndexKey, Value, Allocator>::relocateAll(Filter &&filter)
+{
+	struct Position {
+		Address address;
+		uint32_t idx;
+		uint32_t pending;
+	};
+
+	struct Change {
+		Address address;
+		uint32_t idx;
+	};
+
+	RWSession session(this);
+	this->upgrade(session);
+
+	pet::DynamicStack<Position, Allocator, BTREE_TRAVERSOR_LEVELS> path;
+	pet::DynamicStack<Change, Allocator, BTREE_TRAVERSOR_LEVELS> changes;
+	pet::GenericError res = 0;
+	uint32_t count = 0;
+
+	if(!levels) {
+		if(root != InvalidAddress && filter(root)) {
+			void* ret = this->read(session, root);
+
+			if(!ret) {
+				res = pet::GenericError::readError();
+			} else {
+				this->flagNextAsRoot(session);
+				Address written = this->Storage::write(session, ret);
+
+				if(written == Storage::InvalidAddress)
+					res = pet::GenericError::writeError();
+				else {
+					root = written;
+					count++;
+				}
+			}
+		}
+	} else if(path.acquire().failed()) {
+		res = pet::GenericError::outOfMemoryError();
+	} else {
+		path.current()->address = root;
+		path.current()->idx = 0;
+		path.current()->pending = 0;
+
+		uint32_t currLevel = levels;
+
+		while(path.current()) {
+			void* ret = this->read(session, path.current()->address);
+
+			if(!ret) {
+				res = pet::GenericError::readError();
+				break;
+			}
+
+			Node *node = (Node*)ret;
+			bool rewritten = false;
+
+			if(currLevel == 1) {
+				for(uint32_t i = 0; i < node->length(); i++) {
+					if(filter(node->children[i])) {
+						void* child = this->read(session, node->children[i]);
+
+						if(!child) {
+							res = pet::GenericError::readError();
+							break;
+						}
+
+						Address written = this->Storage::write(session, child);
+
+						if(written == Storage::InvalidAddress) {
+							res = pet::GenericError::writeError();
+							break;
+						}
+
+						if(changes.acquire().failed()) {
+							res = pet::GenericError::outOfMemoryError();
+							break;
+						}
+
+						changes.current()->address = written;
+						changes.current()->idx = i;
+						path.current()->pending++;
+						count++;
+					}
+				}
+
+				if(res.failed()) {
+					this->release(session, node);
+					break;
+				}
+			} else if(path.current()->idx < node->length()) {
+				Address nextChild = node->children[path.current()->idx++];
+				this->release(session, node);
+
+				if(path.acquire().failed()) {
+					res = pet::GenericError::outOfMemoryError();
+					break;
+				}
+
+				path.current()->address = nextChild;
+				path.current()->idx = 0;
+				path.current()->pending = 0;
+				currLevel--;
+				continue;
+			}
+
+			for(; path.current()->pending; path.current()->pending--) {
+				node->children[changes.current()->idx] = changes.current()->address;
+				changes.release();
+				rewritten = true;
+			}
+
+			if(filter(path.current()->address)) {
+				rewritten = true;
+				count++;
+			}
+
+			path.release();
+			currLevel++;
+
+			if(!rewritten) {
+				this->release(session, node);
+				continue;
+			}
+
+			if(!path.current())
+				this->flagNextAsRoot(session);
+
+			Address written = this->Storage::write(session, (void*)node);
+
+			if(written == Storage::InvalidAddress) {
+				res = pet::GenericError::writeError();
+				break;
+			}
+
+			if(path.current()) {
+				if(changes.acquire().failed()) {
+					res = pet::GenericError::outOfMemoryError();
+					break;
+				}
+
+				changes.current()->address = written;
+				changes.current()->idx = path.current()->idx - 1;
+				path.current()->pending++;
+			} else
+				root = written;
+		}
+	}
+
+	if(res.failed()) {
+		this->rollback(session);
+		return res.rethrow();
+	} else if(count) {
+		this->commit(session);
+		return count;
+	} else {
+		this->closeReadWriteSession(session);
+		return 0;
+	}
+}
+
 #endif /* UTILITY_H_ */
@@ -0,0 +1,176 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2016, 2017 Seller Tamás. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *******************************************************************************/
+
+#ifndef BLOCKSUMMARY_H_
+#define BLOCKSUMMARY_H_
+
+#include <cstdint>
+
+/**
+ * Owners of the pages of a block of file data, stored in the last page of the block once
+ * the others are written, so that the garbage collector can learn them by reading a
+ * single page instead of all of them. Unknown owners (of the pages written before the
+ * mount) are marked with an id of -1.
+ */
+template<uint32_t nPages>
+struct BlockSummary {
+	static constexpr uint32_t magicValue = 0x6d6d7573;	// "summ"
+	static constexpr uint32_t ownerId = -2u;			// Node id written in the page meta of the summary.
+
+	struct Entry {
+		uint32_t id;
+		uint32_t parentId;
+	};
+
+	uint32_t magic;
+	uint32_t block;
+	Entry entries[nPages - 1];
+
+	inline void reset(uint32_t block);
+	inline bool isValid(uint32_t block) const;
+};
+
+/**
+ * The summaries of the blocks being filled, at most one for each allocation head of the
+ * file levels. The slot of a block that is no longer being written is taken for a new one.
+ *
+ * The pages the summaries are written to are not used by any file, so they are reclaimed,
+ * but only once they have reached the flash (the block may become free and get erased by
+ * that), until then they are kept here.
+ */
+template<uint32_t nPages, uint32_t nSlots>
+class OpenBlockSummaries {
+	BlockSummary<nPages> slots[nSlots];
+	uint32_t writtenPages[nSlots];
+public:
+	inline void reset();
+
+	template<class Manager>
+	inline BlockSummary<nPages>* get(uint32_t block, Manager& manager);
+
+	inline bool addWritten(uint32_t page);
+
+	template<class Buffers, class Manager>
+	inline void reclaimWritten(Buffers& buffers, Manager& manager, bool wait);
+};
+
+template<uint32_t nPages>
+class OpenBlockSummaries<nPages, 0> {
+public:
+	inline void reset() {}
+
+	template<class Manager>
+	inline BlockSummary<nPages>* get(uint32_t block, Manager& manager) {
+		return 0;
+	}
+
+	inline bool addWritten(uint32_t page) {
+		return false;
+	}
+
+	template<class Buffers, class Manager>
+	inline void reclaimWritten(Buffers& buffers, Manager& manager, bool wait) {}
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+template<uint32_t nPages>
+inline void BlockSummary<nPages>::reset(uint32_t block)
+{
+	this->magic = magicValue;
+	this->block = block;
+
+	for(uint32_t i=0; i<nPages - 1; i++)
+		entries[i].id = entries[i].parentId = -1u;
+}
+
+template<uint32_t nPages>
+inline bool BlockSummary<nPages>::isValid(uint32_t block) const
+{
+	return magic == magicValue && this->block == block;
+}
+
+template<uint32_t nPages, uint32_t nSlots>
+inline void OpenBlockSummaries<nPages, nSlots>::reset()
+{
+	for(uint32_t i=0; i<nSlots; i++) {
+		slots[i].block = -1u;
+		writtenPages[i] = -1u;
+	}
+}
+
+template<uint32_t nPages, uint32_t nSlots>
+template<class Manager>
+inline BlockSummary<nPages>* OpenBlockSummaries<nPages, nSlots>::get(uint32_t block, Manager& manager)
+{
+	BlockSummary<nPages>* stale = 0;
+
+	for(uint32_t i=0; i<nSlots; i++) {
+		if(slots[i].block == block)
+			return slots + i;
+
+		if(!stale && (slots[i].block == -1u || !manager.isBlockBeingUsed(slots[i].block)))
+			stale = slots + i;
+	}
+
+	if(stale)
+		stale->reset(block);
+
+	return stale;
+}
+
+/**
+ * Notes a summary page to be reclaimed once written back, returns false if there is no room for it.
+ */
+template<uint32_t nPages, uint32_t nSlots>
+inline bool OpenBlockSummaries<nPages, nSlots>::addWritten(uint32_t page)
+{
+	for(uint32_t i=0; i<nSlots; i++) {
+		if(writtenPages[i] == -1u) {
+			writtenPages[i] = page;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * Reclaims the noted summary pages that have already been written back, or all of
+ * them if _wait_ is set, by waiting for the write back of the rest.
+ */
+template<uint32_t nPages, uint32_t nSlots>
+template<class Buffers, class Manager>
+inline void OpenBlockSummaries<nPages, nSlots>::reclaimWritten(Buffers& buffers, Manager& manager, bool wait)
+{
+	for(uint32_t i=0; i<nSlots; i++) {
+		if(writtenPages[i] == -1u)
+			continue;
+
+		if(wait)
+			buffers.flush(writtenPages[i]);
+		else if(!buffers.isWrittenBack(writtenPages[i]))
+			continue;
+
+		manager.reclaim(writtenPages[i]);
+		writtenPages[i] = -1u;
+	}
+}
+
+#endif /* BLOCKSUMMARY_H_ */
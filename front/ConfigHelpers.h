@@ -19,7 +19,37 @@
 #ifndef CONFIGHELPERS_H_
 #define CONFIGHELPERS_H_
 
-struct DefaultNolockConfig {
+#include <cstdint>
+
+#include "storage/BufferReplacement.h"
+#include "storage/SecondaryCache.h"
+#include "storage/VictimSelection.h"
+
+/**
+ * Default values for the optional tuning parameters. The locking related
+ * helpers below inherit these, so any of them can be overridden by simply
+ * defining it again in the user supplied configuration.
+ */
+struct DefaultTuning {
+	static constexpr uint32_t maxReadAhead = 8;	// Maximal number of pages read ahead for sequential stream reads.
+	typedef LruReplacement BufferReplacement;	// Replacement policy of the buffer cache (see storage/BufferReplacement.h).
+	typedef NoSecondaryCache SecondaryCache;	// Second level cache of clean pages (see storage/SecondaryCache.h).
+	static constexpr uint32_t maxBuffers = 0;	// Buffers can be added at run-time up to this many in total (or nBuffers).
+	static constexpr uint32_t dirtyHighPercent = 50;	// Background write back starts above this ratio of dirty buffers,
+	static constexpr uint32_t dirtyLowPercent = 25;		// and goes on until this ratio is reached.
+	static constexpr uint32_t minFreeBuffers = 4;		// Idle streams give back their dirty buffers below this.
+	typedef uint16_t EraseCount;						// Type of the erase counts kept for each block (they saturate at its maximum).
+	static constexpr uint32_t freeBlockCandidates = 8;	// The least worn of this many free blocks is used next,
+	static constexpr uint32_t wearCheckInterval = 64;	// and after this many erases the gc moves the data of the least
+	static constexpr uint32_t maxWearSpread = 32;		// worn block elsewhere, if it is worn this much less than the most.
+	static constexpr uint32_t hotRewriteCount = 2;		// Files with each page rewritten this many times (on average) are hot.
+	typedef GreedyVictimSelection GcVictimSelection;	// Choice of the block to be freed up by the gc (see storage/VictimSelection.h).
+	static constexpr uint32_t backgroundGcBlocks = 4;	// The collectGarbageStep frees up blocks until this many are free above the reserve.
+	static constexpr bool blockSummary = false;			// Owners of the file data pages are listed in the last page of the blocks.
+	static constexpr uint32_t erasedPoolSize = 2;		// The collectGarbageStep erases this many free blocks in advance.
+};
+
+struct DefaultNolockConfig: DefaultTuning {
 	struct Mutex {
 		inline void lock() {}
 		inline void unlock() {}
@@ -35,7 +65,7 @@ struct DefaultNolockConfig {
 };
 
 template<class BackendMutex>
-struct DefaultMutexConfig
+struct DefaultMutexConfig: DefaultTuning
 {
 	typedef BackendMutex Mutex;
 
@@ -52,7 +82,7 @@ struct DefaultMutexConfig
 };
 
 template<class BackendMutex, class BackendRWLock>
-class DefaultRwlockConfig {
+class DefaultRwlockConfig: public DefaultTuning {
 public:
 	typedef BackendMutex Mutex;
 
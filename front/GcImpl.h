@@ -23,65 +23,29 @@
 template<class Config>
 inline pet::GenericError WtfsEcosystem<Config>::WtfsMain::collectGarbage()
 {
-	typedef typename Manager::Iterator StorageIterator;
-	typedef typename FlashDriver::Address Address;
-	typedef typename Buffers::Buffer Buffer;
-
 	nodeListLock.lock();
 
 	bool done = false;
 
 	WtfsTrace::info << "gc invoked\n";
 
-	for(StorageIterator candidateIt = StorageIterator(*this); candidateIt.currentBlock() != -1; candidateIt.step(*this)) {
-
-		WtfsTrace::info << "\tconsidering block #" << candidateIt.currentBlock()<< "\n";
-
-		if(candidateIt.currentCount(*this) == FlashDriver::blockSize) {
-			WtfsTrace::info << "\tblock #" << candidateIt.currentBlock() << " is full, aborting !\n";
-			break;
-		}
-
-		if(this->isBlockBeingUsed(candidateIt.currentBlock())) {
-			WtfsTrace::info << "\tblock #" << candidateIt.currentBlock() << " is being used, retrying\n";
-			continue;
-		}
-
-		Address page = candidateIt.currentBlock() * FlashDriver::blockSize;
-		Buffer* buff = this->buffers->find(page);
-		int32_t level = (int32_t)buff->data.level;
-		this->buffers->release(buff, Clean);
+	openSummaries.reclaimWritten(*this->buffers, *this, true);
 
-		buffers->flush();
+	int32_t victim = Config::GcVictimSelection::template select<FlashDriver>((Manager&)*this);
 
-		WtfsTrace::info << "\tmoving out useful data from block #" << candidateIt.currentBlock() << ", contains "
-				<< candidateIt.currentCount(*this) << " pages of level "
-				<< level << " data\n";
+	if(victim != -1) {
+		WtfsTrace::info << "\tblock #" << victim << " selected\n";
 
-		if(level >= 0) {
-			auto moveRet = moveAroundMetaPages(page, candidateIt.currentCount(*this));
-			if(moveRet.failed() || !moveRet) {
-				WtfsTrace::info << "\t";
-				WtfsTrace::warn << "gc freeing up of meta block #" << candidateIt.currentBlock() << " FAILED!\n";
-				nodeListLock.unlock();
-				return moveRet.rethrow();
-			}
-
-			done = true;
-			break;
-		} else {
-			auto moveRet = moveAroundBlobPages(page, candidateIt.currentCount(*this));
-			if(moveRet.failed() || !moveRet) {
-				WtfsTrace::info << "\t";
-				WtfsTrace::warn << "gc freeing up of blob block #" << candidateIt.currentBlock() << " FAILED!\n";
-				nodeListLock.unlock();
-				return moveRet.rethrow();
-			}
+		auto moveRet = evacuateBlock(victim, this->usageCounters[victim]);
 
-			done = true;
-			break;
+		if(moveRet.failed() || !moveRet) {
+			nodeListLock.unlock();
+			return moveRet.rethrow();
 		}
-	}
+
+		done = true;
+	} else
+		WtfsTrace::info << "\tno block to be freed up, aborting !\n";
 
 	if(done)
 		WtfsTrace::info << "gc operation successful\n\n";
@@ -92,6 +56,75 @@ inline pet::GenericError WtfsEcosystem<Config>::WtfsMain::collectGarbage()
 	return done;
 }
 
+/**
+ * Static wear leveling: once in a while the data of the least worn block (which is probably
+ * static) is moved elsewhere, so that the block gets erased and reused. Only done if there
+ * is enough free space left to do that without a garbage collection.
+ */
+template<class Config>
+inline pet::GenericError WtfsEcosystem<Config>::WtfsMain::levelWear()
+{
+	if(this->gcNeeded())
+		return 0;
+
+	openSummaries.reclaimWritten(*this->buffers, *this, true);
+
+	int32_t coldBlock = this->findColdBlock();
+
+	if(coldBlock == -1)
+		return 0;
+
+	nodeListLock.lock();
+
+	WtfsTrace::info << "wear leveling invoked\n";
+
+	pet::GenericError ret = evacuateBlock(coldBlock, this->usageCounters[coldBlock]);
+
+	nodeListLock.unlock();
+	return ret;
+}
+
+/**
+ * Moves the useful pages of a block elsewhere, so that it becomes free.
+ */
+template<class Config>
+inline pet::GenericError WtfsEcosystem<Config>::WtfsMain::evacuateBlock(uint32_t block, uint32_t usedPages)
+{
+	typedef typename FlashDriver::Address Address;
+	typedef typename Buffers::Buffer Buffer;
+
+	Address page = block * FlashDriver::blockSize;
+	Buffer* buff = this->buffers->find(page);
+	int32_t level = (int32_t)buff->data.level;
+	this->buffers->release(buff, Clean);
+
+	buffers->flush();
+
+	WtfsTrace::info << "\tmoving out useful data from block #" << block << ", contains "
+			<< usedPages << " pages of level "
+			<< level << " data\n";
+
+	pet::GenericError moveRet = (level >= 0) ? moveAroundMetaPages(page, usedPages) : moveAroundBlobPages(page, usedPages);
+
+	if(moveRet.failed() || !moveRet) {
+		WtfsTrace::info << "\t";
+		WtfsTrace::warn << "gc freeing up of " << ((level >= 0) ? "meta" : "blob") << " block #" << block << " FAILED!\n";
+	}
+
+	return moveRet;
+}
+
+/**
+ * Moves the used file data pages of a block elsewhere, grouped by the files they belong to,
+ * so that each file is traversed and updated in the meta tree only once. The pages of the
+ * files that are already done are skipped as garbage. The usage counter of the block is
+ * watched instead of counting the pages moved, as the index pages in the block may also
+ * become garbage by getting updated (rather than moved) during the traversal. Once it
+ * drops to zero the block may even be taken again by the writes (which erases it).
+ *
+ * If the block has a summary the owners are taken from there, only the pages with an unknown
+ * owner are read.
+ */
 template<class Config>
 inline pet::GenericError WtfsEcosystem<Config>::WtfsMain::
 moveAroundBlobPages(typename FlashDriver::Address const page, uint32_t usedPages)
@@ -99,10 +132,47 @@ moveAroundBlobPages(typename FlashDriver::Address const page, uint32_t usedPages
 	typedef typename BlobStore::Page Page;
 	typedef typename FlashDriver::Address Address;
 
-	for(uint32_t i = 0; usedPages && i < FlashDriver::blockSize; i++) {
-		Address movePage = page + i;
-		typename Buffers::Buffer* buff = this->buffers->find(movePage);
-		Node* node = openNodes.findByFields(((Page*)buff)->meta.id, &Node::key, &FullKey::id);
+	const uint32_t block = page / FlashDriver::blockSize;
+	const uint32_t eraseCount = this->getEraseCount(block);
+	NodeId done[FlashDriver::blockSize];
+	uint32_t nDone = 0;
+
+	Summary summary;
+	const bool summarized = fetchSummary(block, summary);
+
+	auto evacuated = [&]() {
+		return !this->usageCounters[block] || this->getEraseCount(block) != eraseCount;
+	};
+
+	for(uint32_t i = 0; !evacuated() && i < FlashDriver::blockSize; i++) {
+		NodeId id, parentId;
+
+		if(summarized && (i == FlashDriver::blockSize - 1 || summary.entries[i].id != -1u)) {
+			if(i == FlashDriver::blockSize - 1)
+				break;
+
+			id = summary.entries[i].id;
+			parentId = summary.entries[i].parentId;
+		} else {
+			typename Buffers::Buffer* buff = this->buffers->find(page + i);
+			id = ((Page*)buff)->meta.id;
+			parentId = ((Page*)buff)->meta.parentId;
+			this->buffers->release(buff, Clean);
+		}
+
+		if(id == Summary::ownerId)
+			continue;
+
+		bool seen = false;
+		for(uint32_t j = 0; !seen && j < nDone; j++)
+			seen = done[j] == id;
+
+		if(seen)
+			continue;
+
+		done[nDone++] = id;
+
+		Node* node = openNodes.findByFields(id, &Node::key, &FullKey::id);
 
 		if(!node) {
 			pet::GenericError rootRes = fetchRoot(tempNode);
@@ -110,7 +180,7 @@ moveAroundBlobPages(typename FlashDriver::Address const page, uint32_t usedPages
 				return rootRes.rethrow();
 			}
 
-			pet::GenericError idRes = fetchById(tempNode, ((Page*)buff)->meta.parentId, ((Page*)buff)->meta.id);
+			pet::GenericError idRes = fetchById(tempNode, parentId, id);
 			if(idRes.failed()) {
 				return idRes.rethrow();
 			}
@@ -118,50 +188,289 @@ moveAroundBlobPages(typename FlashDriver::Address const page, uint32_t usedPages
 			node = &this->tempNode;
 		}
 
-		this->buffers->release(buff, Clean);
-
-		pet::GenericError travRes = node->relocate(movePage);
+		pet::GenericError travRes = node->relocateAll([block](Address addr) {
+			return addr / FlashDriver::blockSize == block;
+		});
 
 		if(travRes.failed()) {
-			WtfsTrace::fail << "\terror moving blob page " << page + i << "\n";
+			WtfsTrace::fail << "\terror moving blob pages of node " << id << "\n";
 			return travRes.rethrow();
 		} else if(travRes) {
-			usedPages--;
+			pet::GenericError updateRes = this->update(node->key, *node);
 
-		   pet::GenericError updateRes = this->update(node->key, *node);
+			if(updateRes.failed())
+				return updateRes.rethrow();
 
-		   if(updateRes.failed())
-				   return updateRes.rethrow();
-
-			WtfsTrace::info << "\tmoved blob page " << page + i << " -> " << movePage << " (id:" << node->getId() << ")\n";
+			WtfsTrace::info << "\tmoved " << (int)travRes << " blob pages of node " << id << "\n";
 		}
 	}
 
-	return !usedPages;
+	return evacuated();
 }
 
+/**
+ * Moves the used meta tree pages of a block elsewhere, in a single traversal of the tree
+ * (that also writes the nodes above the moved ones only once). As for the file data, the
+ * usage counter of the block tells whether it has been emptied.
+ */
 template<class Config>
 inline pet::GenericError WtfsEcosystem<Config>::WtfsMain::
 moveAroundMetaPages(typename FlashDriver::Address const page, uint32_t usedPages)
 {
 	typedef typename FlashDriver::Address Address;
-	typedef typename MetaTree::Traversor Traversor;
 
-	for(uint32_t i = 0; usedPages && i < FlashDriver::blockSize; i++) {
-		Address movePage = page + i;
-		pet::GenericError travRes = MetaTree::relocate(movePage);
+	const uint32_t block = page / FlashDriver::blockSize;
+	const uint32_t eraseCount = this->getEraseCount(block);
 
-		if(travRes.failed()) {
-			WtfsTrace::fail << "\terror moving meta page " << page + i << "\n";
-			return travRes.rethrow();
-		} else if(travRes) {
-			usedPages--;
-			WtfsTrace::info << "\tmoved meta page " << page + i << " -> " << movePage << "\n";
+	pet::GenericError travRes = MetaTree::relocateAll([block](Address addr) {
+		return addr / FlashDriver::blockSize == block;
+	});
+
+	if(travRes.failed()) {
+		WtfsTrace::fail << "\terror moving meta pages of block #" << block << "\n";
+		return travRes.rethrow();
+	}
+
+	WtfsTrace::info << "\tmoved " << (int)travRes << " meta pages\n";
+	return !this->usageCounters[block] || this->getEraseCount(block) != eraseCount;
+}
+
+/**
+ * Moves a page of file data elsewhere, if it is still in use. Returns true if it was moved.
+ */
+template<class Config>
+inline pet::GenericError WtfsEcosystem<Config>::WtfsMain::moveBlobPage(typename FlashDriver::Address const page)
+{
+	typedef typename BlobStore::Page Page;
+	typedef typename FlashDriver::Address Address;
+
+	Address movePage = page;
+	typename Buffers::Buffer* buff = this->buffers->find(movePage);
+
+	if(((Page*)buff)->meta.id == Summary::ownerId) {
+		this->buffers->release(buff, Clean);
+		return false;
+	}
+
+	Node* node = openNodes.findByFields(((Page*)buff)->meta.id, &Node::key, &FullKey::id);
+
+	if(!node) {
+		pet::GenericError rootRes = fetchRoot(tempNode);
+		if(rootRes.failed()) {
+			return rootRes.rethrow();
+		}
+
+		pet::GenericError idRes = fetchById(tempNode, ((Page*)buff)->meta.parentId, ((Page*)buff)->meta.id);
+		if(idRes.failed()) {
+			return idRes.rethrow();
+		}
+
+		node = &this->tempNode;
+	}
+
+	this->buffers->release(buff, Clean);
+
+	pet::GenericError travRes = node->relocate(movePage);
+
+	if(travRes.failed()) {
+		WtfsTrace::fail << "\terror moving blob page " << page << "\n";
+		return travRes.rethrow();
+	} else if(travRes) {
+		pet::GenericError updateRes = this->update(node->key, *node);
+
+		if(updateRes.failed())
+			return updateRes.rethrow();
+
+		WtfsTrace::info << "\tmoved blob page " << page << " -> " << movePage << " (id:" << node->getId() << ")\n";
+		return true;
+	}
+
+	return false;
+}
+
+/**
+ * Moves a page of the meta tree elsewhere, if it is still in use. Returns true if it was moved.
+ */
+template<class Config>
+inline pet::GenericError WtfsEcosystem<Config>::WtfsMain::moveMetaPage(typename FlashDriver::Address const page)
+{
+	typename FlashDriver::Address movePage = page;
+	pet::GenericError travRes = MetaTree::relocate(movePage);
+
+	if(travRes.failed()) {
+		WtfsTrace::fail << "\terror moving meta page " << page << "\n";
+		return travRes.rethrow();
+	} else if(travRes) {
+		WtfsTrace::info << "\tmoved meta page " << page << " -> " << movePage << "\n";
+		return true;
+	}
+
+	return false;
+}
+
+/**
+ * Does a limited amount of garbage collection, to be called from a background thread or an
+ * idle hook, so that the blocking collection done while writing (when the free blocks run
+ * out) is rarely needed. At most _pageBudget_ pages of the block being freed up are looked
+ * at (and moved if in use) per call, the block is remembered between the calls.
+ *
+ * A block is freed up if there are no more than _backgroundGcBlocks_ free blocks above the
+ * reserve of the blocking collection, or if one is due for static wear leveling (which is
+ * not done while writing anymore, once this is called). Returns true if there is more work
+ * to be done.
+ */
+template<class Config>
+inline pet::GenericError WtfsEcosystem<Config>::WtfsMain::collectGarbageStep(uint32_t pageBudget)
+{
+	this->writerEnter();
+	this->writerUpgrade();
+
+	if(isReadonly) {
+		this->writerLeaveUpgraded();
+		return pet::GenericError::readOnlyFsError();
+	}
+
+	inGc = true;
+	backgroundGc = true;
+	nodeListLock.lock();
+
+	pet::GenericError ret = 0;
+
+	while(pageBudget) {
+		/*
+		 * The block may have got freed up by the writes since the last step, and even
+		 * taken again for other data (then its erase count has changed).
+		 */
+		if(gcVictim != -1 && (gcNextPage == FlashDriver::blockSize || !this->usageCounters[gcVictim]
+				|| this->getEraseCount(gcVictim) != gcVictimEraseCount || this->isBlockBeingUsed(gcVictim)))
+			gcVictim = -1;
+
+		if(gcVictim == -1) {
+			openSummaries.reclaimWritten(*this->buffers, *this, true);
+
+			if(this->gcNeeded(Config::backgroundGcBlocks))
+				gcVictim = Config::GcVictimSelection::template select<FlashDriver>((Manager&)*this);
+
+			if(gcVictim == -1 && !this->gcNeeded())
+				gcVictim = this->findColdBlock();
+
+			if(gcVictim == -1)
+				break;
+
+			typename Buffers::Buffer* buff = this->buffers->find(gcVictim * FlashDriver::blockSize);
+			gcVictimLevel = (int32_t)buff->data.level;
+			gcVictimEraseCount = this->getEraseCount(gcVictim);
+			this->buffers->release(buff, Clean);
+			buffers->flush();
+
+			gcNextPage = 0;
+
+			WtfsTrace::info << "background gc started on block #" << gcVictim << "\n";
+		}
+
+		const typename FlashDriver::Address page = gcVictim * FlashDriver::blockSize + gcNextPage++;
+		pageBudget--;
+
+		ret = (gcVictimLevel >= 0) ? moveMetaPage(page) : moveBlobPage(page);
+
+		if(ret.failed()) {
+			WtfsTrace::warn << "background gc FAILED\n";
+			isReadonly = true;
+			break;
 		}
 	}
 
-	return !usedPages;
+	if(!ret.failed()) {
+		this->refillErasedPool();
+		ret = gcVictim != -1 || this->gcNeeded(Config::backgroundGcBlocks);
+	}
+
+	nodeListLock.unlock();
+	inGc = false;
+	this->writerLeaveUpgraded();
+	return ret;
 }
 
+/**
+ * Notes the owner of a page of file data just written in the summary of its block. Once only
+ * the last page of the block is left, the summary is written there (from the same allocation
+ * head), unless there is no buffer for it. That page is not used by any file, but it is only
+ * reclaimed once it has been written back (as the block may become free and get erased by
+ * that): the ones already written are reclaimed here, the rest before the next collection.
+ */
+template<class Config>
+inline void WtfsEcosystem<Config>::WtfsMain::recordOwner(typename FlashDriver::Address page, NodeId id, NodeId parentId, int32_t level)
+{
+	typedef typename BlobStore::Page Page;
+	typedef typename Manager::AllocationState AllocationState;
+
+	static_assert(!Config::blockSummary || sizeof(Summary) <= BlobStore::pageSize, "Block summary does not fit in a page");
+
+	const uint32_t block = page / FlashDriver::blockSize, offset = page % FlashDriver::blockSize;
+
+	if(!Config::blockSummary || offset == FlashDriver::blockSize - 1)
+		return;
+
+	Summary* summary = openSummaries.get(block, *this);
+
+	if(!summary)
+		return;
+
+	summary->entries[offset].id = id;
+	summary->entries[offset].parentId = parentId;
+
+	AllocationState &hot = this->hotAllocations[this->levelToIndex(level)];
+	AllocationState &head = (hot.currentAddress == block) ? hot : this->levelAllocations[this->levelToIndex(level)];
+
+	if(head.currentAddress != block || head.usedCount != FlashDriver::blockSize - 1)
+		return;
+
+	openSummaries.reclaimWritten(*this->buffers, *this, false);
+
+	typename Buffers::Buffer* buff = this->buffers->find(FlashDriver::InvalidAddress);
+
+	if(!buff) {
+		WtfsTrace::warn << "no buffer for the summary of block #" << block << ", skipped\n";
+		summary->block = -1u;
+		return;
+	}
+
+	buff->data.level = level;
+	memcpy(((Page*)buff)->payload, summary, sizeof(Summary));
+	((Page*)buff)->meta.id = ((Page*)buff)->meta.parentId = Summary::ownerId;
+
+	Buffers::setTemperature(buff, &head == &hot);
+	typename FlashDriver::Address written = this->buffers->release(buff, Dirty);
+
+	summary->block = -1u;
+
+	if(written != FlashDriver::InvalidAddress) {
+		if(!openSummaries.addWritten(written)) {
+			openSummaries.reclaimWritten(*this->buffers, *this, true);
+			openSummaries.addWritten(written);
+		}
+
+		WtfsTrace::info << "summary of block #" << block << " written to page " << written << "\n";
+	}
+}
+
+/**
+ * Reads the summary of a block of file data, returns false if it has none.
+ */
+template<class Config>
+inline bool WtfsEcosystem<Config>::WtfsMain::fetchSummary(uint32_t block, Summary& summary)
+{
+	typedef typename BlobStore::Page Page;
+
+	if(!Config::blockSummary)
+		return false;
+
+	typename Buffers::Buffer* buff = this->buffers->find(block * FlashDriver::blockSize + FlashDriver::blockSize - 1);
+	memcpy(&summary, ((Page*)buff)->payload, sizeof(Summary));
+	const bool ret = ((Page*)buff)->meta.id == Summary::ownerId && summary.isValid(block);
+	this->buffers->release(buff, Clean);
+
+	return ret;
+}
 
 #endif /* GCIMPL_H_ */
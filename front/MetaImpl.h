@@ -41,6 +41,39 @@ WtfsEcosystem<Config>::Node::getId() {
 	return key.id;
 }
 
+/**
+ * The data of a file is written to the blocks of the hot allocation heads if it was flagged
+ * so when created or opened, or (unless flagged otherwise) if its pages have been rewritten
+ * more than the configured number of times on average since it was fetched. Pages moved
+ * by the garbage collector are always treated as cold, as they have survived a while.
+ */
+template<class Config>
+inline uint8_t WtfsEcosystem<Config>::Node::allocationTemperature() {
+	if(fs->inGc || temperature == WtfsMain::Cold)
+		return 0;
+
+	if(temperature == WtfsMain::Hot)
+		return 1;
+
+	const uint32_t pages = (this->size + BlobStore::pageSize - 1) / BlobStore::pageSize;
+	return (rewrites >= Config::hotRewriteCount * (pages + 1)) ? 1 : 0;
+}
+
+template<class Config>
+inline void WtfsEcosystem<Config>::Node::countRewrite() {
+	if(rewrites != (uint16_t)-1u)
+		rewrites++;
+}
+
+/**
+ * Forgets the flag and the rewrites of the previous file, when the node gets a different one.
+ */
+template<class Config>
+inline void WtfsEcosystem<Config>::Node::resetTemperature(uint8_t temperature) {
+	this->temperature = temperature;
+	rewrites = 0;
+}
+
 template<class Config>
 pet::GenericError
 WtfsEcosystem<Config>::WtfsMain::fetchRoot(Node& node)
@@ -50,6 +83,7 @@ WtfsEcosystem<Config>::WtfsMain::fetchRoot(Node& node)
 	node.key.id = 0;
 	node.initialize(false);
 	node.fs = this;
+	node.resetTemperature(Auto);
 	return true;
 }
 
@@ -62,6 +96,8 @@ WtfsEcosystem<Config>::WtfsMain::fetchChildByName(Node& node, const char* start,
 	if(!end)
 		end = start + strlen(start);
 
+	reclaimStreamBuffers();
+
 	node.key.set(start, end, node.key.id);
 	pet::GenericError ret = this->template get(node.key, node);
 
@@ -71,6 +107,7 @@ WtfsEcosystem<Config>::WtfsMain::fetchChildByName(Node& node, const char* start,
 	if(!ret)
 		return pet::GenericError::noSuchEntryError();
 
+	node.resetTemperature(Auto);
 	return ret;
 }
 
@@ -114,8 +151,15 @@ WtfsEcosystem<Config>::WtfsMain::fetchFirstChild(Node& node)
 	if(node.hasData())
 		return pet::GenericError::isNotDirectoryError();
 
+	reclaimStreamBuffers();
+
 	node.key.indexed.parentId = node.key.id;
-	return this->template search<ParentIndexComparator<Config>, ParentKeyComparator<Config> >(node.key, node);
+	pet::GenericError ret = this->template search<ParentIndexComparator<Config>, ParentKeyComparator<Config> >(node.key, node);
+
+	if(!ret.failed() && ret)
+		node.resetTemperature(Auto);
+
+	return ret;
 }
 
 template<class Config>
@@ -153,6 +197,7 @@ inline WtfsEcosystem<Config>::WtfsMain::fetchById(Node& node, NodeId parent, Nod
 	if(!ret)
 		return pet::GenericError::noSuchEntryError();
 
+	node.resetTemperature(Auto);
 	return ret;
 }
 
@@ -180,7 +225,12 @@ WtfsEcosystem<Config>::WtfsMain::fetchNextSibling(Node& node)
 		}
 	};
 
-	return this->template search<ParentIndexComparator<Config>, NextSiblingComparator>(node.key, node);
+	pet::GenericError ret = this->template search<ParentIndexComparator<Config>, NextSiblingComparator>(node.key, node);
+
+	if(!ret.failed() && ret)
+		node.resetTemperature(Auto);
+
+	return ret;
 }
 
 template<class Config>
@@ -197,6 +247,8 @@ inline WtfsEcosystem<Config>::WtfsMain::addNew(Node& node, const char* start, co
 	if(isReadonly)
 		return pet::GenericError::readOnlyFsError();
 
+	reclaimStreamBuffers();
+
 	node.key.set(start, end, node.key.id);
 
 	maxIdLock.lock();
@@ -229,8 +281,13 @@ WtfsEcosystem<Config>::WtfsMain::newDirectory(Node& node, const char* start, con
 
 template<class Config>
 pet::GenericError
-WtfsEcosystem<Config>::WtfsMain::newFile(Node& node, const char* start, const char* end) {
-	return addNew<true>(node, start, end);
+WtfsEcosystem<Config>::WtfsMain::newFile(Node& node, const char* start, const char* end, Temperature temperature) {
+	pet::GenericError ret = addNew<true>(node, start, end);
+
+	if(!ret.failed())
+		node.resetTemperature(temperature);
+
+	return ret;
 }
 
 template<class Config>
@@ -243,6 +300,8 @@ WtfsEcosystem<Config>::WtfsMain::removeNode(Node& node)
 	if(isReadonly)
 		return pet::GenericError::readOnlyFsError();
 
+	reclaimStreamBuffers();
+
 	if(node.hasData()) {
 		pet::GenericError ret = node.dispose();
 
@@ -22,9 +22,67 @@
 template<class Config>
 inline void WtfsEcosystem<Config>::WtfsMain::bind(Buffers* buffers) {
 	Buffers::Initializer::initialize(buffers, this);
+	buffers->setDirtyWatermarks(Config::dirtyHighPercent, Config::dirtyLowPercent);
 	this->buffers = buffers;
 }
 
+/**
+ * Binds the buffers after adding the ones that fit in the supplied memory region
+ * to them, returns the number of buffers added (see BufferedStorage::addBuffers).
+ */
+template<class Config>
+inline uint32_t WtfsEcosystem<Config>::WtfsMain::bind(Buffers* buffers, void* region, uint32_t size) {
+	uint32_t ret = buffers->addBuffers(region, size);
+	bind(buffers);
+	return ret;
+}
+
+/**
+ * Binds the buffers after adding _count_ buffers to them, allocated using the _Allocator_ of the
+ * configuration, returns the number of buffers added (see BufferedStorage::grow).
+ */
+template<class Config>
+inline uint32_t WtfsEcosystem<Config>::WtfsMain::bind(Buffers* buffers, uint32_t count) {
+	uint32_t ret = buffers->template grow<Allocator>(count);
+	bind(buffers);
+	return ret;
+}
+
+/**
+ * Tells whether a page read in during the mount is erased, based on the
+ * field of the page meta that is always written for the given level.
+ */
+template<class Config>
+inline bool WtfsEcosystem<Config>::WtfsMain::isPageErased(typename Buffers::Buffer* buff, int32_t level)
+{
+	typedef typename MetaStore::Page Page;
+	return ((level >= 0) ? ((Page*)buff)->meta.sequenceNumber : ((Page*)buff)->meta.id) == -1u;
+}
+
+/**
+ * Finds the number of pages written in a block that has its first page written
+ * and its last page erased, by a binary search (the pages are written in order).
+ */
+template<class Config>
+inline uint32_t WtfsEcosystem<Config>::WtfsMain::countWrittenPages(uint32_t block, int32_t level)
+{
+	uint32_t bottom = 1, top = FlashDriver::blockSize - 1;
+
+	while(bottom < top) {
+		const uint32_t offset = (bottom + top) / 2;
+		typename Buffers::Buffer* buff = this->buffers->find(block * FlashDriver::blockSize + offset);
+
+		if(isPageErased(buff, level))
+			top = offset;
+		else
+			bottom = offset + 1;
+
+		this->buffers->release(buff, Clean);
+	}
+
+	return bottom;
+}
+
 template<class Config>
 inline pet::GenericError WtfsEcosystem<Config>::WtfsMain::initialize(bool purge)
 {
@@ -32,6 +90,9 @@ inline pet::GenericError WtfsEcosystem<Config>::WtfsMain::initialize(bool purge)
 	typedef typename Buffers::Buffer Buffer;
 	typedef typename MetaStore::Page Page;
 
+	gcVictim = -1;
+	openSummaries.reset();
+
 	if(purge) {
 		this->Manager::initWithDefaultAssignment();
 		return 0;
@@ -40,72 +101,76 @@ inline pet::GenericError WtfsEcosystem<Config>::WtfsMain::initialize(bool purge)
 		uint32_t maxSequenceCounter = 0;
 		Address root = FlashDriver::InvalidAddress;
 
+		/*
+		 * The partially written blocks are taken as the allocation heads, the first one of a level
+		 * as the normal and the second one of a file level as the hot one. The usage counters of
+		 * these are set to the number of their erased pages first (those are not garbage, they
+		 * get written later), then the pages referenced by the trees are added to them.
+		 */
+		this->resetHotHeads();
+		this->resetEraseCounts();
+
 		for(uint32_t i=0; i<FlashDriver::deviceSize; i++) {
 			Address page = i * FlashDriver::blockSize;
 			Buffer* buff = this->buffers->find(page);
 
+			this->restoreEraseCount(i, buff->data.eraseCount);
+			this->usageCounters[i] = 0;
+
 			int32_t level = (int32_t)buff->data.level;
 			uint32_t index = this->levelToIndex(level);
 
-			if(this->indexOk(index) && (this->levelAllocations[index].currentAddress == -1u)) {
-				if(level >= 0) {
-						Address endPage = page + FlashDriver::blockSize;
-						while(1) {
-							uint32_t sequenceCount = ((Page*)buff)->meta.sequenceNumber;
+			if(!this->indexOk(index)) {
+				this->buffers->release(buff, Clean);
+				continue;
+			}
 
-							if(sequenceCount == -1u) {
-								this->levelAllocations[this->levelToIndex(level)].currentAddress = i;
-								this->levelAllocations[this->levelToIndex(level)].usedCount = page - i * FlashDriver::blockSize;
-								break;
-							}
+			typename Manager::AllocationState &head = this->levelAllocations[index];
 
-							if(sequenceCount > maxSequenceCounter) {
-								root = page;
-								maxSequenceCounter = sequenceCount;
-								rootLevel = level;
-							}
+			if(level >= 0 && head.currentAddress == -1u) {
+				Address endPage = page + FlashDriver::blockSize;
+				while(1) {
+					uint32_t sequenceCount = ((Page*)buff)->meta.sequenceNumber;
 
-							if(++page == endPage)
-								break;
-
-							this->buffers->release(buff, Clean);
-							buff = this->buffers->find(page);
-						}
-				} else if(((Page*)buff)->meta.id != -1u) {
-					this->buffers->release(buff, Clean);
-					buff = this->buffers->find(page + FlashDriver::blockSize - 1);
+					if(sequenceCount == -1u) {
+						head.currentAddress = i;
+						head.usedCount = page - i * FlashDriver::blockSize;
+						this->usageCounters[i] = FlashDriver::blockSize - head.usedCount;
+						break;
+					}
 
-					if(((Page*)buff)->meta.id == -1u) {
-						this->buffers->release(buff, Clean);
-						this->levelAllocations[this->levelToIndex(level)].currentAddress = i;
-						uint32_t bottom=1, top=FlashDriver::blockSize-2;
+					if(sequenceCount > maxSequenceCounter) {
+						root = page;
+						maxSequenceCounter = sequenceCount;
+						rootLevel = level;
+					}
 
-						do{
-							uint32_t offset = (bottom + top + 1) / 2;
+					if(++page == endPage)
+						break;
 
-							buff = this->buffers->find(page + offset);
-							if(((Page*)buff)->meta.id == -1u)
-								top = offset-1;
-							else
-								bottom = offset;
+					this->buffers->release(buff, Clean);
+					buff = this->buffers->find(page);
+				}
 
-							if(bottom == top)
-								break;
+				this->buffers->release(buff, Clean);
+			} else if(!isPageErased(buff, level)) {
+				this->buffers->release(buff, Clean);
+				buff = this->buffers->find(page + FlashDriver::blockSize - 1);
+				const bool partial = isPageErased(buff, level);
+				this->buffers->release(buff, Clean);
 
-							this->buffers->release(buff, Clean);
-						}while(1);
+				typename Manager::AllocationState *state = (head.currentAddress == -1u) ? &head
+						: (level < 0 && this->hotAllocations[index].currentAddress == -1u) ? &this->hotAllocations[index] : 0;
 
-						this->levelAllocations[this->levelToIndex(level)].usedCount = bottom + 1;
-					}
+				if(partial && state) {
+					state->currentAddress = i;
+					state->usedCount = countWrittenPages(i, level);
+					this->usageCounters[i] = FlashDriver::blockSize - state->usedCount;
 				}
-			}
-
-			this->buffers->release(buff, Clean);
+			} else
+				this->buffers->release(buff, Clean);
 		}
 
-		for(uint32_t i=0; i<FlashDriver::deviceSize; i++)
-			this->usageCounters[i] = 0;
-
 		this->updateCounter = maxSequenceCounter+1;
 		this->root = root;
 		this->levels = rootLevel;
@@ -166,21 +231,15 @@ inline pet::GenericError WtfsEcosystem<Config>::WtfsMain::initialize(bool purge)
 
 		this->closeReadWriteSession(session);
 
+		this->rebuildBlockIndex();
+
 		for(uint32_t i=0; i<Manager::maxLevels; i++) {
 			if(this->levelAllocations[i].currentAddress == -1u) {
 				this->levelAllocations[i].currentAddress = this->findFree();
 				this->levelAllocations[i].usedCount = 0;
-			} else {
-				this->usageCounters[this->levelAllocations[i].currentAddress] +=
-						FlashDriver::blockSize - this->levelAllocations[i].usedCount;
 			}
 		}
 
-		this->spareCount = 0;
-		for(uint32_t i=0; i<FlashDriver::deviceSize; i++)
-			if(this->usageCounters[i] == 0)
-				this->spareCount++;
-
 		this->maxId++;
 
 		if(travRet.failed())
@@ -190,4 +249,49 @@ inline pet::GenericError WtfsEcosystem<Config>::WtfsMain::initialize(bool purge)
 	}
 }
 
+/**
+ * Writes back the dirty buffers and records the hottest pages of the cache, along with
+ * the sequence number of the latest root, at clean unmount or at a checkpoint.
+ */
+template<class Config>
+template<uint32_t n>
+inline void WtfsEcosystem<Config>::WtfsMain::recordWarmUp(WarmUpList<n>& list)
+{
+	this->readerEnter();
+	buffers->flush();
+	list.sequenceNumber = updateCounter - 1;
+	list.count = buffers->getHotPages(list.pages, n);
+	this->readerLeave();
+}
+
+/**
+ * Brings the recorded pages into the cache after mounting, in the background if the
+ * flash driver is queued. Nothing is done if the filesystem has been modified since
+ * the recording. Returns the number of pages warmed up.
+ */
+template<class Config>
+template<uint32_t n>
+inline uint32_t WtfsEcosystem<Config>::WtfsMain::warmUp(const WarmUpList<n>& list)
+{
+	uint32_t ret = 0;
+
+	this->readerEnter();
+
+	if(list.sequenceNumber == updateCounter - 1 && list.count <= n) {
+		/*
+		 * The coldest one goes first, so that the hottest ones are
+		 * the least likely to be evicted if the cache is too small.
+		 */
+		for(uint32_t i = list.count; i--;) {
+			if(list.pages[i] < FlashDriver::deviceSize * FlashDriver::blockSize) {
+				buffers->warm(list.pages[i]);
+				ret++;
+			}
+		}
+	}
+
+	this->readerLeave();
+	return ret;
+}
+
 #endif /* MOUNTIMPL_H_ */
@@ -56,6 +56,7 @@ public:
 	};
 
 	inline void *read(ReadOnlySession& session, Address p);
+	inline void prefetch(ReadOnlySession& session, Address p);
 	inline void release(ReadOnlySession& session, void* p);
 	inline void closeReadOnlySession(ReadOnlySession& session);
 
@@ -141,6 +142,19 @@ struct BlobStorage: public StorageBase<BackendConfig, Allocator, BlobStorage<Bac
 		((Page*) ret)->meta.parentId = ((Node*)this)->key.indexed.parentId;
 		return ret;
 	}
+
+	inline typename Base::Address write(typename Base::ReadWriteSession& session, void* p) {
+		const typename Base::PageMeta meta = ((Page*) p)->meta;
+		const int32_t level = (int32_t)((typename Buffers::Buffer*)p)->data.level;
+
+		Buffers::setTemperature((typename Buffers::Buffer*)p, ((Node*)this)->allocationTemperature());
+		typename Base::Address ret = Base::write(session, p);
+
+		if(ret != Base::InvalidAddress)
+			getFs(this).recordOwner(ret, meta.id, meta.parentId, level);
+
+		return ret;
+	}
 private:
 	friend Base;
 
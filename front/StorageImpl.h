@@ -35,6 +35,9 @@ inline void StorageBase<BackendConfig, Allocator, Child>::checkGc()
 		}
 	}
 
+	if(!fs.isReadonly && !fs.backgroundGc && fs.levelWear().failed())
+		fs.isReadonly = true;
+
 	fs.inGc = false;
 }
 
@@ -120,6 +123,12 @@ void *StorageBase<BackendConfig, Allocator, Child>::read(ReadOnlySession& sessio
 	return Child::getFs(this).buffers->find(p);
 }
 
+template<class BackendConfig, class Allocator, class Child>
+void StorageBase<BackendConfig, Allocator, Child>::prefetch(ReadOnlySession& session, Address p)
+{
+	Child::getFs(this).buffers->prefetch(p);
+}
+
 template<class BackendConfig, class Allocator, class Child>
 typename StorageBase<BackendConfig, Allocator, Child>::Address
 StorageBase<BackendConfig, Allocator, Child>::write(ReadWriteSession& session, void* p)
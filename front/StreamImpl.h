@@ -28,11 +28,13 @@
 
 template<class Config>
 pet::GenericError
-inline WtfsEcosystem<Config>::WtfsMain::openStream(Node& node, Stream& stream)
+inline WtfsEcosystem<Config>::WtfsMain::openStream(Node& node, Stream& stream, Temperature temperature)
 {
 	if(!node.hasData())
 		return pet::GenericError::isDirectoryError();
 
+	reclaimStreamBuffers();
+
 	nodeListLock.lock();
 	Node* openedNode = openNodes.findByFields(node.key.id, &Node::key, &FullKey::id);
 
@@ -45,14 +47,53 @@ inline WtfsEcosystem<Config>::WtfsMain::openStream(Node& node, Stream& stream)
 
 	stream.initialize(&node);
 
+	pet::GenericError ret = 0;
+
 	if(node.referenceCount == 1) {
 		openNodes.add(&node);
 		nodeListLock.unlock();
-		return this->get(node.key, node);
-	}
+		ret = this->get(node.key, node);
+	} else
+		nodeListLock.unlock();
 
-	nodeListLock.unlock();
-	return 0;
+	if(!ret.failed() && temperature != Auto)
+		node.temperature = temperature;
+
+	return ret;
+}
+
+/**
+ * Writes back the buffers of idle streams while there are only a few buffers left to be
+ * used (dirty buffers can not be simply dropped like clean ones). Called without holding
+ * any locks, before operations that may need to claim more buffers.
+ *
+ * If the write back fails, the error is reported by the next operation on the stream. If
+ * the stream still has its data then (nothing was written), it keeps the buffer as well.
+ */
+template<class Config>
+inline void WtfsEcosystem<Config>::WtfsMain::reclaimStreamBuffers()
+{
+	typename Buffers::Lease* lease;
+
+	while(buffers->getAvailableCount() <= Config::minFreeBuffers && (lease = buffers->takeDirtyLease())) {
+		Stream* stream = (Stream*)lease->owner;
+
+		WtfsTrace::info << "writing back idle stream of node " << stream->node->key.id << "\n";
+
+		pet::GenericError ret = stream->flushBuffer();
+
+		if(ret.failed()) {
+			WtfsTrace::warn << "failed to write back idle stream\n";
+			stream->pendingError = ret;
+
+			if(stream->buffer) {
+				buffers->returnLease(lease, false);
+				break;
+			}
+		}
+
+		buffers->returnLease(lease);
+	}
 }
 
 template<class Config>
@@ -99,25 +140,47 @@ inline WtfsEcosystem<Config>::WtfsMain::closeStream(Stream& stream)
 
 template<class Config>
 inline WtfsEcosystem<Config>::WtfsMain::Stream::Stream():
-	node(0), page(0), offset(0), buffer(0), written(false) {}
+	node(0), page(0), offset(0), nextPage(0), readAhead(0), buffer(0), written(false), parked(false), pendingError(0) {
+	lease.owner = this;
+}
 
 template<class Config>
 inline void WtfsEcosystem<Config>::WtfsMain::Stream::initialize(Node* node) {
 	this->node = node;
 	written = false;
+	parked = false;
+	pendingError = 0;
 	buffer = 0;
 	offset = 0;
 	page = 0;
+	nextPage = 0;
+	readAhead = 0;
 }
 
 template<class Config>
 pet::GenericError
-WtfsEcosystem<Config>::WtfsMain::Stream::fetchPage()
+WtfsEcosystem<Config>::WtfsMain::Stream::fetchPage(bool reading)
 {
 	if(getPosition() > node->getSize())
 		return pet::GenericError::invalidSeekError();
 
-	pet::FailPointer<void> ret = node->read(page);
+	/*
+	 * The read ahead window is doubled for every page of a sequential
+	 * read, up to the configured maximum, and dropped on a seek.
+	 */
+	if(reading) {
+		if(page == nextPage)
+			readAhead = readAhead ? readAhead * 2 : 1;
+		else
+			readAhead = 0;
+
+		if(readAhead > Config::maxReadAhead)
+			readAhead = Config::maxReadAhead;
+
+		nextPage = page + 1;
+	}
+
+	pet::FailPointer<void> ret = node->read(page, reading ? readAhead : 0);
 
 	if(ret.failed())
 		return pet::GenericError::readError();
@@ -126,14 +189,66 @@ WtfsEcosystem<Config>::WtfsMain::Stream::fetchPage()
 	return 0;
 }
 
+/**
+ * Lets the filesystem take the buffer held by the stream while it is idle (as the pool can
+ * run out of buffers if many streams are open). The pointers returned by _read_ and _write_
+ * can not be used after this, the buffer is fetched again (or written back before it is
+ * taken) as needed by the next access.
+ */
+template<class Config>
+inline void WtfsEcosystem<Config>::WtfsMain::Stream::park()
+{
+	if(buffer && !parked) {
+		node->fs->buffers->lease(&lease, (typename Buffers::Buffer*)buffer, written);
+		parked = true;
+	}
+}
+
+/**
+ * Takes back the parked buffer, returns the error of writing it back if that failed meanwhile.
+ */
+template<class Config>
+inline pet::GenericError WtfsEcosystem<Config>::WtfsMain::Stream::resume()
+{
+	if(parked) {
+		parked = false;
+
+		if(!node->fs->buffers->resume(&lease))
+			buffer = 0;
+	}
+
+	if(pendingError.failed()) {
+		pet::GenericError ret = pendingError;
+		pendingError = 0;
+		return ret.rethrow();
+	}
+
+	return 0;
+}
+
 template<class Config>
 pet::GenericError
 WtfsEcosystem<Config>::WtfsMain::Stream::flush()
+{
+	pet::GenericError ret = resume();
+
+	if(ret.failed())
+		return ret.rethrow();
+
+	return flushBuffer();
+}
+
+template<class Config>
+pet::GenericError
+WtfsEcosystem<Config>::WtfsMain::Stream::flushBuffer()
 {
 	if(written) {
 		if(node->fs->isReadonly)
 			return pet::GenericError::readOnlyFsError();
 
+		if(page * BlobStore::pageSize < node->getSize())
+			node->countRewrite();
+
 		node->dirty = true;
 		pet::GenericError ret = node->update(page, getPosition(), buffer);
 		buffer = 0;
@@ -151,8 +266,13 @@ template<class Config>
 pet::GenericError
 WtfsEcosystem<Config>::WtfsMain::Stream::access(void* &content, uint32_t size, bool reading)
 {
+	pet::GenericError res = resume();
+
+	if(res.failed())
+		return res.rethrow();
+
 	if(offset == BlobStore::pageSize) {
-		pet::GenericError ret = flush();
+		pet::GenericError ret = flushBuffer();
 
 		if(ret.failed())
 			return ret.rethrow();
@@ -176,6 +296,8 @@ WtfsEcosystem<Config>::WtfsMain::Stream::access(void* &content, uint32_t size, b
 		size = spaceLeft;
 
 	if(!buffer) {
+		node->fs->reclaimStreamBuffers();
+
 		if(getPosition() == node->getSize() && offset == 0) {
 			if(node->fs->isReadonly)
 				return pet::GenericError::readOnlyFsError();
@@ -187,7 +309,7 @@ WtfsEcosystem<Config>::WtfsMain::Stream::access(void* &content, uint32_t size, b
 
 			buffer = ret;
 		} else {
-			pet::GenericError ret = fetchPage();
+			pet::GenericError ret = fetchPage(reading);
 
 			if(ret.failed())
 				return ret.rethrow();
@@ -264,9 +386,14 @@ WtfsEcosystem<Config>::WtfsMain::Stream::setPosition(Whence whence, int32_t offs
 	const uint32_t oldPage = page;
 	const uint32_t newPage = newPosition / BlobStore::pageSize;
 
+	pet::GenericError res = resume();
+
+	if(res.failed())
+		return res.rethrow();
+
 	if(buffer) {
 		if(written) {
-			pet::GenericError ret = flush();
+			pet::GenericError ret = flushBuffer();
 
 			if(ret.failed())
 				return ret.rethrow();
@@ -43,6 +43,7 @@
 
 #include "MetaKeys.h"
 #include "Storage.h"
+#include "BlockSummary.h"
 #include "ConfigHelpers.h"
 
 class WtfsTrace: public pet::Trace<WtfsTrace> {};
@@ -66,8 +67,9 @@ private:
 	typedef typename Config::Mutex Mutex;
 	typedef MetaFullKey<Config::maxFilenameLength> FullKey;
 	typedef MetaIndexKey<Config::maxFilenameLength> IndexKey;
-	typedef BufferedStorage<FlashDriver, WtfsMain, Mutex, Config::nBuffers> Buffers;
-	typedef StorageManager<FlashDriver, Config::maxMeta, Config::maxFile> Manager;
+	typedef BufferedStorage<FlashDriver, WtfsMain, Mutex, Config::nBuffers, typename Config::BufferReplacement, typename Config::SecondaryCache,
+			(Config::maxBuffers > Config::nBuffers) ? Config::maxBuffers : Config::nBuffers> Buffers;
+	typedef StorageManager<FlashDriver, Config::maxMeta, Config::maxFile, Config> Manager;
 	typedef MetaStorage<FlashDriver, Allocator, WtfsMain, Buffers> MetaStore;
 	typedef BlobStorage<FlashDriver, Allocator, WtfsMain, Buffers, Node> BlobStore;
 	typedef BTree<MetaStore, FullKey, IndexKey, FileTree, Allocator> MetaTree;
@@ -93,9 +95,15 @@ private:
 		FullKey key;
 		WtfsMain* fs;
 		bool dirty;
+		uint8_t temperature = 0;
+		uint16_t rewrites = 0;
 
 		Node* next = (Node*)-1u;
 		uint32_t referenceCount = 0;
+
+		inline uint8_t allocationTemperature();
+		inline void countRewrite();
+		inline void resetTemperature(uint8_t temperature = 0);
 	public:
 		inline Node(): fs(0), dirty(false), next(0) {key.id=-1u;}
 		inline void getName(const char*&, const char*&);
@@ -111,6 +119,8 @@ public:
 		template<class BackendConfig, class Allocator, class Child>
 		friend class StorageBase;
 		friend MetaStore;
+		friend BlobStore;
+		friend WtfsEcosystem::Node;
 
 		class Stream;
 		typedef typename WtfsEcosystem::NodeId NodeId;
@@ -118,7 +128,27 @@ public:
 		typedef typename MetaTree::Table MetaTable ;
 		typedef typename MetaTree::Element MetaElement ;
 
+		/**
+		 * Expected lifetime of the contents of a file, used for putting data that is
+		 * likely to be overwritten soon in different blocks than the long lived data.
+		 */
+		enum Temperature {
+			Auto, Cold, Hot
+		};
+
 		Buffers *buffers = 0;
+
+		/**
+		 * Addresses of the most valuable cached pages, along with the sequence number of the
+		 * latest root, to be stored by the application (in backup RAM, a separate flash area,
+		 * EEPROM or the like) and used for warming up the cache after the next mount.
+		 */
+		template<uint32_t n>
+		struct WarmUpList {
+			uint32_t sequenceNumber = 0;
+			uint32_t count = 0;
+			typename FlashDriver::Address pages[n];
+		};
 	private:
 		Mutex maxIdLock;
 		uint32_t maxId = 1;
@@ -127,30 +157,52 @@ public:
 		Mutex nodeListLock;
 		pet::LinkedList<Node> openNodes;
 		bool inGc = false;
+		bool backgroundGc = false;		// Set once the background gc is used, which then does the wear leveling too.
+		int32_t gcVictim = -1;			// Block being freed up by the background gc steps,
+		int32_t gcVictimLevel;			// the level of its data,
+		uint32_t gcVictimEraseCount;	// its erase count when selected (it is reused if that changes),
+		uint32_t gcNextPage;			// and the next page of it to be looked at.
 		bool isReadonly = false;
 		WtfsEcosystem::Node tempNode;
 
+		typedef BlockSummary<FlashDriver::blockSize> Summary;
+		OpenBlockSummaries<FlashDriver::blockSize, Config::blockSummary ? 2 * Config::maxFile : 0> openSummaries;
+
 		template<bool isDir>
 		inline pet::GenericError addNew(Node&, const char*, const char*);
 
 		inline pet::GenericError moveAroundMetaPages(typename FlashDriver::Address const page, uint32_t usedPages);
 		inline pet::GenericError moveAroundBlobPages(typename FlashDriver::Address const page, uint32_t usedPages);
+		inline pet::GenericError moveBlobPage(typename FlashDriver::Address const page);
+		inline pet::GenericError moveMetaPage(typename FlashDriver::Address const page);
 		inline pet::GenericError collectGarbage();
+		inline pet::GenericError evacuateBlock(uint32_t block, uint32_t usedPages);
+		inline pet::GenericError levelWear();
+		inline void reclaimStreamBuffers();
+		inline void recordOwner(typename FlashDriver::Address page, NodeId id, NodeId parentId, int32_t level);
+		inline bool fetchSummary(uint32_t block, Summary& summary);
+		inline bool isPageErased(typename Buffers::Buffer* buff, int32_t level);
+		inline uint32_t countWrittenPages(uint32_t block, int32_t level);
 	protected:
 		inline pet::GenericError fetchById(Node& node, NodeId parent, NodeId id);
 	public:
 		inline void bind(Buffers*);
+		inline uint32_t bind(Buffers*, void* region, uint32_t size);
+		inline uint32_t bind(Buffers*, uint32_t count);
 		pet::GenericError initialize(bool purge=false);
+		template<uint32_t n> inline void recordWarmUp(WarmUpList<n>&);
+		template<uint32_t n> inline uint32_t warmUp(const WarmUpList<n>&);
 		pet::GenericError fetchRoot(Node&);
 		pet::GenericError fetchChildByName(Node&, const char*, const char* = 0);
 		pet::GenericError fetchChildById(Node&, NodeId);
 		pet::GenericError fetchFirstChild(Node&);
 		pet::GenericError fetchNextSibling(Node&);
 		pet::GenericError newDirectory(Node&, const char*, const char*);
-		pet::GenericError newFile(Node&, const char*, const char*);
+		pet::GenericError newFile(Node&, const char*, const char*, Temperature = Auto);
 		pet::GenericError removeNode(Node&);
+		pet::GenericError collectGarbageStep(uint32_t pageBudget);
 
-		pet::GenericError openStream(Node&, Stream&);
+		pet::GenericError openStream(Node&, Stream&, Temperature = Auto);
 		pet::GenericError flushStream(Stream&);
 		pet::GenericError closeStream(Stream&);
 
@@ -158,11 +210,16 @@ public:
 		private:
 			Node *node;
 			uint32_t page, offset;
+			uint32_t nextPage, readAhead;
 			void *buffer;
-			bool written;
+			bool written, parked;
+			typename Buffers::Lease lease;
+			pet::GenericError pendingError;		// Of writing back the parked buffer.
 
-			pet::GenericError fetchPage();
+			pet::GenericError fetchPage(bool reading);
 			pet::GenericError access(void* &content, uint32_t size, bool reading);
+			pet::GenericError flushBuffer();
+			inline pet::GenericError resume();
 
 			friend WtfsMain;
 			inline void initialize(Node *tree);
@@ -177,6 +234,7 @@ public:
 			pet::GenericError write(void* &content, uint32_t size);
 			pet::GenericError setPosition(Whence whence, int32_t offset);
 			pet::GenericError flush();
+			inline void park();
 
 			inline uint32_t getPosition();
 			inline uint32_t getSize();
@@ -206,6 +264,10 @@ struct WtfsTestHelper {
 		typename WtfsTestHelper<Config>::BlobStore::ReadWriteSession session(&node);
 		return node.traverse(session, c);
 	}
+
+	static uint8_t allocationTemperature(Node &node) {
+		return node.allocationTemperature();
+	}
 };
 
 
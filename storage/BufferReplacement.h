@@ -0,0 +1,513 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2016, 2017 Seller Tamás. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *******************************************************************************/
+
+#ifndef BUFFERREPLACEMENT_H_
+#define BUFFERREPLACEMENT_H_
+
+#include <cstdint>
+
+/*
+ * Replacement policies for the BufferedStorage.
+ *
+ * A policy is a class with a _BufferData_ member type, that is stored along with the
+ * management data of each buffer, and a _Policy_ member template that keeps track of
+ * the evictable buffers (the ones that are not used nor transferred currently). The
+ * storage calls its methods with its mutex held:
+ *
+ *  - _add_ when a buffer becomes evictable,
+ *  - _remove_ when an evictable buffer is claimed, or is going to be written back,
+ *  - _pick_ to select (but not remove) the next buffer to be evicted, if _cleanOnly_ is
+ *    set only buffers that can be reused without writing them back can be selected,
+ *  - _reuse_ when a buffer is about to be reused for another page (with the old
+ *    address still in place),
+ *  - _setCapacity_ when buffers are added to or removed from the pool at run-time (the
+ *    _nBuffers_ template parameter is the maximal amount, used for static sizing).
+ *
+ * The policies link the buffers through the _prev_ and _next_ fields of their management
+ * data, and the address of a buffer must not change while it is evictable.
+ */
+
+/**
+ * Intrusive doubly linked list of buffers.
+ */
+template <class Buffer>
+struct BufferList {
+	Buffer *first = 0, *last = 0;
+	uint32_t count = 0;
+
+	inline void pushFront(Buffer* buff);
+	inline void pushBack(Buffer* buff);
+	inline void remove(Buffer* buff);
+};
+
+/**
+ * Least recently used first, with a preference for clean buffers.
+ *
+ * Clean and dirty buffers are kept on separate lists, the least recently used clean
+ * one is evicted unless the least recently used dirty one is much older than that.
+ */
+struct LruReplacement {
+	struct BufferData {};
+
+	template <class FlashDriver, class Buffer, uint32_t nBuffers>
+	class Policy {
+		BufferList<Buffer> clean, dirty;
+	public:
+		inline void add(Buffer* buff);
+		inline void remove(Buffer* buff);
+		inline Buffer* pick(uint32_t accessCounter, bool cleanOnly);
+		inline void reuse(Buffer*, typename FlashDriver::Address) {}
+		inline void setCapacity(uint32_t) {}
+	};
+};
+
+/**
+ * Scan resistant two queue (2Q) replacement.
+ *
+ * Pages read in for the first time are put on a short probationary queue, which is
+ * evicted from first as long as it has more than a quarter of the buffers. Pages that
+ * are re-read shortly after being evicted from there (the addresses of the last twice
+ * as many evicted pages as the maximal number of buffers are remembered) are put on the main queue. So a long sequential read only
+ * churns through the probationary queue, instead of flushing out the frequently
+ * used pages (ie. the upper levels of the trees).
+ */
+struct TwoQueueReplacement {
+	struct BufferData {
+		bool frequent = false;
+	};
+
+	template <class FlashDriver, class Buffer, uint32_t nBuffers>
+	class Policy {
+		typedef typename FlashDriver::Address Address;
+
+		static constexpr uint32_t historySize = 2 * nBuffers;
+
+		uint32_t recentQuota = 1;
+
+		BufferList<Buffer> empty, recent, frequent;
+		Address history[historySize];
+		uint32_t historyNext = 0;
+
+		inline BufferList<Buffer>& listOf(Buffer* buff);
+	public:
+		inline Policy();
+		inline void add(Buffer* buff);
+		inline void remove(Buffer* buff);
+		inline Buffer* pick(uint32_t accessCounter, bool cleanOnly);
+		inline void reuse(Buffer* buff, Address addr);
+		inline void setCapacity(uint32_t n);
+	};
+};
+
+/**
+ * Tree level aware replacement.
+ *
+ * Index pages (the ones with a meta tree level above zero, or a blob tree level below
+ * minus one) are kept separately from the leaves, user data and empty buffers. As long
+ * as the unused index pages take up at most _indexPercent_ of the buffers, the other
+ * ones are evicted first, so the upper levels of the trees stay resident while user data churns
+ * through the rest. Both groups are managed by an instance of the _Base_ policy.
+ */
+template <class Base = LruReplacement, uint32_t indexPercent = 50>
+struct LevelAwareReplacement {
+	struct BufferData: Base::BufferData {
+		bool index = false;
+	};
+
+	template <class FlashDriver, class Buffer, uint32_t nBuffers>
+	class Policy {
+		typedef typename Base::template Policy<FlashDriver, Buffer, nBuffers> Group;
+
+		Group index, other;
+		uint32_t indexCount = 0, indexQuota = nBuffers * indexPercent / 100;
+
+		static inline bool isIndex(Buffer* buff) {
+			int32_t level = (int32_t)buff->data.level;
+			return buff->management.address != FlashDriver::InvalidAddress && (level > 0 || level < -1);
+		}
+
+		inline Group& groupOf(Buffer* buff) {
+			return buff->management.replacement.index ? index : other;
+		}
+	public:
+		inline void add(Buffer* buff);
+		inline void remove(Buffer* buff);
+		inline Buffer* pick(uint32_t accessCounter, bool cleanOnly);
+		inline void reuse(Buffer* buff, typename FlashDriver::Address addr) {
+			groupOf(buff).reuse(buff, addr);
+		}
+
+		inline void setCapacity(uint32_t n) {
+			indexQuota = n * indexPercent / 100;
+			index.setCapacity(n);
+			other.setCapacity(n);
+		}
+	};
+};
+
+/**
+ * Partitioned replacement for meta tree, file index and file data pages.
+ *
+ * Each partition (determined by the level of the pages) has a guaranteed minimum share
+ * of the buffers, given in percents. Buffers that are not needed by a partition can be
+ * borrowed by the others, but those are taken back first: the victim is chosen from the
+ * partition that holds the most buffers above its guaranteed minimum (file data first). So heavy file I/O
+ * can not push the meta tree pages below their minimum. Empty buffers are used first,
+ * and each partition is managed by an instance of the _Base_ policy internally.
+ */
+template <class Base = LruReplacement, uint32_t metaPercent = 25, uint32_t indexPercent = 25, uint32_t dataPercent = 0>
+struct PartitionedReplacement {
+	static_assert(metaPercent + indexPercent + dataPercent <= 100, "Partition minimums exceed the number of buffers");
+
+	enum Partition: uint8_t {
+		Meta, BlobIndex, BlobData, None
+	};
+
+	struct BufferData: Base::BufferData {
+		Partition partition = None;
+	};
+
+	template <class FlashDriver, class Buffer, uint32_t nBuffers>
+	class Policy {
+		typedef typename Base::template Policy<FlashDriver, Buffer, nBuffers> Group;
+
+		Group groups[None + 1];
+		uint32_t resident[None] = {0, 0, 0};
+		uint32_t capacity = nBuffers;
+
+		inline uint32_t minimum(uint32_t partition) {
+			static constexpr uint32_t percents[None] = {metaPercent, indexPercent, dataPercent};
+			return capacity * percents[partition] / 100;
+		}
+
+		static inline Partition partitionOf(Buffer* buff) {
+			if(buff->management.address == FlashDriver::InvalidAddress)
+				return None;
+
+			int32_t level = (int32_t)buff->data.level;
+			return (level >= 0) ? Meta : ((level == -1) ? BlobData : BlobIndex);
+		}
+	public:
+		inline void add(Buffer* buff);
+		inline void remove(Buffer* buff);
+		inline Buffer* pick(uint32_t accessCounter, bool cleanOnly);
+		inline void reuse(Buffer* buff, typename FlashDriver::Address addr);
+		inline void setCapacity(uint32_t n);
+	};
+};
+
+////////////////////////////////////////////////////////////////////////////////////////
+
+template <class Buffer>
+inline void BufferList<Buffer>::pushFront(Buffer* buff) {
+	buff->management.prev = 0;
+	buff->management.next = first;
+
+	if(first)
+		first->management.prev = buff;
+	else
+		last = buff;
+
+	first = buff;
+	count++;
+}
+
+template <class Buffer>
+inline void BufferList<Buffer>::pushBack(Buffer* buff) {
+	buff->management.next = 0;
+	buff->management.prev = last;
+
+	if(last)
+		last->management.next = buff;
+	else
+		first = buff;
+
+	last = buff;
+	count++;
+}
+
+template <class Buffer>
+inline void BufferList<Buffer>::remove(Buffer* buff) {
+	if(buff->management.prev)
+		buff->management.prev->management.next = buff->management.next;
+	else
+		first = buff->management.next;
+
+	if(buff->management.next)
+		buff->management.next->management.prev = buff->management.prev;
+	else
+		last = buff->management.prev;
+
+	buff->management.prev = buff->management.next = 0;
+	count--;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+
+template <class FlashDriver, class Buffer, uint32_t nBuffers>
+inline void LruReplacement::Policy<FlashDriver, Buffer, nBuffers>::add(Buffer* buff) {
+	if(buff->management.address == FlashDriver::InvalidAddress)
+		clean.pushFront(buff);	// Clean, free, empty ones, should definitely be used first
+	else
+		(buff->management.dirty ? dirty : clean).pushBack(buff);
+}
+
+template <class FlashDriver, class Buffer, uint32_t nBuffers>
+inline void LruReplacement::Policy<FlashDriver, Buffer, nBuffers>::remove(Buffer* buff) {
+	(buff->management.dirty ? dirty : clean).remove(buff);
+}
+
+template <class FlashDriver, class Buffer, uint32_t nBuffers>
+inline Buffer* LruReplacement::Policy<FlashDriver, Buffer, nBuffers>::pick(uint32_t accessCounter, bool cleanOnly)
+{
+	Buffer *leastRecentClean = clean.first, *leastRecentDirty = dirty.first;
+
+	if(cleanOnly)
+		return leastRecentClean;
+
+	uint32_t leastRecentCleanCount = 0, leastRecentDirtyCount = 0;
+
+	if(leastRecentClean) {
+		if(leastRecentClean->management.address == FlashDriver::InvalidAddress)
+			leastRecentCleanCount = -1u;
+		else
+			leastRecentCleanCount = accessCounter - leastRecentClean->management.accessCounter;
+	}
+
+	if(leastRecentDirty)
+		leastRecentDirtyCount = accessCounter - leastRecentDirty->management.accessCounter;
+
+	if(leastRecentDirty != 0 && leastRecentCleanCount * 2 < leastRecentDirtyCount)
+		return leastRecentDirty;
+
+	return leastRecentClean ? leastRecentClean : leastRecentDirty;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+
+template <class FlashDriver, class Buffer, uint32_t nBuffers>
+inline TwoQueueReplacement::Policy<FlashDriver, Buffer, nBuffers>::Policy() {
+	setCapacity(nBuffers);
+
+	for(uint32_t i = 0; i < historySize; i++)
+		history[i] = FlashDriver::InvalidAddress;
+}
+
+template <class FlashDriver, class Buffer, uint32_t nBuffers>
+inline BufferList<Buffer>& TwoQueueReplacement::Policy<FlashDriver, Buffer, nBuffers>::listOf(Buffer* buff) {
+	if(buff->management.address == FlashDriver::InvalidAddress)
+		return empty;
+
+	return buff->management.replacement.frequent ? frequent : recent;
+}
+
+template <class FlashDriver, class Buffer, uint32_t nBuffers>
+inline void TwoQueueReplacement::Policy<FlashDriver, Buffer, nBuffers>::add(Buffer* buff) {
+	if(buff->management.address == FlashDriver::InvalidAddress)
+		empty.pushFront(buff);
+	else
+		listOf(buff).pushBack(buff);
+}
+
+template <class FlashDriver, class Buffer, uint32_t nBuffers>
+inline void TwoQueueReplacement::Policy<FlashDriver, Buffer, nBuffers>::remove(Buffer* buff) {
+	listOf(buff).remove(buff);
+}
+
+template <class FlashDriver, class Buffer, uint32_t nBuffers>
+inline Buffer* TwoQueueReplacement::Policy<FlashDriver, Buffer, nBuffers>::pick(uint32_t, bool cleanOnly)
+{
+	if(empty.first)
+		return empty.first;
+
+	BufferList<Buffer> *preferred = &frequent, *other = &recent;
+
+	if(recent.count > recentQuota || !frequent.first) {
+		preferred = &recent;
+		other = &frequent;
+	}
+
+	if(preferred->first && (!cleanOnly || !preferred->first->management.dirty))
+		return preferred->first;
+
+	if(other->first && (!cleanOnly || !other->first->management.dirty))
+		return other->first;
+
+	return 0;
+}
+
+template <class FlashDriver, class Buffer, uint32_t nBuffers>
+inline void TwoQueueReplacement::Policy<FlashDriver, Buffer, nBuffers>::reuse(Buffer* buff, Address addr)
+{
+	bool wasFrequent = buff->management.replacement.frequent;
+	buff->management.replacement.frequent = false;
+
+	if(addr != FlashDriver::InvalidAddress) {
+		for(uint32_t i = 0; i < historySize; i++) {
+			if(history[i] == addr) {
+				history[i] = FlashDriver::InvalidAddress;
+				buff->management.replacement.frequent = true;
+				break;
+			}
+		}
+	}
+
+	if(!wasFrequent && buff->management.address != FlashDriver::InvalidAddress) {
+		history[historyNext] = buff->management.address;
+		historyNext = (historyNext + 1) % historySize;
+	}
+}
+
+template <class FlashDriver, class Buffer, uint32_t nBuffers>
+inline void TwoQueueReplacement::Policy<FlashDriver, Buffer, nBuffers>::setCapacity(uint32_t n) {
+	recentQuota = (n / 4) ? (n / 4) : 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+
+template <class Base, uint32_t indexPercent>
+template <class FlashDriver, class Buffer, uint32_t nBuffers>
+inline void LevelAwareReplacement<Base, indexPercent>::Policy<FlashDriver, Buffer, nBuffers>::add(Buffer* buff)
+{
+	buff->management.replacement.index = isIndex(buff);
+
+	if(buff->management.replacement.index)
+		indexCount++;
+
+	groupOf(buff).add(buff);
+}
+
+template <class Base, uint32_t indexPercent>
+template <class FlashDriver, class Buffer, uint32_t nBuffers>
+inline void LevelAwareReplacement<Base, indexPercent>::Policy<FlashDriver, Buffer, nBuffers>::remove(Buffer* buff)
+{
+	if(buff->management.replacement.index)
+		indexCount--;
+
+	groupOf(buff).remove(buff);
+}
+
+template <class Base, uint32_t indexPercent>
+template <class FlashDriver, class Buffer, uint32_t nBuffers>
+inline Buffer* LevelAwareReplacement<Base, indexPercent>::Policy<FlashDriver, Buffer, nBuffers>::pick(uint32_t accessCounter, bool cleanOnly)
+{
+	Group *preferred = &other, *fallback = &index;
+
+	if(indexCount > indexQuota) {
+		preferred = &index;
+		fallback = &other;
+	}
+
+	if(Buffer* ret = preferred->pick(accessCounter, cleanOnly))
+		return ret;
+
+	return fallback->pick(accessCounter, cleanOnly);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+
+template <class Base, uint32_t metaPercent, uint32_t indexPercent, uint32_t dataPercent>
+template <class FlashDriver, class Buffer, uint32_t nBuffers>
+inline void PartitionedReplacement<Base, metaPercent, indexPercent, dataPercent>::
+Policy<FlashDriver, Buffer, nBuffers>::add(Buffer* buff)
+{
+	/*
+	 * The partition of a buffer is determined when it becomes unused after
+	 * getting its contents, and it is kept while it is used again later, so
+	 * the resident counts include most of the used buffers too.
+	 */
+	Partition old = buff->management.replacement.partition, current = partitionOf(buff);
+
+	if(old != current) {
+		if(old != None)
+			resident[old]--;
+
+		if(current != None)
+			resident[current]++;
+
+		buff->management.replacement.partition = current;
+	}
+
+	groups[current].add(buff);
+}
+
+template <class Base, uint32_t metaPercent, uint32_t indexPercent, uint32_t dataPercent>
+template <class FlashDriver, class Buffer, uint32_t nBuffers>
+inline void PartitionedReplacement<Base, metaPercent, indexPercent, dataPercent>::
+Policy<FlashDriver, Buffer, nBuffers>::remove(Buffer* buff)
+{
+	groups[buff->management.replacement.partition].remove(buff);
+}
+
+template <class Base, uint32_t metaPercent, uint32_t indexPercent, uint32_t dataPercent>
+template <class FlashDriver, class Buffer, uint32_t nBuffers>
+inline Buffer* PartitionedReplacement<Base, metaPercent, indexPercent, dataPercent>::
+Policy<FlashDriver, Buffer, nBuffers>::pick(uint32_t accessCounter, bool cleanOnly)
+{
+	if(Buffer* ret = groups[None].pick(accessCounter, cleanOnly))
+		return ret;
+
+	Buffer* ret = 0;
+	uint32_t maxExcess = 0;
+
+	for(uint32_t i = None; i--;) {
+		if(resident[i] > minimum(i) && resident[i] - minimum(i) > maxExcess) {
+			if(Buffer* candidate = groups[i].pick(accessCounter, cleanOnly)) {
+				ret = candidate;
+				maxExcess = resident[i] - minimum(i);
+			}
+		}
+	}
+
+	/*
+	 * If none of the partitions has more than its minimum (with
+	 * buffers to spare) the file data is sacrificed first.
+	 */
+	for(uint32_t i = None; !ret && i--;)
+		ret = groups[i].pick(accessCounter, cleanOnly);
+
+	return ret;
+}
+
+template <class Base, uint32_t metaPercent, uint32_t indexPercent, uint32_t dataPercent>
+template <class FlashDriver, class Buffer, uint32_t nBuffers>
+inline void PartitionedReplacement<Base, metaPercent, indexPercent, dataPercent>::
+Policy<FlashDriver, Buffer, nBuffers>::reuse(Buffer* buff, typename FlashDriver::Address addr)
+{
+	Partition old = buff->management.replacement.partition;
+	groups[old].reuse(buff, addr);
+
+	if(old != None)
+		resident[old]--;
+
+	buff->management.replacement.partition = None;
+}
+
+template <class Base, uint32_t metaPercent, uint32_t indexPercent, uint32_t dataPercent>
+template <class FlashDriver, class Buffer, uint32_t nBuffers>
+inline void PartitionedReplacement<Base, metaPercent, indexPercent, dataPercent>::
+Policy<FlashDriver, Buffer, nBuffers>::setCapacity(uint32_t n)
+{
+	capacity = n;
+
+	for(uint32_t i = 0; i <= None; i++)
+		groups[i].setCapacity(n);
+}
+
+#endif /* BUFFERREPLACEMENT_H_ */
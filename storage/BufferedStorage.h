@@ -21,17 +21,120 @@
 #define BUFFEREDSTORAGE_H_
 
 #include <cstdint>
+#include <new>
 
 #include "ubiquitous/Error.h"
 #include "ubiquitous/Trace.h"
 
+#include "FlashTransfer.h"
+#include "BufferReplacement.h"
+#include "SecondaryCache.h"
+
 enum BufferReleaseCondition {
 		Dirty, Clean, Purge
 };
 
 class BufferedStorageTrace: public pet::Trace<BufferedStorageTrace> {};
 
-template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers>
+/**
+ * Taking back the allocation of pages that are discarded before being written.
+ *
+ * If the storage manager has an _unallocate_ method, that takes back the last page allocated
+ * for a level (and tells whether it could), a purged dirty page does not become garbage if no
+ * other page is allocated after it, otherwise it is reclaimed as usual.
+ */
+template <class StorageManager>
+class BufferUnallocateHelper {
+	template <class M, class Address>
+	static inline auto unallocate(M* manager, Address addr, int) -> decltype(manager->unallocate(addr)) {
+		return manager->unallocate(addr);
+	}
+
+	template <class M, class Address>
+	static inline bool unallocate(M*, Address, long) {
+		return false;
+	}
+
+public:
+	template <class Address>
+	static inline bool unallocate(StorageManager* manager, Address addr) {
+		return unallocate(manager, addr, 0);
+	}
+};
+
+/**
+ * Passing the temperature of the data to the allocation.
+ *
+ * If the _allocate_ method of the storage manager takes a second argument, the temperature
+ * set for the buffer by _setTemperature_ (zero by default) is passed to it, so that data with
+ * similar lifetimes can be put in the same blocks. It is ignored otherwise.
+ */
+template <class StorageManager>
+class BufferAllocateHelper {
+	template <class M>
+	static inline auto allocate(M* manager, int32_t level, uint8_t temperature, int) -> decltype(manager->allocate(level, temperature)) {
+		return manager->allocate(level, temperature);
+	}
+
+	template <class M>
+	static inline auto allocate(M* manager, int32_t level, uint8_t, long) -> decltype(manager->allocate(level)) {
+		return manager->allocate(level);
+	}
+
+public:
+	static inline auto allocate(StorageManager* manager, int32_t level, uint8_t temperature) -> decltype(allocate(manager, level, temperature, 0)) {
+		return allocate(manager, level, temperature, 0);
+	}
+};
+
+/**
+ * Recording the wear of the blocks in the pages.
+ *
+ * If the storage manager has a _getPageEraseCount_ method, the erase count of the block is stored
+ * along with the data of every page written, so that it can be recovered on mount. It is left as
+ * all ones (like an erased page) otherwise.
+ */
+template <class StorageManager>
+class BufferEraseCountHelper {
+	template <class M, class Address>
+	static inline auto get(M* manager, Address addr, int) -> decltype(manager->getPageEraseCount(addr)) {
+		return manager->getPageEraseCount(addr);
+	}
+
+	template <class M, class Address>
+	static inline uint32_t get(M*, Address, long) {
+		return -1u;
+	}
+
+public:
+	template <class Address>
+	static inline uint32_t get(StorageManager* manager, Address addr) {
+		return get(manager, addr, 0);
+	}
+};
+
+/**
+ * The built-in buffers of the storage, there may be none of them
+ * if all of the buffers are supplied at run-time.
+ */
+
+template <class Buffer, uint32_t n>
+struct BufferArray {
+	Buffer items[n];
+
+	inline Buffer* get() {
+		return items;
+	}
+};
+
+template <class Buffer>
+struct BufferArray<Buffer, 0> {
+	inline Buffer* get() {
+		return 0;
+	}
+};
+
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement = LruReplacement, class SecondaryCache = NoSecondaryCache, uint32_t maxBuffers = nBuffers>
 class BufferedStorage: BufferedStorageTrace {
 public:
 	typedef typename FlashDriver::Address Address;
@@ -42,76 +145,1016 @@ public:
 			storage->storageManager = manager;
 		}
 	};
+
+	struct Buffer;
 private:
 	friend Initializer;
+	typedef FlashTransferHelper<FlashDriver> Driver;
+
+	enum IoState: uint8_t {
+		Idle, Reading, Writing
+	};
+
+	struct Transfer: FlashTransfer<Address> {
+		BufferedStorage* storage;
+	};
+
 	struct ManagementData {
 		Address address = FlashDriver::InvalidAddress;
 		uint32_t accessCounter = 0, usageCounter = 0;
 		bool dirty = false;
+		uint8_t temperature = 0;			// Passed to the allocation of the next page written from the buffer.
+		IoState io = Idle;					// Transfer in progress (done without holding the mutex).
+		Transfer transfer;					// Request used for the transfers of the buffer.
+
+		Buffer *hashNext = 0;				// Next buffer in the same bucket of the address index.
+		Buffer *prev = 0, *next = 0;		// Links used by the replacement policy (only while not used nor transferred).
+		typename Replacement::BufferData replacement;
 
 		inline ManagementData(): address(FlashDriver::InvalidAddress) {}
 	};
 
 public:
+	static_assert(FlashDriver::pageSize > 2 * sizeof(uint32_t), "Page too small for the stored management data");
+	static_assert(maxBuffers >= nBuffers, "The built-in buffers exceed the maximal number of buffers");
+
 	struct StoredData {
-		int8_t user[FlashDriver::pageSize - sizeof(uint32_t)];
+		int8_t user[FlashDriver::pageSize - 2 * sizeof(uint32_t)];
+		uint32_t eraseCount;		// Of the block containing the page when it was written, all ones if unknown (or erased).
 		uint32_t level;
 	};
 
 	static const uint32_t pageSize = sizeof(StoredData::user);
 
 
-	struct Buffer
+	/**
+	 * The stored data comes first, so that the buffer can be found from the pointer handed
+	 * out to the upper layers. If the flash driver specifies an alignment (for DMA and cache
+	 * maintenance) both the data and the management part start on a boundary of that, and
+	 * the buffer is padded to it, so the data shares no cache line with any management data.
+	 */
+	struct alignas(Driver::bufferAlignment) alignas(StoredData) alignas(ManagementData) Buffer
 	{
 		StoredData data;
-		ManagementData management;
+		alignas(Driver::bufferAlignment) alignas(ManagementData) ManagementData management;
+	};
+
+	/**
+	 * Cache hit and miss counts, separately for the pages of the meta tree (non-negative
+	 * levels) and the files (negative levels). The misses served from the second level
+	 * cache (without reading the flash) are counted among the misses too.
+	 */
+	struct Statistics {
+		uint32_t metaHits = 0, metaMisses = 0, metaSecondaryHits = 0;
+		uint32_t blobHits = 0, blobMisses = 0, blobSecondaryHits = 0;
+	};
+
+	/**
+	 * Revocable claim of a buffer, for holders that keep a buffer claimed while being idle (like
+	 * open streams). A clean one is revoked by _find_ if there is no buffer to be evicted, the
+	 * dirty ones can be taken by _takeDirtyLease_, to be written back by the upper layers.
+	 */
+	class Lease {
+		friend BufferedStorage;
+		Buffer* buffer = 0;
+		Lease *prev = 0, *next = 0;
+		bool dirty = false, taken = false;
+	public:
+		void* owner = 0;
 	};
 
 private:
-	uint32_t accessCounter=0;
-	Buffer buffers[nBuffers];
+	static constexpr uint32_t hashSizeFor(uint32_t n, uint32_t size = 1) {
+		return (size >= n) ? size : hashSizeFor(n, size << 1);
+	}
+
+	/**
+	 * A contiguous group of buffers, either the built-in ones or a region added at run-time.
+	 */
+	struct Segment {
+		Segment* next = 0;					// The built-in one is the first, followed by the most recently added one.
+		Buffer* buffers = 0;
+		uint32_t count = 0;
+	};
+
+	static constexpr uint32_t sizingBuffers = maxBuffers ? maxBuffers : 1;	// Static sizing of the index and the policy.
+	static const uint32_t hashSize = hashSizeFor(sizingBuffers);
+
+	uint32_t accessCounter=0, transfersInProgress = 0;
+	uint32_t bufferCount = nBuffers;
+	uint32_t dirtyCount = 0;				// Dirty buffers that are not being written back.
+	uint32_t dirtyHighPercent = 50, dirtyLowPercent = 25;
+	bool writeBackStopped = false;
+	BufferArray<Buffer, nBuffers> builtinBuffers;
+	Segment builtin;
+	Buffer* index[hashSize];
+	typename Replacement::template Policy<FlashDriver, Buffer, sizingBuffers> evictable;
+	typename SecondaryCache::template Cache<FlashDriver> secondary;
+
+	struct LeaseList {
+		Lease *first = 0, *last = 0;
+		uint32_t count = 0;
+
+		inline void pushBack(Lease* lease);
+		inline void remove(Lease* lease);
+	};
+
+	LeaseList cleanLeases, dirtyLeases;
+	uint32_t claimedCount = 0;			// Buffers with a non-zero usage counter.
+	Statistics statistics;
 	StorageManager *storageManager = 0;
 	Mutex mutex;
+
+	inline void initBuffer(Buffer* buff);
+	template <class Action>
+	inline void forEachBuffer(Action&& action);
+	inline uint32_t bufferId(Buffer* buff);
+	inline uint32_t dirtyHigh();
+	inline uint32_t dirtyLow();
+	static inline uint32_t hash(Address addr);
+	inline Buffer* lookup(Address addr);
+	inline void addToIndex(Buffer* buff);
+	inline void removeFromIndex(Buffer* buff);
+	inline void makeEvictable(Buffer* buff);
+	inline void claim(Buffer* buff);
+	inline void unclaim(Buffer* buff);
+	inline bool revokeLease();
+	inline void countAccess(Buffer* buff, bool hit);
+	inline void evict(Buffer* buff, Address addr);
+	inline bool fetchSecondary(Buffer* buff);
+	inline uint64_t hotness(Buffer* buff);
+	inline void prepareTransfer(Buffer* buff, typename Transfer::Operation operation);
+	inline void startTransfer(Buffer* buff, typename Transfer::Operation operation);
+	template <class Key>
+	static inline FlashTransfer<Address>* sortTransfers(FlashTransfer<Address>* list, Key key);
+	inline void submitWrites(FlashTransfer<Address>* list);
+	inline void writeBackInOrder(Buffer* buff);
+	inline void waitAny();
+	inline void waitIo(Buffer* buff);
+	static void transferDone(FlashTransfer<Address>* transfer);
 public:
+	BufferedStorage();
+
+	static constexpr uint32_t regionSize(uint32_t count) {
+		return sizeof(Segment) + alignof(Buffer) - 1 + count * sizeof(Buffer);
+	}
+
+	uint32_t addBuffers(void* region, uint32_t size);
+	void* removeBuffers();
+	template <class Allocator> uint32_t grow(uint32_t count);
+	template <class Allocator> bool shrink();
+	uint32_t getBufferCount();
+	uint32_t attachSecondaryCache(void* region, uint32_t size);
+	void* detachSecondaryCache();
+
 	void flush();
+	void flush(Address addr);
+	bool isWrittenBack(Address addr);
+	void setDirtyWatermarks(uint32_t highPercent, uint32_t lowPercent);
+	uint32_t writeBack();
+	bool waitForWriteBack();
+	void stopWriteBack();
+	void prefetch(Address addr);
+	void warm(Address addr);
+	uint32_t getHotPages(Address* pages, uint32_t max);
 	Buffer* find(Address addr);
 	Address release(Buffer* buff, BufferReleaseCondition cond);
 	Address getAddress(Buffer* buff);
+	static inline void setTemperature(Buffer* buff, uint8_t temperature) {buff->management.temperature = temperature;}
+	void lease(Lease* lease, Buffer* buff, bool dirty);
+	Buffer* resume(Lease* lease);
+	Lease* takeDirtyLease();
+	void returnLease(Lease* lease, bool revoke = true);
+	uint32_t getAvailableCount();
+	Statistics getStatistics();
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////
 
-template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers>
-void BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers>::flush() {
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+inline void BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::initBuffer(Buffer* buff) {
+	buff->management.transfer.storage = this;
+	buff->management.transfer.data = &buff->data;
+	buff->management.transfer.callback = &BufferedStorage::transferDone;
+}
+
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+template <class Action>
+inline void BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::forEachBuffer(Action&& action) {
+	for(Segment* segment = &builtin; segment; segment = segment->next)
+		for(uint32_t i = 0; i < segment->count; i++)
+			action(segment->buffers + i);
+}
+
+/**
+ * Sequence number of a buffer throughout the segments, for the traces only.
+ */
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+inline uint32_t BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::bufferId(Buffer* buff) {
+	uint32_t ret = 0;
+
+	for(Segment* segment = &builtin; segment; segment = segment->next) {
+		if(segment->buffers <= buff && buff < segment->buffers + segment->count)
+			return ret + (uint32_t)(buff - segment->buffers);
+
+		ret += segment->count;
+	}
+
+	return -1u;
+}
+
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+inline uint32_t BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::dirtyHigh() {
+	return bufferCount * dirtyHighPercent / 100;
+}
+
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+inline uint32_t BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::dirtyLow() {
+	return bufferCount * dirtyLowPercent / 100;
+}
+
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+inline uint32_t BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::hash(Address addr) {
+	return ((uint32_t)addr ^ ((uint32_t)addr >> 16)) & (hashSize - 1);
+}
+
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+inline typename BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::Buffer*
+BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::lookup(Address addr) {
+	for(Buffer* buff = index[hash(addr)]; buff; buff = buff->management.hashNext)
+		if(buff->management.address == addr)
+			return buff;
+
+	return 0;
+}
+
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+inline void BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::addToIndex(Buffer* buff) {
+	Buffer** bucket = index + hash(buff->management.address);
+	buff->management.hashNext = *bucket;
+	*bucket = buff;
+}
+
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+inline void BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::removeFromIndex(Buffer* buff) {
+	for(Buffer** it = index + hash(buff->management.address); *it; it = &(*it)->management.hashNext) {
+		if(*it == buff) {
+			*it = buff->management.hashNext;
+			buff->management.hashNext = 0;
+			return;
+		}
+	}
+
+	assert(false, "Indexed buffer not found in the index.");
+}
+
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+inline void BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::makeEvictable(Buffer* buff) {
+	evictable.add(buff);
+}
+
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+inline void BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::claim(Buffer* buff) {
+	if(!buff->management.usageCounter++)
+		claimedCount++;
+}
+
+/**
+ * Drops a claim of a buffer, it becomes evictable if it was the last one.
+ */
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+inline void BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::unclaim(Buffer* buff) {
+	assert(buff->management.usageCounter);
+
+	if(!--buff->management.usageCounter) {
+		claimedCount--;
+		makeEvictable(buff);
+	}
+}
+
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+inline void BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::LeaseList::pushBack(Lease* lease) {
+	lease->next = 0;
+	lease->prev = last;
+	(last ? last->next : first) = lease;
+	last = lease;
+	count++;
+}
+
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+inline void BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::LeaseList::remove(Lease* lease) {
+	(lease->prev ? lease->prev->next : first) = lease->next;
+	(lease->next ? lease->next->prev : last) = lease->prev;
+	lease->prev = lease->next = 0;
+	count--;
+}
+
+/**
+ * Revokes the oldest clean lease, with the mutex held. Returns false if there is none.
+ */
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+inline bool BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::revokeLease()
+{
+	Lease* lease = cleanLeases.first;
+
+	if(!lease)
+		return false;
+
+	info << "revoking lease of buffer #" << bufferId(lease->buffer) << "\n";
+
+	cleanLeases.remove(lease);
+	unclaim(lease->buffer);
+	lease->buffer = 0;
+	return true;
+}
+
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+inline void BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::countAccess(Buffer* buff, bool hit) {
+	if((int32_t)buff->data.level >= 0)
+		(hit ? statistics.metaHits : statistics.metaMisses)++;
+	else
+		(hit ? statistics.blobHits : statistics.blobMisses)++;
+}
+
+/**
+ * Prepares an evictable buffer to be reused for the page at _addr_, the caller has to hold the
+ * mutex and the buffer must be clean. The previous contents is handed to the second level cache.
+ */
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+inline void BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::evict(Buffer* buff, Address addr)
+{
+	evictable.remove(buff);
+	evictable.reuse(buff, addr);
+
+	if(buff->management.address != FlashDriver::InvalidAddress) {
+		removeFromIndex(buff);
+		secondary.store(buff->management.address, &buff->data);
+	}
+}
+
+/**
+ * Tries to get the contents of a buffer (with its new address set) from the second
+ * level cache instead of reading it from the flash, with the mutex held.
+ */
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+inline bool BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::fetchSecondary(Buffer* buff)
+{
+	if(!secondary.fetch(buff->management.address, &buff->data))
+		return false;
+
+	if((int32_t)buff->data.level >= 0)
+		statistics.metaSecondaryHits++;
+	else
+		statistics.blobSecondaryHits++;
+
+	return true;
+}
+
+/**
+ * Fills the request of a buffer and marks the transfer as in progress, the caller
+ * has to hold the mutex and the buffer must not be on any of the lists.
+ */
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+inline void BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::
+prepareTransfer(Buffer* buff, typename Transfer::Operation operation)
+{
+	buff->management.io = (operation == Transfer::Write) ? Writing : Reading;
+	transfersInProgress++;
+
+	if(operation == Transfer::Write)
+		dirtyCount--;
+
+	buff->management.transfer.operation = operation;
+	buff->management.transfer.address = buff->management.address;
+	buff->management.transfer.data = &buff->data;
+	buff->management.transfer.batch = 0;
+}
+
+/**
+ * Submits a read or a write (back) request for a buffer, the caller has to hold the mutex and
+ * the buffer must not be on any of the lists. The mutex is released during the submission,
+ * because the request may be completed immediately. Afterwards a written buffer is clean, and
+ * it is put on the evictable list if it is not used.
+ */
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+inline void BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::
+startTransfer(Buffer* buff, typename Transfer::Operation operation)
+{
+	prepareTransfer(buff, operation);
+
+	mutex.unlock();
+	Driver::submit(&buff->management.transfer);
 	mutex.lock();
-	while(1) {
-		uint32_t leastRecentCount = 0;
-		Buffer* leastRecent = 0;
+}
+
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+void BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::transferDone(FlashTransfer<Address>* transfer)
+{
+	BufferedStorage* self = static_cast<Transfer*>(transfer)->storage;
+	Buffer* buff = (Buffer*)transfer->data;
 
-		for(uint32_t i=0; i<nBuffers; i++) {
-			uint32_t unrecentness = accessCounter - buffers[i].management.accessCounter;
-			if(buffers[i].management.dirty && unrecentness >= leastRecentCount) {
-				leastRecentCount = unrecentness;
-				leastRecent = &buffers[i];
+	self->mutex.lock();
+
+	if(buff->management.io == Writing)
+		buff->management.dirty = false;
+
+	buff->management.io = Idle;
+	self->transfersInProgress--;
+
+	if(!buff->management.usageCounter)
+		self->makeEvictable(buff);
+
+	TransferWaitHelper<Mutex>::notifyAll(self->mutex);
+	self->mutex.unlock();
+}
+
+/**
+ * Merge sorts a list of requests linked through their _batch_ field, in increasing
+ * order of the value returned by _key_ (without needing any additional memory).
+ */
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+template <class Key>
+inline FlashTransfer<typename FlashDriver::Address>*
+BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::sortTransfers(FlashTransfer<Address>* list, Key key)
+{
+	if(!list || !list->batch)
+		return list;
+
+	FlashTransfer<Address> *slow = list, *fast = list->batch;
+	while(fast && fast->batch) {
+		slow = slow->batch;
+		fast = fast->batch->batch;
+	}
+
+	FlashTransfer<Address>* a = sortTransfers(slow->batch, key);
+	slow->batch = 0;
+	FlashTransfer<Address>* b = sortTransfers(list, key);
+
+	FlashTransfer<Address> *ret = 0, **tail = &ret;
+	while(a && b) {
+		FlashTransfer<Address>*& smaller = (key(a) < key(b)) ? a : b;
+		*tail = smaller;
+		tail = &smaller->batch;
+		smaller = smaller->batch;
+	}
+
+	*tail = a ? a : b;
+	return ret;
+}
+
+/**
+ * Submits the prepared write requests linked through their _batch_ field in the order of their
+ * addresses, runs of consecutive pages within a block are submitted together as a single batch.
+ */
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+inline void BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::submitWrites(FlashTransfer<Address>* list)
+{
+	list = sortTransfers(list, [](FlashTransfer<Address>* t) {return t->address;});
+
+	while(list) {
+		FlashTransfer<Address>* last = list;
+		while(last->batch && last->batch->address == last->address + 1 && last->batch->address % FlashDriver::blockSize)
+			last = last->batch;
+
+		FlashTransfer<Address>* rest = last->batch;
+		last->batch = 0;
+
+		mutex.unlock();
+		Driver::submit(list);
+		mutex.lock();
+
+		list = rest;
+	}
+}
+
+/**
+ * Starts writing back an evictable dirty buffer along with all the dirty ones that precede it
+ * in the same block, so that the pages of a block are programmed in the order of allocation
+ * (instead of leaving gaps to be filled later), with the mutex held. The ones in use are written
+ * too, like _flush_ does (their holders wait for it when releasing them). The ones already being
+ * written back have been submitted earlier, so the driver gets all of them in order.
+ */
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+inline void BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::writeBackInOrder(Buffer* buff)
+{
+	const Address address = buff->management.address;
+	const Address blockStart = address - address % FlashDriver::blockSize;
+	FlashTransfer<Address>* list = 0;
+
+	forEachBuffer([&](Buffer* other) {
+		if(other == buff || (other->management.dirty && other->management.io == Idle
+				&& blockStart <= other->management.address && other->management.address < address)) {
+			if(!other->management.usageCounter)
+				evictable.remove(other);
+
+			prepareTransfer(other, Transfer::Write);
+			other->management.transfer.batch = list;
+			list = &other->management.transfer;
+		}
+	});
+
+	submitWrites(list);
+}
+
+/**
+ * Waits for the completion of some transfer, with the mutex held.
+ */
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+inline void BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::waitAny() {
+	if(Driver::hasPoll) {
+		mutex.unlock();
+		Driver::poll();
+		mutex.lock();
+	} else
+		TransferWaitHelper<Mutex>::wait(mutex);
+}
+
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+inline void BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::waitIo(Buffer* buff) {
+	while(buff->management.io != Idle)
+		waitAny();
+}
+
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::BufferedStorage() {
+	for(uint32_t i=0; i<hashSize; i++)
+		index[i] = 0;
+
+	builtin.buffers = builtinBuffers.get();
+	builtin.count = nBuffers;
+	evictable.setCapacity(nBuffers);
+
+	for(uint32_t i=nBuffers; i--;) {
+		initBuffer(builtin.buffers + i);
+		makeEvictable(builtin.buffers + i);
+	}
+}
+
+/**
+ * Adds the buffers that fit in the supplied memory region (which has to be aligned
+ * for pointers) to the pool, but no more than _maxBuffers_ in total, returns the
+ * number of them. The region stays in use until it is given back by _removeBuffers_.
+ * The storage needs to have at least one buffer more than the number of buffers
+ * used concurrently by the upper layers.
+ */
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+uint32_t BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::addBuffers(void* region, uint32_t size)
+{
+	uintptr_t start = ((uintptr_t)region + sizeof(Segment) + alignof(Buffer) - 1) & ~(uintptr_t)(alignof(Buffer) - 1);
+	uintptr_t end = (uintptr_t)region + size;
+
+	if(end < start + sizeof(Buffer))
+		return 0;
+
+	uint32_t count = (uint32_t)((end - start) / sizeof(Buffer));
+
+	mutex.lock();
+
+	/*
+	 * The address index and the replacement policy are sized
+	 * statically, so the pool can not grow beyond that size.
+	 */
+	if(count > maxBuffers - bufferCount)
+		count = maxBuffers - bufferCount;
+
+	if(!count) {
+		info << "can not add buffers, there are " << bufferCount << " already\n";
+		mutex.unlock();
+		return 0;
+	}
+
+	Segment* segment = new(region) Segment;
+	segment->buffers = (Buffer*)start;
+	segment->count = count;
+
+	for(uint32_t i = 0; i < segment->count; i++)
+		initBuffer(new(segment->buffers + i) Buffer);
+
+	segment->next = builtin.next;
+	builtin.next = segment;
+
+	for(uint32_t i = segment->count; i--;)
+		makeEvictable(segment->buffers + i);
+
+	bufferCount += segment->count;
+	evictable.setCapacity(bufferCount);
+
+	info << "added " << segment->count << " buffers, " << bufferCount << " in total\n";
+
+	mutex.unlock();
+	return segment->count;
+}
+
+/**
+ * Removes the buffers of the most recently added region from the pool, and returns the
+ * region, so that the memory can be used for something else. The dirty ones are written
+ * back first. It fails (returning null) if any of them is in use or if there is no region
+ * to be removed, the built-in buffers can not be removed.
+ */
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+void* BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::removeBuffers()
+{
+	mutex.lock();
+
+	Segment* segment = builtin.next;
+
+	/*
+	 * The mutex is released while writing back, so the buffers
+	 * may get used or dirty again, in which case it is retried.
+	 */
+	while(segment) {
+		FlashTransfer<Address>* list = 0;
+		bool done = true;
+
+		for(uint32_t i = 0; i < segment->count; i++) {
+			Buffer* buff = segment->buffers + i;
+
+			if(buff->management.usageCounter) {
+				info << "can not remove buffers, #" << bufferId(buff) << " is in use\n";
+				segment = 0;
+				break;
+			}
+
+			if(buff->management.io != Idle) {
+				done = false;
+			} else if(buff->management.dirty) {
+				evictable.remove(buff);
+				prepareTransfer(buff, Transfer::Write);
+				buff->management.transfer.batch = list;
+				list = &buff->management.transfer;
+				done = false;
 			}
 		}
 
-		if(!leastRecent)
+		submitWrites(list);
+
+		if(!segment || done)
 			break;
 
-		FlashDriver::write(leastRecent->management.address, &leastRecent->data);
-		leastRecent->management.dirty = false;
+		for(uint32_t i = 0; i < segment->count; i++)
+			waitIo(segment->buffers + i);
+	}
+
+	if(segment) {
+		for(uint32_t i = 0; i < segment->count; i++) {
+			Buffer* buff = segment->buffers + i;
+
+			evict(buff, FlashDriver::InvalidAddress);
+		}
+
+		builtin.next = segment->next;
+		bufferCount -= segment->count;
+		evictable.setCapacity(bufferCount);
+
+		info << "removed " << segment->count << " buffers, " << bufferCount << " left\n";
+	}
+
+	mutex.unlock();
+	return segment;
+}
+
+/**
+ * Adds a region for _count_ buffers (or as many as there is room for below _maxBuffers_), taken
+ * from the _Allocator_ (with static _alloc_ and _free_ methods, like the one of the filesystem
+ * configuration). Returns the number of buffers added.
+ */
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+template <class Allocator>
+uint32_t BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::grow(uint32_t count)
+{
+	const uint32_t room = maxBuffers - getBufferCount();
+
+	if(count > room)
+		count = room;
+
+	if(!count)
+		return 0;
+
+	if(void* region = Allocator::alloc(regionSize(count))) {
+		if(uint32_t ret = addBuffers(region, regionSize(count)))
+			return ret;
+
+		Allocator::free(region);
 	}
+
+	return 0;
+}
+
+/**
+ * Removes the most recently added region (see _removeBuffers_) and gives it back to the _Allocator_.
+ */
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+template <class Allocator>
+bool BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::shrink()
+{
+	if(void* region = removeBuffers()) {
+		Allocator::free(region);
+		return true;
+	}
+
+	return false;
+}
+
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+uint32_t BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::getBufferCount() {
+	mutex.lock();
+	uint32_t ret = bufferCount;
+	mutex.unlock();
+	return ret;
+}
+
+/**
+ * Sets the memory region used by the second level cache (see storage/SecondaryCache.h), that
+ * can be in a larger but slower memory than the buffers. Returns the number of pages it holds.
+ */
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+uint32_t BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::attachSecondaryCache(void* region, uint32_t size)
+{
+	mutex.lock();
+	uint32_t ret = secondary.attach(region, size);
+	mutex.unlock();
+	return ret;
+}
+
+/**
+ * Drops the contents of the second level cache, and returns its memory region.
+ */
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+void* BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::detachSecondaryCache()
+{
+	mutex.lock();
+	void* ret = secondary.detach();
+	mutex.unlock();
+	return ret;
+}
+
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+void BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::flush() {
+	mutex.lock();
+
+	/*
+	 * All of the dirty buffers (including the ones currently in use) are
+	 * collected first, linked through the _batch_ field of their requests.
+	 */
+	FlashTransfer<Address>* list = 0;
+
+	forEachBuffer([this, &list](Buffer* buff) {
+		if(buff->management.dirty && buff->management.io == Idle) {
+			if(!buff->management.usageCounter)
+				evictable.remove(buff);
+
+			prepareTransfer(buff, Transfer::Write);
+			buff->management.transfer.batch = list;
+			list = &buff->management.transfer;
+		}
+	});
+
+	/*
+	 * All of the write backs are submitted before waiting for any of them to complete.
+	 */
+	submitWrites(list);
+
+	/*
+	 * Wait for all of them, including the ones started by someone else.
+	 */
+	forEachBuffer([this](Buffer* buff) {
+		waitIo(buff);
+	});
+
+	mutex.unlock();
+}
+
+/**
+ * Writes back the page at _addr_ if it is dirty (along with the dirty ones preceding
+ * it in the same block, see _writeBackInOrder_) and waits for it to complete.
+ */
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+void BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::flush(Address addr) {
+	mutex.lock();
+
+	if(Buffer* buff = lookup(addr)) {
+		if(buff->management.dirty && buff->management.io == Idle)
+			writeBackInOrder(buff);
+
+		waitIo(buff);
+	}
+
+	mutex.unlock();
+}
+
+/**
+ * Tells without waiting whether the page at _addr_ has reached the flash, that is
+ * it is not held in a dirty buffer nor being written back from one.
+ */
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+bool BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::isWrittenBack(Address addr) {
+	mutex.lock();
+	Buffer* buff = lookup(addr);
+	const bool ret = !buff || (!buff->management.dirty && buff->management.io != Writing);
+	mutex.unlock();
+	return ret;
+}
+
+/**
+ * Sets the watermarks for _writeBack_ in percents of the number of buffers,
+ * so that those follow the changes of the size of the pool.
+ */
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+void BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::setDirtyWatermarks(uint32_t highPercent, uint32_t lowPercent) {
+	mutex.lock();
+	dirtyHighPercent = highPercent;
+	dirtyLowPercent = (lowPercent < highPercent) ? lowPercent : highPercent;
+	mutex.unlock();
+}
+
+/**
+ * Writes back the least recently used dirty buffers if there are more of them than
+ * the high watermark, until only the low watermark amount of them remains dirty.
+ *
+ * It does not wait for the writes to complete, so it can be called from the idle
+ * task (or alike) of the application, or from a dedicated flusher thread along
+ * with _waitForWriteBack_. Returns the number of write backs started.
+ */
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+uint32_t BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::writeBack() {
+	uint32_t ret = 0;
+
+	mutex.lock();
+
+	if(dirtyCount > dirtyHigh()) {
+		/*
+		 * Dirty buffers that are in use can not be written back now, the
+		 * rest is collected and ordered from the least recently used one.
+		 */
+		FlashTransfer<Address>* candidates = 0;
+
+		forEachBuffer([&candidates](Buffer* buff) {
+			if(buff->management.dirty && buff->management.io == Idle && !buff->management.usageCounter) {
+				buff->management.transfer.batch = candidates;
+				candidates = &buff->management.transfer;
+			}
+		});
+
+		candidates = sortTransfers(candidates, [this](FlashTransfer<Address>* t) {
+			return ~(accessCounter - ((Buffer*)t->data)->management.accessCounter);
+		});
+
+		FlashTransfer<Address>* list = 0;
+
+		while(candidates && dirtyCount > dirtyLow()) {
+			Buffer* buff = (Buffer*)candidates->data;
+			candidates = candidates->batch;
+
+			evictable.remove(buff);
+			prepareTransfer(buff, Transfer::Write);
+			buff->management.transfer.batch = list;
+			list = &buff->management.transfer;
+			ret++;
+		}
+
+		info << "writing back " << ret << " dirty buffers\n";
+		submitWrites(list);
+	}
+
+	mutex.unlock();
+	return ret;
+}
+
+/**
+ * Blocks until there are more dirty buffers than the high watermark, for a flusher
+ * thread that calls _writeBack_ afterwards. Returns false if _stopWriteBack_ is called.
+ *
+ * It needs a mutex type that supports waiting (see TransferWaitHelper), otherwise it spins.
+ */
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+bool BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::waitForWriteBack() {
+	mutex.lock();
+
+	while(!writeBackStopped && dirtyCount <= dirtyHigh())
+		TransferWaitHelper<Mutex>::wait(mutex);
+
+	bool ret = !writeBackStopped;
+	mutex.unlock();
+	return ret;
+}
+
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+void BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::stopWriteBack() {
+	mutex.lock();
+	writeBackStopped = true;
+	TransferWaitHelper<Mutex>::notifyAll(mutex);
+	mutex.unlock();
+}
+
+/**
+ * Starts reading a page into a clean buffer in the background, without claiming it.
+ *
+ * It is only a hint, so nothing is done if the page is already buffered or there is no
+ * clean buffer to be reused without writing back dirty data. Also it is only worth doing
+ * with a queued driver, synchronous transfers can not overlap with the processing anyway.
+ */
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+void BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::prefetch(Address addr)
+{
+	if(!Driver::isQueued || addr == FlashDriver::InvalidAddress)
+		return;
+
+	mutex.lock();
+
+	if(!lookup(addr)) {
+		if(Buffer* buff = evictable.pick(accessCounter, true)) {
+			info << "prefetching page " << addr << " into buffer #" << bufferId(buff) << "\n";
+
+			evict(buff, addr);
+
+			buff->management.address = addr;
+			buff->management.accessCounter = accessCounter++;
+			addToIndex(buff);
+
+			if(fetchSecondary(buff))
+				makeEvictable(buff);
+			else
+				startTransfer(buff, Transfer::Read);
+		}
+	}
+
+	mutex.unlock();
+}
+
+/**
+ * Brings a page into the cache without claiming it: in the background with a queued driver
+ * (like _prefetch_ does), or by reading it synchronously otherwise.
+ */
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+void BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::warm(Address addr)
+{
+	if(Driver::isQueued)
+		prefetch(addr);
+	else if(Buffer* buff = find(addr))
+		release(buff, Clean);
+}
+
+/**
+ * Value of keeping a page in the cache, for _getHotPages_: index pages of the meta tree
+ * first (higher levels first), then the ones of the file trees and the leaves of the meta
+ * tree, more recently used ones first within those. File data pages are worth nothing.
+ */
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+inline uint64_t BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::hotness(Buffer* buff)
+{
+	int32_t level = (int32_t)buff->data.level;
+
+	if(buff->management.address == FlashDriver::InvalidAddress || level == -1)
+		return 0;
+
+	uint64_t group = (level > 0) ? 3 : ((level < 0) ? 2 : 1);
+	uint64_t height = (uint8_t)((level < 0) ? -level : level);
+	uint64_t recency = ~(accessCounter - buff->management.accessCounter);
+	return group << 40 | height << 32 | recency;
+}
+
+/**
+ * Collects the addresses of the most valuable pages in the cache (see _hotness_), the hottest
+ * one first, so that they can be recorded and warmed up after the next mount. Returns their count.
+ */
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+uint32_t BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::getHotPages(Address* pages, uint32_t max)
+{
+	uint32_t ret = 0;
+
+	mutex.lock();
+
+	forEachBuffer([&](Buffer* buff) {
+		uint64_t value = hotness(buff);
+
+		if(!value)
+			return;
+
+		uint32_t i = ret;
+		while(i && hotness(lookup(pages[i - 1])) < value) {
+			if(i < max)
+				pages[i] = pages[i - 1];
+
+			i--;
+		}
+
+		if(i < max) {
+			pages[i] = buff->management.address;
+
+			if(ret < max)
+				ret++;
+		}
+	});
+
 	mutex.unlock();
+	return ret;
 }
 
-template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers>
-typename BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers>::Buffer*
-BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers>::
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+typename BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::Buffer*
+BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::
 find(Address addr)
 {
-	uint32_t leastRecentDirtyCount = 0, leastRecentCleanCount = 0;
-	Buffer *leastRecentDirty = 0, *leastRecentClean = 0;
 	Buffer *ret = 0;
 
 	info << "looking for ";
@@ -121,80 +1164,108 @@ find(Address addr)
 		info << "page " << addr << ": ";
 
 	mutex.lock();
-	for(uint32_t i=0; i<nBuffers; i++) {
-		if(	buffers[i].management.address == addr && 	// Hit
-			(addr != FlashDriver::InvalidAddress ||		// If looking for empty it should be free
-			buffers[i].management.usageCounter == 0)) {
-				ret = &buffers[i];
-				info << "found buffer #" << i << "\n";
-				break;
-		}
 
-		if(buffers[i].management.usageCounter == 0) {	// Eviction candidate search
-			uint32_t unrecentness = accessCounter - buffers[i].management.accessCounter;
+	while(true) {
+		if(addr != FlashDriver::InvalidAddress)
+			ret = lookup(addr);
 
-			if(buffers[i].management.dirty) {
-				if(unrecentness >= leastRecentDirtyCount) {
-					leastRecentDirtyCount = unrecentness;
-					leastRecentDirty = &buffers[i];
-				}
-			} else {
-				// Clean, free, empty ones, should definitely be used first
-				if(buffers[i].management.address == FlashDriver::InvalidAddress)
-					unrecentness = -1u;
-
-				if(unrecentness >= leastRecentCleanCount) {
-					leastRecentCleanCount = unrecentness;
-					leastRecentClean = &buffers[i];
-				}
-			}
+		if(ret) {
+			info << "found buffer #" << bufferId(ret) << "\n";
+
+			if(!ret->management.usageCounter && ret->management.io == Idle)
+				evictable.remove(ret);
+
+			/*
+			 * Claim it before waiting for any transfer in progress,
+			 * so that it can not be evicted in the meantime.
+			 */
+			claim(ret);
+			waitIo(ret);
+			countAccess(ret, true);
+			break;
 		}
-	}
 
-	if(!ret) {
 		info << "not found, ";
 
-		bool useClean = leastRecentClean != 0;
-		if(leastRecentDirty != 0 && leastRecentCleanCount * 2 < leastRecentDirtyCount)
-			useClean = false;
+		Buffer *victim = evictable.pick(accessCounter, false);
 
-		if(useClean) {
-			info << "evicting clean buffer " << leastRecentClean-buffers << "\n";
-			ret = leastRecentClean;
+		if(victim && !victim->management.dirty) {
+			info << "evicting clean buffer " << bufferId(victim) << "\n";
+			ret = victim;
 		} else {
-			if(!leastRecentDirty) {
+			if(!victim) {
+				if(transfersInProgress) {
+					/*
+					 * A buffer is being written back or prefetched,
+					 * that may very well be usable after that.
+					 */
+					waitAny();
+					continue;
+				}
+
+				if(revokeLease())
+					continue;
+
 				warn << "buffer request can not be satisfied!\n";
 				mutex.unlock();
 				return 0;
 			}
 
-			info << "flushing dirty buffer " << leastRecentDirty-buffers << "\n";
+			info << "flushing dirty buffer " << bufferId(victim) << "\n";
+
+			ret = victim;
+			const Address victimAddress = ret->management.address;
+			const uint32_t victimAccess = ret->management.accessCounter;
 
-			FlashDriver::write(leastRecentDirty->management.address, &leastRecentDirty->data);
-			leastRecentDirty->management.dirty = false;
-			ret = leastRecentDirty;
+			writeBackInOrder(ret);
+			waitIo(ret);
+
+			/*
+			 * If someone else used it (even if it has been released since then, maybe dirty
+			 * again), evicted it, or brought in the requested page while the mutex was not
+			 * held it can not be used, so start over from scratch.
+			 */
+			if(ret->management.usageCounter || ret->management.dirty || ret->management.io != Idle
+					|| ret->management.address != victimAddress || ret->management.accessCounter != victimAccess
+					|| (addr != FlashDriver::InvalidAddress && lookup(addr))) {
+				ret = 0;
+				continue;
+			}
 		}
 
+		evict(ret, addr);
+
 		ret->management.address = addr;
-		if(addr != FlashDriver::InvalidAddress)
-			FlashDriver::read(addr, &ret->data);
+		claim(ret);
+
+		if(addr != FlashDriver::InvalidAddress) {
+			addToIndex(ret);
+
+			if(!fetchSecondary(ret)) {
+				startTransfer(ret, Transfer::Read);
+				waitIo(ret);
+			}
+
+			countAccess(ret, false);
+		}
+
+		break;
 	}
 
 	ret->management.accessCounter = accessCounter++;
-	ret->management.usageCounter++;
 
 	mutex.unlock();
 	return ret;
 }
 
-template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers>
-typename BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers>::Address
-BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers>::
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+typename BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::Address
+BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::
 release(Buffer* buff, BufferReleaseCondition cond)
 {
 	typename FlashDriver::Address oldAddress = buff->management.address;
 
-	info << "releasing buffer #" << buff-buffers << " (containing: ";
+	info << "releasing buffer #" << bufferId(buff) << " (containing: ";
 
 	if(oldAddress == FlashDriver::InvalidAddress)
 		info << "fresh data";
@@ -204,28 +1275,69 @@ release(Buffer* buff, BufferReleaseCondition cond)
 	info << ") as ";
 
 	mutex.lock();
+
+	/*
+	 * The contents of the buffer can be changed after it is released,
+	 * so an ongoing write back (by a flush) has to be completed first.
+	 */
+	waitIo(buff);
+
 	if(cond == Purge) {
 		info << "garbage (it was " << (buff->management.dirty ? "dirty" : "clean") << ")\n";
-		this->storageManager->reclaim(buff->management.address);
+		if(!buff->management.dirty || !BufferUnallocateHelper<StorageManager>::unallocate(this->storageManager, oldAddress))
+			this->storageManager->reclaim(buff->management.address);
+
+		if(oldAddress != FlashDriver::InvalidAddress) {
+			removeFromIndex(buff);
+			secondary.invalidate(oldAddress);
+		}
+
+		if(buff->management.dirty)
+			dirtyCount--;
+
 		buff->management.address = FlashDriver::InvalidAddress;
 		buff->management.dirty = false;
 	} else if(cond == Dirty) {
 		info << "dirty (it was " << (buff->management.dirty ? "dirty" : "clean") << ")\n";
 		if(!buff->management.dirty) {
-			buff->management.address = this->storageManager->allocate(buff->data.level);
-
-			// Wipe stale copies
-			for(uint32_t i=0; i<nBuffers; i++) {
-				if((buffers + i != buff) &&
-					(buffers[i].management.address == buff->management.address)) {
-					assert(!buffers[i].management.usageCounter, "Wiping occupied page.");
-					assert(!buffers[i].management.dirty, "Wiping dirty page (probable write collision).");
-					buffers[i].management.address = FlashDriver::InvalidAddress;
-				}
+			/*
+			 * Allocation may need to erase a block, that is done without holding the
+			 * mutex (the storage manager itself is protected by the upper layers).
+			 */
+			mutex.unlock();
+			Address newAddress = BufferAllocateHelper<StorageManager>::allocate(this->storageManager, buff->data.level, buff->management.temperature);
+			mutex.lock();
+
+			/*
+			 * Wipe stale copy, it may be still being read in if it
+			 * was prefetched before the page became garbage.
+			 */
+			Buffer* stale;
+			while((stale = lookup(newAddress)) && stale->management.io != Idle)
+				waitIo(stale);
+
+			secondary.invalidate(newAddress);
+
+			if(stale) {
+				assert(!stale->management.usageCounter && stale->management.io == Idle, "Wiping occupied page.");
+				assert(!stale->management.dirty, "Wiping dirty page (probable write collision).");
+				removeFromIndex(stale);
+				evictable.remove(stale);
+				stale->management.address = FlashDriver::InvalidAddress;
+				evictable.add(stale);
 			}
 
+			if(oldAddress != FlashDriver::InvalidAddress)
+				removeFromIndex(buff);
+
+			buff->management.address = newAddress;
+			buff->data.eraseCount = BufferEraseCountHelper<StorageManager>::get(this->storageManager, newAddress);
+			addToIndex(buff);
 			buff->management.dirty = true;
 
+			if(++dirtyCount > dirtyHigh())
+				TransferWaitHelper<Mutex>::notifyAll(mutex);
+
 			if(oldAddress != FlashDriver::InvalidAddress)
 				this->storageManager->reclaim(oldAddress);
 		}
@@ -233,18 +1345,117 @@ release(Buffer* buff, BufferReleaseCondition cond)
 		info << "clean (it was " << (buff->management.dirty ? "dirty" : "clean") << ")\n";
 	}
 
-	assert(buff->management.usageCounter);
-	buff->management.usageCounter--;
+	buff->management.temperature = 0;
+	unclaim(buff);
 
+	Address ret = buff->management.address;
 	mutex.unlock();
-	return buff->management.address;
+	return ret;
 }
 
-template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers>
-typename BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers>::Address
-BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers>::
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+typename BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::Address
+BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::
 getAddress(Buffer* buff) {
 	return buff->management.address;
 }
 
+/**
+ * Turns the claim of a buffer into a lease, when its holder becomes idle. It has to be
+ * resumed (which fails if it has been revoked meanwhile) before accessing the buffer again.
+ */
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+void BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::lease(Lease* lease, Buffer* buff, bool dirty)
+{
+	mutex.lock();
+	lease->buffer = buff;
+	lease->dirty = dirty;
+	(dirty ? dirtyLeases : cleanLeases).pushBack(lease);
+	mutex.unlock();
+}
+
+/**
+ * Turns a lease back into a claim, returns the buffer, or null if the lease has been revoked
+ * (in which case the holder has to fetch the page again). Waits if it is being written back.
+ */
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+typename BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::Buffer*
+BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::resume(Lease* lease)
+{
+	mutex.lock();
+
+	while(lease->taken)
+		TransferWaitHelper<Mutex>::wait(mutex);
+
+	Buffer* ret = lease->buffer;
+
+	if(ret) {
+		(lease->dirty ? dirtyLeases : cleanLeases).remove(lease);
+		lease->buffer = 0;
+	}
+
+	mutex.unlock();
+	return ret;
+}
+
+/**
+ * Takes the oldest dirty lease for writing it back, the holder can not resume it until it is
+ * given back using _returnLease_ (after which it is considered to be revoked, unless it could
+ * not be written back, in which case it is kept as is for the holder). Returns null if there are none.
+ */
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+typename BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::Lease*
+BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::takeDirtyLease()
+{
+	mutex.lock();
+
+	Lease* ret = dirtyLeases.first;
+
+	if(ret) {
+		dirtyLeases.remove(ret);
+		ret->taken = true;
+	}
+
+	mutex.unlock();
+	return ret;
+}
+
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+void BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::returnLease(Lease* lease, bool revoke)
+{
+	mutex.lock();
+
+	if(revoke)
+		lease->buffer = 0;
+	else
+		dirtyLeases.pushBack(lease);
+
+	lease->taken = false;
+	TransferWaitHelper<Mutex>::notifyAll(mutex);
+	mutex.unlock();
+}
+
+/**
+ * The number of buffers that can be claimed without waiting for someone to release one,
+ * including the ones held by clean leases, but not the ones held by dirty leases.
+ */
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+uint32_t BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::getAvailableCount()
+{
+	mutex.lock();
+	uint32_t ret = bufferCount - claimedCount + cleanLeases.count;
+	mutex.unlock();
+	return ret;
+}
+
+template <class FlashDriver, class StorageManager, class Mutex, uint32_t nBuffers, class Replacement, class SecondaryCache, uint32_t maxBuffers>
+typename BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::Statistics
+BufferedStorage<FlashDriver, StorageManager, Mutex, nBuffers, Replacement, SecondaryCache, maxBuffers>::
+getStatistics() {
+	mutex.lock();
+	Statistics ret = statistics;
+	mutex.unlock();
+	return ret;
+}
+
 #endif /* BUFFEREDSTORAGE_H_ */
@@ -0,0 +1,247 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2017 Seller Tamás. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *******************************************************************************/
+
+#ifndef FLASHTRANSFER_H_
+#define FLASHTRANSFER_H_
+
+#include <cstdint>
+
+/**
+ * Page transfer request for queued flash drivers.
+ *
+ * The driver takes ownership of the request when it is submitted, and gives it
+ * back by calling _complete_. The _next_ field can be used freely by the driver
+ * for queuing the requests without the need to allocate memory.
+ *
+ * Writes of consecutive pages of the same block may be submitted together, as a
+ * batch linked through the _batch_ field of the requests (in increasing address
+ * order), these are best done as a single multi-page program operation. Every
+ * request of the batch has to be completed individually.
+ *
+ * The completion has to be signaled from a context in which the mutex of the
+ * buffering layer can be taken (a driver thread or the optional _poll_ method),
+ * not directly from an interrupt handler.
+ *
+ * Erase requests (see _FlashQueuedErase_) carry the number of the block in the
+ * _address_ field and no data.
+ */
+template <class Address>
+struct FlashTransfer {
+	enum Operation: uint8_t {
+		Read, Write, Erase
+	};
+
+	Operation operation;
+	Address address;
+	void* data;
+	FlashTransfer* next = 0;
+	FlashTransfer* batch = 0;
+	void (*callback)(FlashTransfer*) = 0;
+
+	inline void complete() {
+		callback(this);
+	}
+};
+
+/**
+ * Alignment of the page buffers required by the flash driver, it can be specified by
+ * defining a static _bufferAlignment_ constant in the driver (the DMA alignment or the
+ * cache line size, whichever is larger). Defaults to no special alignment.
+ */
+template <class FlashDriver, class = void>
+struct FlashBufferAlignment {
+	static constexpr uint32_t value = 1;
+};
+
+template <class FlashDriver>
+struct FlashBufferAlignment<FlashDriver, decltype(void(FlashDriver::bufferAlignment))> {
+	static constexpr uint32_t value = FlashDriver::bufferAlignment;
+	static_assert(value && !(value & (value - 1)), "Buffer alignment must be a power of two");
+};
+
+/**
+ * Tells whether a queued flash driver accepts erase requests, it can be specified by
+ * defining a static _queuedErase_ constant in the driver. Otherwise the blocks are
+ * erased by calling the synchronous _ensureErased_ method.
+ */
+template <class FlashDriver, class = void>
+struct FlashQueuedErase {
+	static constexpr bool value = false;
+};
+
+template <class FlashDriver>
+struct FlashQueuedErase<FlashDriver, decltype(void(FlashDriver::queuedErase))> {
+	static constexpr bool value = FlashDriver::queuedErase;
+};
+
+/**
+ * Waiting for the completion of transfers, with a mutex held.
+ *
+ * If the supplied mutex type has _wait_ and _notifyAll_ methods (with
+ * the semantics of a condition variable bound to the mutex) those are
+ * used for waiting, otherwise the waiter just spins by releasing and
+ * re-acquiring the mutex (which is only good enough if there is no
+ * strict priority based scheduling, or there is only one thread).
+ */
+template <class Mutex>
+class TransferWaitHelper {
+	template <class M>
+	static inline auto wait(M& mutex, int) -> decltype(mutex.wait(), void()) {
+		mutex.wait();
+	}
+
+	template <class M>
+	static inline void wait(M& mutex, long) {
+		mutex.unlock();
+		mutex.lock();
+	}
+
+	template <class M>
+	static inline auto notifyAll(M& mutex, int) -> decltype(mutex.notifyAll(), void()) {
+		mutex.notifyAll();
+	}
+
+	template <class M>
+	static inline void notifyAll(M& mutex, long) {}
+
+public:
+	static inline void wait(Mutex& mutex) {
+		wait(mutex, 0);
+	}
+
+	static inline void notifyAll(Mutex& mutex) {
+		notifyAll(mutex, 0);
+	}
+};
+
+/**
+ * Uniform access to the different kinds of flash drivers.
+ *
+ * If the driver has a static _submit_ method, that is used to queue requests,
+ * otherwise the plain synchronous _read_ or _write_ method is called and the
+ * request is completed immediately. Batched writes are passed to the optional
+ * _writeMulti_ method of synchronous drivers if there is one, that receives the
+ * address of the first page, and the data of the consecutive pages as an array
+ * of pointers. If the driver has a static _poll_ method,
+ * it is called repeatedly (without holding any locks) while waiting for the
+ * completion of requests, this enables drivers without a thread of their own.
+ */
+template <class FlashDriver>
+class FlashTransferHelper {
+	typedef FlashTransfer<typename FlashDriver::Address> Transfer;
+
+	template <class D>
+	static inline auto submit(Transfer* transfer, int) -> decltype(D::submit(transfer), void()) {
+		D::submit(transfer);
+	}
+
+	template <class D>
+	static inline auto write(Transfer* transfer, int) -> decltype(D::writeMulti(transfer->address, (void* const*)0, 0u), void()) {
+		if(transfer->batch) {
+			void* data[FlashDriver::blockSize];
+			uint32_t n = 0;
+
+			for(Transfer* t = transfer; t; t = t->batch)
+				data[n++] = t->data;
+
+			D::writeMulti(transfer->address, data, n);
+		} else
+			D::write(transfer->address, transfer->data);
+	}
+
+	template <class D>
+	static inline void write(Transfer* transfer, long) {
+		for(Transfer* t = transfer; t; t = t->batch)
+			D::write(t->address, t->data);
+	}
+
+	template <class D>
+	static inline void submit(Transfer* transfer, long) {
+		if(transfer->operation == Transfer::Read)
+			D::read(transfer->address, transfer->data);
+		else
+			write<D>(transfer, 0);
+
+		while(transfer) {
+			Transfer* next = transfer->batch;
+			transfer->complete();
+			transfer = next;
+		}
+	}
+
+	template <class D>
+	static auto submitCheck(int) -> decltype(D::submit((Transfer*)0), char());
+
+	template <class D>
+	static uint32_t submitCheck(long);
+
+	template <class D>
+	static auto pollCheck(int) -> decltype(D::poll(), char());
+
+	template <class D>
+	static uint32_t pollCheck(long);
+
+	template <class D>
+	static inline auto poll(int) -> decltype(D::poll(), void()) {
+		D::poll();
+	}
+
+	template <class D>
+	static inline void poll(long) {}
+
+	template <bool queued, class D = FlashDriver>
+	struct Eraser {
+		static inline void erase(Transfer* transfer) {
+			D::ensureErased(transfer->address);
+			transfer->complete();
+		}
+	};
+
+	template <class D>
+	struct Eraser<true, D> {
+		static inline void erase(Transfer* transfer) {
+			D::submit(transfer);
+		}
+	};
+
+public:
+	static constexpr bool isQueued = sizeof(submitCheck<FlashDriver>(0)) == sizeof(char);
+	static constexpr bool hasPoll = sizeof(pollCheck<FlashDriver>(0)) == sizeof(char);
+	static constexpr uint32_t bufferAlignment = FlashBufferAlignment<FlashDriver>::value;
+	static constexpr bool queuedErase = isQueued && FlashQueuedErase<FlashDriver>::value;
+
+	static inline void submit(Transfer* transfer) {
+		submit<FlashDriver>(transfer, 0);
+	}
+
+	/**
+	 * Starts erasing the block given in the request, it is completed like the other
+	 * requests, immediately if the driver can not queue it.
+	 */
+	static inline void erase(Transfer* transfer) {
+		transfer->operation = Transfer::Erase;
+		Eraser<queuedErase>::erase(transfer);
+	}
+
+	static inline void poll() {
+		poll<FlashDriver>(0);
+	}
+};
+
+#endif /* FLASHTRANSFER_H_ */
@@ -0,0 +1,226 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2016, 2017 Seller Tamás. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *******************************************************************************/
+
+#ifndef SECONDARYCACHE_H_
+#define SECONDARYCACHE_H_
+
+#include <cstdint>
+#include <cstring>
+
+/*
+ * Second level caches of clean pages for the BufferedStorage.
+ *
+ * A second level cache is a class with a _Cache_ member template, that holds copies of
+ * clean pages evicted from the buffers, in a (possibly large but slower) memory region
+ * supplied at run-time. The storage calls its methods with its mutex held:
+ *
+ *  - _attach_ and _detach_ to set and take back the memory region used for the pages,
+ *  - _store_ when a clean buffer is about to be reused for another page,
+ *  - _fetch_ before reading a page from the flash, if the page is found it is copied
+ *    into the buffer and forgotten by the cache (the buffer becomes the only copy),
+ *  - _invalidate_ when the page at an address changes (ie. it is reallocated).
+ */
+
+/**
+ * No second level cache, the default.
+ */
+struct NoSecondaryCache {
+	template <class FlashDriver>
+	class Cache {
+		typedef typename FlashDriver::Address Address;
+	public:
+		inline uint32_t attach(void*, uint32_t) {return 0;}
+		inline void* detach() {return 0;}
+		inline void store(Address, const void*) {}
+		inline bool fetch(Address, void*) {return false;}
+		inline void invalidate(Address) {}
+	};
+};
+
+/**
+ * Second level cache of the least recently evicted pages.
+ *
+ * The memory region is split into a hash index and the page slots, the oldest
+ * stored page is overwritten if there is no free slot.
+ */
+struct SecondaryPageCache {
+	template <class FlashDriver>
+	class Cache {
+		typedef typename FlashDriver::Address Address;
+
+		struct Slot {
+			Address address;
+			Slot *hashNext, *prev, *next;
+			char data[FlashDriver::pageSize];
+		};
+
+		void* region = 0;
+		Slot** index = 0;
+		uint32_t hashMask = 0;
+		Slot *unused = 0, *newest = 0, *oldest = 0;
+
+		inline Slot** bucket(Address addr) {
+			return index + (((uint32_t)addr ^ ((uint32_t)addr >> 16)) & hashMask);
+		}
+
+		inline Slot* lookup(Address addr);
+		inline void forget(Slot* slot);
+	public:
+		inline uint32_t attach(void* region, uint32_t size);
+		inline void* detach();
+		inline void store(Address addr, const void* data);
+		inline bool fetch(Address addr, void* data);
+		inline void invalidate(Address addr);
+	};
+};
+
+////////////////////////////////////////////////////////////////////////////////////////
+
+template <class FlashDriver>
+inline typename SecondaryPageCache::Cache<FlashDriver>::Slot*
+SecondaryPageCache::Cache<FlashDriver>::lookup(Address addr)
+{
+	if(!index)
+		return 0;
+
+	for(Slot* slot = *bucket(addr); slot; slot = slot->hashNext)
+		if(slot->address == addr)
+			return slot;
+
+	return 0;
+}
+
+/**
+ * Removes a stored page from the index and the age list, and puts its slot on the unused list.
+ */
+template <class FlashDriver>
+inline void SecondaryPageCache::Cache<FlashDriver>::forget(Slot* slot)
+{
+	for(Slot** it = bucket(slot->address); *it; it = &(*it)->hashNext) {
+		if(*it == slot) {
+			*it = slot->hashNext;
+			break;
+		}
+	}
+
+	(slot->prev ? slot->prev->next : newest) = slot->next;
+	(slot->next ? slot->next->prev : oldest) = slot->prev;
+
+	slot->next = unused;
+	unused = slot;
+}
+
+/**
+ * Sets the memory region (which has to be aligned for pointers) used for storing
+ * the pages, returns the number of pages that fit in it.
+ */
+template <class FlashDriver>
+inline uint32_t SecondaryPageCache::Cache<FlashDriver>::attach(void* region, uint32_t size)
+{
+	detach();
+
+	uint32_t count = size / (sizeof(Slot) + sizeof(Slot*));
+
+	if(!count)
+		return 0;
+
+	uint32_t buckets = 1;
+	while(buckets * 2 <= count)
+		buckets *= 2;
+
+	count = (size - buckets * sizeof(Slot*)) / sizeof(Slot);
+
+	this->region = region;
+	index = (Slot**)region;
+	hashMask = buckets - 1;
+
+	for(uint32_t i = 0; i < buckets; i++)
+		index[i] = 0;
+
+	Slot* slots = (Slot*)(index + buckets);
+	for(uint32_t i = 0; i < count; i++) {
+		slots[i].next = unused;
+		unused = slots + i;
+	}
+
+	return count;
+}
+
+/**
+ * Drops all of the stored pages, and returns the memory region.
+ */
+template <class FlashDriver>
+inline void* SecondaryPageCache::Cache<FlashDriver>::detach()
+{
+	void* ret = region;
+	region = 0;
+	index = 0;
+	hashMask = 0;
+	unused = newest = oldest = 0;
+	return ret;
+}
+
+template <class FlashDriver>
+inline void SecondaryPageCache::Cache<FlashDriver>::store(Address addr, const void* data)
+{
+	if(!index)
+		return;
+
+	if(Slot* old = lookup(addr))
+		forget(old);
+
+	if(!unused)
+		forget(oldest);
+
+	Slot* slot = unused;
+	unused = slot->next;
+
+	slot->address = addr;
+	memcpy(slot->data, data, sizeof(slot->data));
+
+	Slot** head = bucket(addr);
+	slot->hashNext = *head;
+	*head = slot;
+
+	slot->prev = 0;
+	slot->next = newest;
+	(newest ? newest->prev : oldest) = slot;
+	newest = slot;
+}
+
+template <class FlashDriver>
+inline bool SecondaryPageCache::Cache<FlashDriver>::fetch(Address addr, void* data)
+{
+	if(Slot* slot = lookup(addr)) {
+		memcpy(data, slot->data, sizeof(slot->data));
+		forget(slot);
+		return true;
+	}
+
+	return false;
+}
+
+template <class FlashDriver>
+inline void SecondaryPageCache::Cache<FlashDriver>::invalidate(Address addr)
+{
+	if(Slot* slot = lookup(addr))
+		forget(slot);
+}
+
+#endif /* SECONDARYCACHE_H_ */
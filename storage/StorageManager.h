@@ -25,9 +25,84 @@
 #include "ubiquitous/Error.h"
 #include "ubiquitous/Trace.h"
 
+#include "FlashTransfer.h"
+
 class StorageManagerTrace;
 
-template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels>
+template <bool small>
+struct StorageBlockIndex {
+	typedef uint16_t Type;
+};
+
+template <>
+struct StorageBlockIndex<false> {
+	typedef uint32_t Type;
+};
+
+/**
+ * Time of the last allocation in each block, kept only for victim selection policies that
+ * use the age of the blocks (the ones with a true _usesBlockAge_ constant), otherwise all
+ * the blocks look like they have just been written.
+ */
+template <uint32_t deviceSize, bool tracked>
+struct StorageBlockTimes {
+	uint32_t times[deviceSize];
+
+	inline void reset() {
+		for(uint32_t i=0; i<deviceSize; i++)
+			times[i] = 0;
+	}
+
+	inline void set(uint32_t block, uint32_t time) {times[block] = time;}
+	inline uint32_t get(uint32_t block, uint32_t) {return times[block];}
+};
+
+template <uint32_t deviceSize>
+struct StorageBlockTimes<deviceSize, false> {
+	inline void reset() {}
+	inline void set(uint32_t, uint32_t) {}
+	inline uint32_t get(uint32_t, uint32_t now) {return now;}
+};
+
+template <class WearLeveling, class = void>
+struct StorageManagerUsesBlockAge {
+	static constexpr bool value = false;
+};
+
+template <class WearLeveling>
+struct StorageManagerUsesBlockAge<WearLeveling, decltype(void(sizeof(typename WearLeveling::GcVictimSelection)))> {
+	static constexpr bool value = WearLeveling::GcVictimSelection::usesBlockAge;
+};
+
+/**
+ * Default wear leveling parameters, see the _DefaultTuning_ of the filesystem for their meaning.
+ */
+struct DefaultWearLeveling {
+	typedef uint16_t EraseCount;
+	static constexpr uint32_t freeBlockCandidates = 8;
+	static constexpr uint32_t wearCheckInterval = 64;
+	static constexpr uint32_t maxWearSpread = 32;
+	static constexpr uint32_t erasedPoolSize = 2;
+};
+
+/**
+ * Mutex guarding the state of the blocks being erased in advance against the completion of the
+ * erase, taken from the configuration if it defines a _Mutex_ type, otherwise there is no locking.
+ */
+template <class WearLeveling, class = void>
+struct StorageManagerMutex {
+	struct Type {
+		inline void lock() {}
+		inline void unlock() {}
+	};
+};
+
+template <class WearLeveling>
+struct StorageManagerMutex<WearLeveling, decltype(void(sizeof(typename WearLeveling::Mutex)))> {
+	typedef typename WearLeveling::Mutex Type;
+};
+
+template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels, class WearLeveling = DefaultWearLeveling>
 class StorageManager: pet::Trace<StorageManagerTrace> {
 	public:
 		typedef typename FlashDriver::Address Address;
@@ -36,6 +111,61 @@ class StorageManager: pet::Trace<StorageManagerTrace> {
 
 		uint8_t usageCounters[FlashDriver::deviceSize];
 
+		/*
+		 * Two level bitmap of the free blocks (the ones with zero usage counter), a bit of the
+		 * summary is set if the corresponding word of the map is not zero, so that the lowest
+		 * free block is found without scanning the usage counters of the whole device.
+		 */
+		static constexpr uint32_t freeMapWords = (FlashDriver::deviceSize + 31) / 32;
+		static constexpr uint32_t freeSummaryWords = (freeMapWords + 31) / 32;
+		uint32_t freeMap[freeMapWords];
+		uint32_t freeSummary[freeSummaryWords];
+
+		/*
+		 * The blocks in use are also kept in lists by their usage counters (in the order of
+		 * getting there), so that the garbage collector can walk them starting from the one
+		 * with the least used pages, without searching the usage counters.
+		 */
+		typedef typename StorageBlockIndex<(FlashDriver::deviceSize < 0xffff)>::Type BlockIndex;
+		static constexpr BlockIndex noBlock = (BlockIndex)-1;
+		BlockIndex bucketNext[FlashDriver::deviceSize], bucketPrev[FlashDriver::deviceSize];
+		BlockIndex bucketFirst[FlashDriver::blockSize], bucketLast[FlashDriver::blockSize];
+
+		/*
+		 * Number of erases of the blocks, stored in every page written (so that it can be
+		 * recovered on mount from the first page of the blocks). These are kept relative to
+		 * a common base, in the (possibly narrow) _EraseCount_ type of the configuration,
+		 * which only needs to hold the spread of the counts. The base is moved up when the
+		 * most worn block reaches the largest value, the counts saturate only if the spread
+		 * does not fit. The largest value marks the counts not recovered yet on mount.
+		 */
+		typedef typename WearLeveling::EraseCount EraseCount;
+		static constexpr EraseCount unknownEraseCount = (EraseCount)-1;
+		static constexpr EraseCount maxRelativeEraseCount = unknownEraseCount - 1;
+		EraseCount eraseCounts[FlashDriver::deviceSize];
+		uint32_t eraseCountBase;
+		uint32_t maxEraseCount;
+		uint32_t erasesSinceWearCheck;
+		uint32_t freeCursor;				// The search for free blocks starts here (after the last one taken).
+
+		/*
+		 * Number of pages allocated so far, and its value at the last allocation in each block,
+		 * giving the age of the youngest data in them for the garbage collector (if its victim
+		 * selection uses that). The age is not stored on the flash, so all the blocks found on
+		 * mount are treated as being written at the time of mounting.
+		 */
+		uint32_t writeClock;
+		StorageBlockTimes<FlashDriver::deviceSize, StorageManagerUsesBlockAge<WearLeveling>::value> writeTimes;
+
+		inline void markFree(uint32_t block);
+		inline void markUsed(uint32_t block);
+		inline void findFreeCandidates(uint32_t from, uint32_t to, uint32_t &block, uint32_t &candidates);
+		inline void rebaseEraseCounts(uint32_t base);
+		inline void countErase(uint32_t block);
+		inline void linkBlock(uint32_t block);
+		inline void unlinkBlock(uint32_t block);
+		inline void rebuildBlockIndex();
+
 		struct AllocationState {
 			uint32_t currentAddress = -1u;
 			uint32_t usedCount = -1u;
@@ -43,6 +173,41 @@ class StorageManager: pet::Trace<StorageManagerTrace> {
 
 		AllocationState levelAllocations[maxLevels];
 
+		/*
+		 * Separate allocation heads for the frequently updated (hot) file data, so that it does
+		 * not get mixed with long lived data in the same blocks. These get a block only when
+		 * needed (on mount the partially written blocks are taken back as such).
+		 */
+		static constexpr uint32_t maxHeads = maxLevels + maxFileLevels;
+		AllocationState hotAllocations[maxFileLevels];
+
+		inline AllocationState& head(uint32_t i) {
+			return (i < maxLevels) ? levelAllocations[i] : hotAllocations[i - maxLevels];
+		}
+
+		inline void resetHotHeads();
+
+		/*
+		 * Free blocks erased in advance (by _refillErasedPool_), so that the allocations do not
+		 * need to wait for the erase. These are not in the free block map, but they are counted
+		 * as spare. The erase is done asynchronously if the flash driver supports it, the state
+		 * is updated on completion with the _eraseMutex_ held (and waiters notified, if it can).
+		 */
+		enum PoolState: uint8_t {
+			Empty, Erasing, Erased
+		};
+
+		struct EraseTransfer: FlashTransfer<Address> {
+			StorageManager* manager;
+			PoolState state = Empty;
+		};
+
+		EraseTransfer erasedPool[WearLeveling::erasedPoolSize ? WearLeveling::erasedPoolSize : 1];
+		typename StorageManagerMutex<WearLeveling>::Type eraseMutex;
+
+		static inline void eraseDone(FlashTransfer<Address>*);
+		inline uint32_t takeErased(bool wait);
+
 		inline Address findFree();
 
 		constexpr static inline uint32_t levelToIndex(int32_t level);
@@ -56,18 +221,30 @@ class StorageManager: pet::Trace<StorageManagerTrace> {
 
 		inline bool updateAllocationState();
 
-		inline Address allocate(int32_t level);
+		inline Address allocate(int32_t level, uint32_t temperature = 0);
+		inline bool unallocate(Address addr);
 		inline void claim(Address addr);
 		inline void reclaim(Address addr);
 		inline bool isBlockBeingUsed(uint32_t);
 
-		inline bool gcNeeded() {return spareCount <= maxLevels;}
+		inline uint32_t getEraseCount(uint32_t block) {return eraseCountBase + eraseCounts[block];}
+		inline uint32_t getPageEraseCount(Address addr) {return getEraseCount(addr / FlashDriver::blockSize);}
+		inline void resetEraseCounts();
+		inline void restoreEraseCount(uint32_t block, uint32_t count);
+		inline int32_t findColdBlock();
+		inline uint32_t getBlockAge(uint32_t block) {return writeClock - writeTimes.get(block, writeClock);}
+		inline uint32_t getWriteClock() {return writeClock;}	// Number of pages allocated since mounting.
+
+		inline bool gcNeeded(uint32_t margin = 0) {return spareCount <= maxLevels + margin;}
+		inline uint32_t refillErasedPool();
 
+		/**
+		 * Walks the blocks in use in increasing order of their usage counters.
+		 */
 		class Iterator {
 			int32_t index;
 
-			static inline int32_t forwardSearch(StorageManager &, int32_t);
-			static inline int32_t backwardSearch(StorageManager &, int32_t, int32_t);
+			static inline int32_t firstAbove(StorageManager &, uint32_t);
 		public:
 			inline Iterator(StorageManager &);
 			inline int32_t currentCount(StorageManager &);
@@ -78,37 +255,41 @@ class StorageManager: pet::Trace<StorageManagerTrace> {
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels>
+template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels, class WearLeveling>
 constexpr inline uint32_t
-StorageManager<FlashDriver, maxMetaLevels, maxFileLevels>::
+StorageManager<FlashDriver, maxMetaLevels, maxFileLevels, WearLeveling>::
 levelToIndex(int32_t level)
 {
 	return 	(level < 0) ? -level-1 : (level + (int32_t)maxFileLevels);
 }
 
-template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels>
+template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels, class WearLeveling>
 constexpr inline bool
-StorageManager<FlashDriver, maxMetaLevels, maxFileLevels>::
+StorageManager<FlashDriver, maxMetaLevels, maxFileLevels, WearLeveling>::
 indexOk(uint32_t idx)
 {
 	return idx < maxLevels;
 }
 
-template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels>
+template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels, class WearLeveling>
 constexpr inline int32_t
-StorageManager<FlashDriver, maxMetaLevels, maxFileLevels>::
+StorageManager<FlashDriver, maxMetaLevels, maxFileLevels, WearLeveling>::
 indexToLevel(uint32_t index)
 {
 	return (index < maxFileLevels) ? -(int32_t)index-1 : ((int32_t)index - (int32_t)maxFileLevels);
 }
 
-template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels>
-inline bool StorageManager<FlashDriver, maxMetaLevels, maxFileLevels>::initWithDefaultAssignment()
+template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels, class WearLeveling>
+inline bool StorageManager<FlashDriver, maxMetaLevels, maxFileLevels, WearLeveling>::initWithDefaultAssignment()
 {
-	spareCount = FlashDriver::deviceSize;
-
-	for(uint32_t i=0; i<FlashDriver::deviceSize; i++)
+	for(uint32_t i=0; i<FlashDriver::deviceSize; i++) {
 		this->usageCounters[i] = 0;
+		this->eraseCounts[i] = 0;
+	}
+
+	eraseCountBase = 0;
+
+	rebuildBlockIndex();
 
 	for(uint32_t i=0; i<maxLevels; i++) {
 		this->levelAllocations[i].currentAddress = findFree();
@@ -119,67 +300,508 @@ inline bool StorageManager<FlashDriver, maxMetaLevels, maxFileLevels>::initWithD
 		this->levelAllocations[i].usedCount = 0;
 	}
 
+	resetHotHeads();
 	return true;
 }
 
-template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels>
-inline bool StorageManager<FlashDriver, maxMetaLevels, maxFileLevels>::isBlockBeingUsed(uint32_t block)
+template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels, class WearLeveling>
+inline void StorageManager<FlashDriver, maxMetaLevels, maxFileLevels, WearLeveling>::resetHotHeads()
 {
-	for(uint32_t i=0; i<maxLevels; i++) {
-		if(this->levelAllocations[i].currentAddress == block)
+	for(uint32_t i=0; i<maxFileLevels; i++) {
+		hotAllocations[i].currentAddress = -1u;
+		hotAllocations[i].usedCount = FlashDriver::blockSize;
+	}
+}
+
+template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels, class WearLeveling>
+inline bool StorageManager<FlashDriver, maxMetaLevels, maxFileLevels, WearLeveling>::isBlockBeingUsed(uint32_t block)
+{
+	for(uint32_t i=0; i<maxHeads; i++) {
+		if(head(i).currentAddress == block)
 			return true;
 	}
 
 	return false;
 }
 
-template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels>
-typename StorageManager<FlashDriver, maxMetaLevels, maxFileLevels>::Address
-inline StorageManager<FlashDriver, maxMetaLevels, maxFileLevels>::findFree()
+template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels, class WearLeveling>
+inline void StorageManager<FlashDriver, maxMetaLevels, maxFileLevels, WearLeveling>::markFree(uint32_t block)
+{
+	freeMap[block / 32] |= 1u << (block % 32);
+	freeSummary[block / 32 / 32] |= 1u << (block / 32 % 32);
+}
+
+template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels, class WearLeveling>
+inline void StorageManager<FlashDriver, maxMetaLevels, maxFileLevels, WearLeveling>::markUsed(uint32_t block)
+{
+	if(!(freeMap[block / 32] &= ~(1u << (block % 32))))
+		freeSummary[block / 32 / 32] &= ~(1u << (block / 32 % 32));
+}
+
+/**
+ * Marks all the erase counts unknown, before recovering them on mount.
+ */
+template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels, class WearLeveling>
+inline void StorageManager<FlashDriver, maxMetaLevels, maxFileLevels, WearLeveling>::resetEraseCounts()
+{
+	for(uint32_t i=0; i<FlashDriver::deviceSize; i++)
+		eraseCounts[i] = unknownEraseCount;
+
+	eraseCountBase = -1u;
+}
+
+/**
+ * Sets the erase count of a block (-1 if it is unknown). The first one recovered on mount places
+ * the base half the range below it, so that the others usually fit, the base is moved if they do not.
+ */
+template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels, class WearLeveling>
+inline void StorageManager<FlashDriver, maxMetaLevels, maxFileLevels, WearLeveling>::restoreEraseCount(uint32_t block, uint32_t count)
+{
+	static constexpr uint32_t margin = maxRelativeEraseCount / 2;
+
+	if(count == -1u) {
+		eraseCounts[block] = unknownEraseCount;
+		return;
+	}
+
+	if(eraseCountBase == -1u)
+		eraseCountBase = (count > margin) ? count - margin : 0;
+	else if(count < eraseCountBase) {
+		/*
+		 * The base is moved as low as the most worn block allows.
+		 */
+		uint32_t highest = 0;
+
+		for(uint32_t i=0; i<FlashDriver::deviceSize; i++)
+			if(eraseCounts[i] != unknownEraseCount && eraseCounts[i] > highest)
+				highest = eraseCounts[i];
+
+		highest += eraseCountBase;
+		const uint32_t lowest = (highest > maxRelativeEraseCount) ? highest - maxRelativeEraseCount : 0;
+
+		if(lowest < eraseCountBase)
+			rebaseEraseCounts((lowest > count) ? lowest : count);
+	} else if(count - eraseCountBase > maxRelativeEraseCount)
+		rebaseEraseCounts(count - maxRelativeEraseCount);
+
+	const uint32_t relative = (count > eraseCountBase) ? count - eraseCountBase : 0;
+	eraseCounts[block] = (EraseCount)((relative < maxRelativeEraseCount) ? relative : maxRelativeEraseCount);
+}
+
+/**
+ * Moves the base of the erase counts, the ones that do not fit above it are clamped.
+ */
+template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels, class WearLeveling>
+inline void StorageManager<FlashDriver, maxMetaLevels, maxFileLevels, WearLeveling>::rebaseEraseCounts(uint32_t base)
+{
+	for(uint32_t i=0; i<FlashDriver::deviceSize; i++) {
+		if(eraseCounts[i] != unknownEraseCount) {
+			const uint32_t count = eraseCountBase + eraseCounts[i];
+			const uint32_t relative = (count > base) ? count - base : 0;
+			eraseCounts[i] = (EraseCount)((relative < maxRelativeEraseCount) ? relative : maxRelativeEraseCount);
+		}
+	}
+
+	info << "erase count base moved from " << eraseCountBase << " to " << base << "\n";
+	eraseCountBase = base;
+}
+
+template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels, class WearLeveling>
+inline void StorageManager<FlashDriver, maxMetaLevels, maxFileLevels, WearLeveling>::countErase(uint32_t block)
+{
+	if(eraseCounts[block] == maxRelativeEraseCount) {
+		EraseCount least = maxRelativeEraseCount;
+
+		for(uint32_t i=0; i<FlashDriver::deviceSize; i++)
+			if(eraseCounts[i] < least)
+				least = eraseCounts[i];
+
+		if(least)
+			rebaseEraseCounts(eraseCountBase + least);
+	}
+
+	if(eraseCounts[block] < maxRelativeEraseCount)
+		eraseCounts[block]++;
+
+	if(getEraseCount(block) > maxEraseCount)
+		maxEraseCount = getEraseCount(block);
+
+	erasesSinceWearCheck++;
+}
+
+/**
+ * Appends a block to the list of its usage counter (if it is in use).
+ */
+template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels, class WearLeveling>
+inline void StorageManager<FlashDriver, maxMetaLevels, maxFileLevels, WearLeveling>::linkBlock(uint32_t block)
+{
+	if(const uint32_t count = this->usageCounters[block]) {
+		const BlockIndex last = bucketLast[count - 1];
+		bucketPrev[block] = last;
+		bucketNext[block] = noBlock;
+		(last != noBlock ? bucketNext[last] : bucketFirst[count - 1]) = block;
+		bucketLast[count - 1] = block;
+	}
+}
+
+/**
+ * Removes a block from the list of its usage counter (if it is in use).
+ */
+template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels, class WearLeveling>
+inline void StorageManager<FlashDriver, maxMetaLevels, maxFileLevels, WearLeveling>::unlinkBlock(uint32_t block)
+{
+	if(const uint32_t count = this->usageCounters[block]) {
+		const BlockIndex prev = bucketPrev[block], next = bucketNext[block];
+		(prev != noBlock ? bucketNext[prev] : bucketFirst[count - 1]) = next;
+		(next != noBlock ? bucketPrev[next] : bucketLast[count - 1]) = prev;
+	}
+}
+
+/**
+ * Recomputes the free block map, the usage lists and the spare count from the usage
+ * counters, after they are set up from scratch (on initialization and mounting). The
+ * erase counts that could not be recovered are assumed to be the average of the others.
+ */
+template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels, class WearLeveling>
+inline void StorageManager<FlashDriver, maxMetaLevels, maxFileLevels, WearLeveling>::rebuildBlockIndex()
 {
+	for(uint32_t i=0; i<freeMapWords; i++)
+		freeMap[i] = 0;
+
+	for(uint32_t i=0; i<freeSummaryWords; i++)
+		freeSummary[i] = 0;
+
+	for(uint32_t i=0; i<FlashDriver::blockSize; i++)
+		bucketFirst[i] = bucketLast[i] = noBlock;
+
+	spareCount = 0;
+
+	uint64_t eraseSum = 0;
+	uint32_t known = 0;
+
 	for(uint32_t i=0; i<FlashDriver::deviceSize; i++) {
 		if(!this->usageCounters[i]) {
-			this->usageCounters[i] = FlashDriver::blockSize;
-			FlashDriver::ensureErased(i);
+			markFree(i);
+			spareCount++;
+		} else
+			linkBlock(i);
+
+		if(eraseCounts[i] != unknownEraseCount) {
+			eraseSum += eraseCounts[i];
+			known++;
+		}
+	}
+
+	if(eraseCountBase == -1u)
+		eraseCountBase = 0;
+
+	maxEraseCount = 0;
+	erasesSinceWearCheck = 0;
+	freeCursor = 0;
+	writeClock = 0;
+
+	for(uint32_t i=0; i<WearLeveling::erasedPoolSize; i++)
+		erasedPool[i].state = Empty;
+
+	writeTimes.reset();
+
+	for(uint32_t i=0; i<FlashDriver::deviceSize; i++) {
+		if(eraseCounts[i] == unknownEraseCount)
+			eraseCounts[i] = known ? (EraseCount)(eraseSum / known) : 0;
+
+		if(getEraseCount(i) > maxEraseCount)
+			maxEraseCount = getEraseCount(i);
+	}
+}
+
+/**
+ * Looks at the free blocks in the range [from, to) in increasing order, until _freeBlockCandidates_
+ * of them are seen in total, and updates _block_ if there is a less worn one among them.
+ */
+template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels, class WearLeveling>
+inline void StorageManager<FlashDriver, maxMetaLevels, maxFileLevels, WearLeveling>::
+findFreeCandidates(uint32_t from, uint32_t to, uint32_t &block, uint32_t &candidates)
+{
+	if(from >= to)
+		return;
+
+	const uint32_t firstWord = from / 32, lastWord = (to - 1) / 32;
+
+	for(uint32_t i = firstWord / 32; i <= lastWord / 32 && candidates < WearLeveling::freeBlockCandidates; i++) {
+		uint32_t words = freeSummary[i];
+
+		if(i == firstWord / 32)
+			words &= ~0u << (firstWord % 32);
+
+		if(i == lastWord / 32)
+			words &= ~0u >> (31 - lastWord % 32);
+
+		for(; words && candidates < WearLeveling::freeBlockCandidates; words &= words - 1) {
+			const uint32_t word = i * 32 + __builtin_ctz(words);
+			uint32_t bits = freeMap[word];
+
+			if(word == firstWord)
+				bits &= ~0u << (from % 32);
+
+			if(word == lastWord)
+				bits &= ~0u >> (31 - (to - 1) % 32);
+
+			for(; bits && candidates < WearLeveling::freeBlockCandidates; bits &= bits - 1) {
+				const uint32_t candidate = word * 32 + __builtin_ctz(bits);
+
+				if(block == -1u || eraseCounts[candidate] < eraseCounts[block])
+					block = candidate;
+
+				candidates++;
+			}
+		}
+	}
+}
+
+/**
+ * Takes the least worn one of the already erased blocks of the pool, or if there is none, the
+ * least worn one of the next few (_freeBlockCandidates_) free blocks after the previously taken
+ * one (wrapping around at the end of the device), and erases it. If there is no such block
+ * either, the rest of the spare blocks are still being erased in advance, so one of those
+ * is waited for.
+ */
+template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels, class WearLeveling>
+typename StorageManager<FlashDriver, maxMetaLevels, maxFileLevels, WearLeveling>::Address
+inline StorageManager<FlashDriver, maxMetaLevels, maxFileLevels, WearLeveling>::findFree()
+{
+	uint32_t block = takeErased(false);
+
+	if(block == -1u) {
+		uint32_t candidates = 0;
+
+		findFreeCandidates(freeCursor, FlashDriver::deviceSize, block, candidates);
+		findFreeCandidates(0, freeCursor, block, candidates);
+
+		if(block != -1u) {
+			freeCursor = (block + 1) % FlashDriver::deviceSize;
+
+			markUsed(block);
+			this->usageCounters[block] = FlashDriver::blockSize;
+			linkBlock(block);
+			FlashDriver::ensureErased(block);
 			spareCount--;
-			return i;
+			countErase(block);
+			return block;
+		}
+
+		block = takeErased(true);
+
+		if(block == -1u)
+			return block;
+	}
+
+	this->usageCounters[block] = FlashDriver::blockSize;
+	linkBlock(block);
+	spareCount--;
+	return block;
+}
+
+template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels, class WearLeveling>
+inline void StorageManager<FlashDriver, maxMetaLevels, maxFileLevels, WearLeveling>::eraseDone(FlashTransfer<Address>* transfer)
+{
+	EraseTransfer* entry = static_cast<EraseTransfer*>(transfer);
+	entry->manager->eraseMutex.lock();
+	entry->state = Erased;
+	TransferWaitHelper<typename StorageManagerMutex<WearLeveling>::Type>::notifyAll(entry->manager->eraseMutex);
+	entry->manager->eraseMutex.unlock();
+}
+
+/**
+ * Removes the least worn block that has been erased from the pool, returns -1 if there is none.
+ * If _wait_ is set and some of the blocks are still being erased, it waits for one of those.
+ */
+template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels, class WearLeveling>
+inline uint32_t StorageManager<FlashDriver, maxMetaLevels, maxFileLevels, WearLeveling>::takeErased(bool wait)
+{
+	EraseTransfer* best = 0;
+
+	eraseMutex.lock();
+
+	while(true) {
+		bool erasing = false;
+
+		for(uint32_t i=0; i<WearLeveling::erasedPoolSize; i++) {
+			EraseTransfer &entry = erasedPool[i];
+
+			if(entry.state == Erasing)
+				erasing = true;
+			else if(entry.state == Erased && (!best || eraseCounts[entry.address] < eraseCounts[best->address]))
+				best = &entry;
 		}
+
+		if(best || !erasing || !wait)
+			break;
+
+		if(FlashTransferHelper<FlashDriver>::hasPoll) {
+			eraseMutex.unlock();
+			FlashTransferHelper<FlashDriver>::poll();
+			eraseMutex.lock();
+		} else
+			TransferWaitHelper<typename StorageManagerMutex<WearLeveling>::Type>::wait(eraseMutex);
+	}
+
+	if(best)
+		best->state = Empty;
+
+	eraseMutex.unlock();
+
+	if(!best)
+		return -1u;
+
+	info << "pre-erased block " << best->address << " taken\n";
+	return best->address;
+}
+
+/**
+ * Starts erasing free blocks for the empty places of the pool (picked the same way as the ones
+ * erased on demand), to be called from a background thread or an idle hook. If the erases can
+ * not be queued to the flash driver, only a single block is erased (synchronously) per call, to
+ * keep the time spent in it bounded. Returns the number of erases started. The storage manager
+ * has to be protected from concurrent use by the caller.
+ */
+template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels, class WearLeveling>
+inline uint32_t StorageManager<FlashDriver, maxMetaLevels, maxFileLevels, WearLeveling>::refillErasedPool()
+{
+	uint32_t ret = 0;
+
+	for(uint32_t i=0; i<WearLeveling::erasedPoolSize; i++) {
+		EraseTransfer &entry = erasedPool[i];
+
+		/*
+		 * Some of the free blocks are left alone, so that there are enough of them for the
+		 * allocation heads even if none of the erases are finished when they are needed.
+		 */
+		uint32_t pooled = 0;
+
+		eraseMutex.lock();
+		const bool empty = entry.state == Empty;
+		for(uint32_t j=0; j<WearLeveling::erasedPoolSize; j++)
+			if(erasedPool[j].state != Empty)
+				pooled++;
+		eraseMutex.unlock();
+
+		if(!empty)
+			continue;
+
+		if(spareCount <= maxHeads + pooled)
+			break;
+
+		uint32_t block = -1u, candidates = 0;
+		findFreeCandidates(freeCursor, FlashDriver::deviceSize, block, candidates);
+		findFreeCandidates(0, freeCursor, block, candidates);
+
+		if(block == -1u)
+			break;
+
+		freeCursor = (block + 1) % FlashDriver::deviceSize;
+		markUsed(block);
+		countErase(block);
+
+		entry.manager = this;
+		entry.address = block;
+		entry.data = 0;
+		entry.batch = 0;
+		entry.callback = &StorageManager::eraseDone;
+
+		eraseMutex.lock();
+		entry.state = Erasing;
+		eraseMutex.unlock();
+
+		info << "erasing block " << block << " in advance\n";
+		FlashTransferHelper<FlashDriver>::erase(&entry);
+		ret++;
+
+		if(!FlashTransferHelper<FlashDriver>::queuedErase)
+			break;
+	}
+
+	return ret;
+}
+
+/**
+ * Returns the least worn block in use, if it is due to be checked (after every _wearCheckInterval_
+ * erases) and it is worn less than the most worn block by more than _maxWearSpread_ erases. The data
+ * on it is probably static, so it is worth moving it to a more worn one, to let it take its share of
+ * the erases. Returns -1 otherwise.
+ */
+template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels, class WearLeveling>
+inline int32_t StorageManager<FlashDriver, maxMetaLevels, maxFileLevels, WearLeveling>::findColdBlock()
+{
+	if(erasesSinceWearCheck < WearLeveling::wearCheckInterval)
+		return -1;
+
+	erasesSinceWearCheck = 0;
+
+	int32_t ret = -1;
+
+	for(uint32_t i=0; i<FlashDriver::deviceSize; i++) {
+		if(this->usageCounters[i] && !isBlockBeingUsed(i) && (ret == -1 || eraseCounts[i] < eraseCounts[ret]))
+			ret = i;
 	}
 
-	return -1u;
+	if(ret == -1 || maxEraseCount - getEraseCount(ret) <= WearLeveling::maxWearSpread)
+		return -1;
+
+	info << "block " << ret << " is cold (erased " << getEraseCount(ret) << " times, max " << maxEraseCount << ")\n";
+	return ret;
 }
 
-template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels>
-inline void StorageManager<FlashDriver, maxMetaLevels, maxFileLevels>::reclaim(Address addr) {
+template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels, class WearLeveling>
+inline void StorageManager<FlashDriver, maxMetaLevels, maxFileLevels, WearLeveling>::reclaim(Address addr) {
 	uint32_t blockAddress = addr / FlashDriver::blockSize;
+	unlinkBlock(blockAddress);
 	this->usageCounters[blockAddress]--;
+	linkBlock(blockAddress);
 
 	info << "address "<< addr << " reclaimed";
 
 	if(!this->usageCounters[blockAddress]) {
+		markFree(blockAddress);
 		spareCount++;
 		info << " and block " << blockAddress << " is now free\n";
 	}else
 		info << "\n";
 }
 
-template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels>
-inline void StorageManager<FlashDriver, maxMetaLevels, maxFileLevels>::claim(Address addr) {
+template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels, class WearLeveling>
+inline void StorageManager<FlashDriver, maxMetaLevels, maxFileLevels, WearLeveling>::claim(Address addr) {
 	uint32_t blockAddress = addr / FlashDriver::blockSize;
-	this->usageCounters[blockAddress]++;
+	unlinkBlock(blockAddress);
+
+	if(!this->usageCounters[blockAddress]++) {
+		markUsed(blockAddress);
+		spareCount--;
+	}
+
+	linkBlock(blockAddress);
+
 	info << "address "<< addr << " claimed\n";
 }
 
-template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels>
-typename StorageManager<FlashDriver, maxMetaLevels, maxFileLevels>::Address
-inline StorageManager<FlashDriver, maxMetaLevels, maxFileLevels>::allocate(int32_t level)
+/**
+ * Allocates a page for the specified level, pages of file levels with a non-zero
+ * _temperature_ are allocated from the hot allocation head of the level.
+ */
+template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels, class WearLeveling>
+typename StorageManager<FlashDriver, maxMetaLevels, maxFileLevels, WearLeveling>::Address
+inline StorageManager<FlashDriver, maxMetaLevels, maxFileLevels, WearLeveling>::allocate(int32_t level, uint32_t temperature)
 {
 	if((level >= (int32_t)maxMetaLevels) || (level < -(int32_t)maxFileLevels))
 		return FlashDriver::InvalidAddress;
 
-	const uint32_t index = levelToIndex(level);
+	/*
+	 * A new block is only opened for the hot data if there are enough free ones left
+	 * for the other heads, otherwise it goes with the rest of the data of the level.
+	 */
+	const bool hot = temperature && level < 0 && (hotAllocations[levelToIndex(level)].usedCount != FlashDriver::blockSize || spareCount > maxHeads);
+	AllocationState &state = hot ? hotAllocations[levelToIndex(level)] : levelAllocations[levelToIndex(level)];
 
-	if(levelAllocations[index].usedCount == FlashDriver::blockSize) {
+	if(state.usedCount == FlashDriver::blockSize) {
 		uint32_t newEmpty = findFree();
 
 		if(newEmpty == -1u) {
@@ -187,57 +809,62 @@ inline StorageManager<FlashDriver, maxMetaLevels, maxFileLevels>::allocate(int32
 			return FlashDriver::InvalidAddress;
 		}
 
-		levelAllocations[index].usedCount = 0;
-		levelAllocations[index].currentAddress = newEmpty;
-		info << "block " << newEmpty << " allocated for level " << level << "\n";
+		state.usedCount = 0;
+		state.currentAddress = newEmpty;
+		info << "block " << newEmpty << " allocated for " << (hot ? "hot " : "") << "level " << level << "\n";
 	}
 
-	Address ret = levelAllocations[index].currentAddress * FlashDriver::blockSize + levelAllocations[index].usedCount++;
+	Address ret = state.currentAddress * FlashDriver::blockSize + state.usedCount++;
+	writeTimes.set(state.currentAddress, writeClock++);
 
-	info << "page " << ret << " allocated for level " << level << " request\n";
+	info << "page " << ret << " allocated for " << (hot ? "hot " : "") << "level " << level << " request\n";
 
 	return ret;
 }
 
-template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels>
-inline int32_t StorageManager<FlashDriver, maxMetaLevels, maxFileLevels>::Iterator::
-forwardSearch(StorageManager &manager, int32_t min)
+/**
+ * Takes back a page if it is the last one allocated for its level (and it was not written), so
+ * that it is allocated again next time, instead of becoming garbage. Returns false otherwise.
+ */
+template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels, class WearLeveling>
+inline bool StorageManager<FlashDriver, maxMetaLevels, maxFileLevels, WearLeveling>::unallocate(Address addr)
 {
-	int32_t ret = -1;
-	int32_t act = 0xff;
+	for(uint32_t i=0; i<maxHeads; i++) {
+		AllocationState &state = head(i);
 
-	for(uint32_t i=0; i<FlashDriver::deviceSize; i++) {
-		if((int32_t)manager.usageCounters[i] > min && (int32_t)manager.usageCounters[i] <= act) {
-			ret = i;
-			act = (int32_t)manager.usageCounters[i];
+		if(state.currentAddress != -1u && state.usedCount && state.usedCount != -1u
+				&& state.currentAddress * FlashDriver::blockSize + state.usedCount - 1 == addr) {
+			state.usedCount--;
+			info << "page " << addr << " unallocated\n";
+			return true;
 		}
 	}
 
-	return ret;
+	return false;
 }
 
-template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels>
-inline int32_t StorageManager<FlashDriver, maxMetaLevels, maxFileLevels>::Iterator::
-backwardSearch(StorageManager &manager, int32_t value, int32_t place)
+/**
+ * The first block of the lowest non-empty usage list above the specified count, or -1 if none.
+ */
+template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels, class WearLeveling>
+inline int32_t StorageManager<FlashDriver, maxMetaLevels, maxFileLevels, WearLeveling>::Iterator::
+firstAbove(StorageManager &manager, uint32_t count)
 {
-	while(place){
-		--place;
-
-		if(manager.usageCounters[place] == value)
-			return place;
-	}
+	for(uint32_t i=count; i<FlashDriver::blockSize; i++)
+		if(manager.bucketFirst[i] != noBlock)
+			return manager.bucketFirst[i];
 
 	return -1;
 }
 
-template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels>
-inline StorageManager<FlashDriver, maxMetaLevels, maxFileLevels>::Iterator::Iterator(StorageManager &manager)
+template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels, class WearLeveling>
+inline StorageManager<FlashDriver, maxMetaLevels, maxFileLevels, WearLeveling>::Iterator::Iterator(StorageManager &manager)
 {
-	index = forwardSearch(manager, 0);
+	index = firstAbove(manager, 0);
 }
 
-template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels>
-inline int32_t StorageManager<FlashDriver, maxMetaLevels, maxFileLevels>::Iterator::currentCount(StorageManager &manager)
+template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels, class WearLeveling>
+inline int32_t StorageManager<FlashDriver, maxMetaLevels, maxFileLevels, WearLeveling>::Iterator::currentCount(StorageManager &manager)
 {
 	if(index >= 0)
 		return manager.usageCounters[index];
@@ -245,25 +872,22 @@ inline int32_t StorageManager<FlashDriver, maxMetaLevels, maxFileLevels>::Iterat
 	return -1;
 }
 
-template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels>
-inline int32_t StorageManager<FlashDriver, maxMetaLevels, maxFileLevels>::Iterator::currentBlock()
+template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels, class WearLeveling>
+inline int32_t StorageManager<FlashDriver, maxMetaLevels, maxFileLevels, WearLeveling>::Iterator::currentBlock()
 {
 	return index;
 }
 
-template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels>
-inline void StorageManager<FlashDriver, maxMetaLevels, maxFileLevels>::Iterator::step(StorageManager &manager)
+template <class FlashDriver, uint32_t maxMetaLevels, uint32_t maxFileLevels, class WearLeveling>
+inline void StorageManager<FlashDriver, maxMetaLevels, maxFileLevels, WearLeveling>::Iterator::step(StorageManager &manager)
 {
 	if(index == -1)
 		return;
 
-	int32_t next;
-	next = backwardSearch(manager, manager.usageCounters[index], index);
-
-	if(next != -1)
-		index = next;
+	if(manager.bucketNext[index] != noBlock)
+		index = manager.bucketNext[index];
 	else
-		index = forwardSearch(manager, manager.usageCounters[index]);
+		index = firstAbove(manager, manager.usageCounters[index]);
 }
 
 #endif /* STORAGEMANAGER_H_ */
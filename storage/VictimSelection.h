@@ -0,0 +1,119 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2016, 2017 Seller Tamás. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *******************************************************************************/
+
+#ifndef VICTIMSELECTION_H_
+#define VICTIMSELECTION_H_
+
+#include <cstdint>
+
+/*
+ * Victim selection policies for the garbage collector.
+ *
+ * A policy is a class with a static _select_ method template, that is given the storage
+ * manager and returns the block to be freed up next, or -1 if there is none that would
+ * yield any free space. Blocks that are currently being written (see _isBlockBeingUsed_)
+ * must not be selected. The _usesBlockAge_ constant tells whether the storage manager
+ * needs to keep track of the age of the blocks (see _getBlockAge_), which takes a word
+ * of memory for each block.
+ */
+
+/**
+ * The block with the least used pages (the one that is the cheapest to free up) is taken.
+ */
+struct GreedyVictimSelection {
+	static constexpr bool usesBlockAge = false;
+
+	template<class FlashDriver, class Manager>
+	static inline int32_t select(Manager& manager);
+};
+
+/**
+ * The block with the highest ratio of the space gained and the cost of freeing it up,
+ * weighted by the age of its data, is taken. With _u_ being the ratio of the used pages
+ * in the block, that is (1 - u) * age / (2 * u) (where the cost is reading the used pages,
+ * then writing them elsewhere). Blocks written recently are likely to lose more pages
+ * soon, so these are left alone even if they are slightly cheaper to free up, while the
+ * old (probably static) data gets compacted.
+ *
+ * The age of the blocks is only kept in memory, after mounting all of them start out as
+ * new, so until the blocks are rewritten the selection is the same as the greedy one.
+ */
+struct CostBenefitVictimSelection {
+	static constexpr bool usesBlockAge = true;
+
+	template<class FlashDriver, class Manager>
+	static inline int32_t select(Manager& manager);
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+template<class FlashDriver, class Manager>
+inline int32_t GreedyVictimSelection::select(Manager& manager)
+{
+	typedef typename Manager::Iterator Iterator;
+
+	for(Iterator it(manager); it.currentBlock() != -1; it.step(manager)) {
+		if(it.currentCount(manager) == FlashDriver::blockSize)
+			break;
+
+		if(!manager.isBlockBeingUsed(it.currentBlock()))
+			return it.currentBlock();
+	}
+
+	return -1;
+}
+
+template<class FlashDriver, class Manager>
+inline int32_t CostBenefitVictimSelection::select(Manager& manager)
+{
+	typedef typename Manager::Iterator Iterator;
+
+	int32_t ret = -1;
+	uint64_t best = 0;
+
+	for(Iterator it(manager); it.currentBlock() != -1; it.step(manager)) {
+		const uint32_t used = it.currentCount(manager);
+
+		if(used == FlashDriver::blockSize)
+			break;
+
+		/*
+		 * The blocks come in increasing order of their usage counters, so
+		 * none of the rest can beat the best one if even the oldest can not.
+		 */
+		const uint64_t gain = FlashDriver::blockSize - used;
+
+		if(ret != -1 && gain * manager.getWriteClock() / used <= best)
+			break;
+
+		if(manager.isBlockBeingUsed(it.currentBlock()))
+			continue;
+
+		const uint64_t score = gain * manager.getBlockAge(it.currentBlock()) / used;
+
+		if(ret == -1 || score > best) {
+			ret = it.currentBlock();
+			best = score;
+		}
+	}
+
+	return ret;
+}
+
+#endif /* VICTIMSELECTION_H_ */
@@ -73,6 +73,7 @@ struct GcTestHelpers {
 			};
 
 			BlockAllocation allocations[Wtfs<Config>::maxLevels];
+			BlockAllocation hotAllocations[Config::maxFile];
 
 			bool resembles(const State& other) {
 				if(other.links.size() != links.size())
@@ -152,6 +153,11 @@ struct GcTestHelpers {
 				ret.allocations[i].addr = this->levelAllocations[i].currentAddress;
 			}
 
+			for(unsigned int i = 0; i < sizeof(this->hotAllocations) / sizeof(this->hotAllocations[0]); i++) {
+				ret.hotAllocations[i].count = this->hotAllocations[i].usedCount;
+				ret.hotAllocations[i].addr = this->hotAllocations[i].currentAddress;
+			}
+
 			return ret;
 		}
 
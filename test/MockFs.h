@@ -106,6 +106,7 @@ public:
 		pet::GenericError write(void* &content, unsigned int size);
 		pet::GenericError setPosition(Whence whence, int offset);
 		pet::GenericError flush();
+		inline void park() {}
 
 		unsigned int getPosition();
 		unsigned int getSize();
@@ -140,15 +140,18 @@ struct MockStorage: protected pet::Trace<MockStorageTrace> {
 		unsigned int maxInUse = 0;
 		unsigned int nRead = 0;
 		unsigned int nWrite = 0;
+		unsigned int nPrefetch = 0;
 
 		std::unordered_set<void*> open;
 		std::unordered_set<Address> stored;
+		std::unordered_set<Address> prefetched;
 
 		inline void traceEmpty(void*);
 		inline void tracePreWrite(void*);
 		inline void tracePostWrite(Address);
 		inline void tracePreRead(Address);
 		inline void tracePostRead(void*);
+		inline void tracePrefetch(Address);
 		inline void traceRelease(void*);
 		inline void traceDispose(const void*);
 	};
@@ -173,6 +176,7 @@ struct MockStorage: protected pet::Trace<MockStorageTrace> {
 	inline void closeReadOnlySession(ReadOnlySession& session);
 
 	inline void *read(ReadOnlySession& session, Address p);
+	inline void prefetch(ReadOnlySession& session, Address p);
 	inline void release(ReadOnlySession& session, void* p);
 
 	struct ReadWriteSession: public ReadOnlySession {
@@ -263,6 +267,13 @@ void *MockStorage<pageSizeParam, Client, strict, checkRoot>::read(ReadOnlySessio
 	return (void*) ret;
 }
 
+template<unsigned int pageSizeParam, class Client, bool strict, bool checkRoot>
+void MockStorage<pageSizeParam, Client, strict, checkRoot>::prefetch(ReadOnlySession& session, Address p)
+{
+	CHECK(!session.closed);
+	diagnostics.tracePrefetch(p);
+}
+
 template<unsigned int pageSizeParam, class Client, bool strict, bool checkRoot>
 void MockStorage<pageSizeParam, Client, strict, checkRoot>::release(ReadOnlySession& session, void* p)
 {
@@ -588,6 +599,16 @@ inline void MockStorage<pageSizeParam, Client, strict, checkRoot>::Diagnostics::
 	info << ret << "\n";
 }
 
+template<unsigned int pageSizeParam, class Client, bool strict, bool checkRoot>
+inline void MockStorage<pageSizeParam, Client, strict, checkRoot>::Diagnostics::tracePrefetch(Address in)
+{
+	bool ok = diagnostics.stored.find(in) != diagnostics.stored.end();
+	CHECK_TEXT(ok, "Invalid prefetch");
+	diagnostics.prefetched.insert(in);
+	diagnostics.nPrefetch++;
+	info << "prefetch " << in << "\n";
+}
+
 template<unsigned int pageSizeParam, class Client, bool strict, bool checkRoot>
 inline void MockStorage<pageSizeParam, Client, strict, checkRoot>::Diagnostics::traceRelease(void* in)
 {
@@ -0,0 +1,66 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2017 Seller Tamás. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *******************************************************************************/
+
+#ifndef PTHREADWRAPPERS_H_
+#define PTHREADWRAPPERS_H_
+
+#include <pthread.h>
+
+struct PthreadMutexWrapper {
+	pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+	pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+	void lock() {
+		pthread_mutex_lock(&mutex);
+	}
+
+	void unlock() {
+		pthread_mutex_unlock(&mutex);
+	}
+
+	void wait() {
+		pthread_cond_wait(&cond, &mutex);
+	}
+
+	void notifyAll() {
+		pthread_cond_broadcast(&cond);
+	}
+};
+
+struct PthreadRWLockWrapper {
+	pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+
+	void rlock() {
+		pthread_rwlock_rdlock(&lock);
+	}
+
+	void runlock() {
+		pthread_rwlock_unlock(&lock);
+	}
+
+	void wlock() {
+		pthread_rwlock_wrlock(&lock);
+	}
+
+	void wunlock() {
+		pthread_rwlock_unlock(&lock);
+	}
+};
+
+#endif /* PTHREADWRAPPERS_H_ */
@@ -569,6 +569,21 @@ TEST(SimpleBarelyThreeLayerTree, RelocateSeventh) {
 	BTreeTestUtils::requireSucces(tree.relocate(page));
 }
 
+TEST(SimpleBarelyThreeLayerTree, RelocateMany) {
+	Storage::Address first = Storage::InvalidAddress, fourth = Storage::InvalidAddress;
+	BTreeTestUtils::requireFailure(BTreeTestUtils::nthAddress(tree, 1, first));
+	BTreeTestUtils::requireFailure(BTreeTestUtils::nthAddress(tree, 4, fourth));
+	CHECK(first != Storage::InvalidAddress && fourth != Storage::InvalidAddress);
+	tree.allowUnnecessary = true;
+
+	pet::GenericError ret = tree.relocateAll([&](Storage::Address addr) {
+		return addr == first || addr == fourth;
+	});
+
+	CHECK(!ret.failed() && ret == 2);
+	BTreeTestUtils::requireKeysAlways(tree, {Key(2), Key(5), Key(8), Key(11), Key(14), Key(17), Key(20), Key(23)});
+}
+
 TEST_GROUP(SimpleFrontHeavyThreeLayerTree) {
 	TestTree tree;
 
@@ -311,6 +311,71 @@ TEST(NinePages, RewriteRoot) {
 	CHECK(!test.tree.relocate(addr).failed());
 }
 
+TEST(NinePages, RewriteMany) {
+	Storage::Address first = test.tree.findNth(1), fourth = test.tree.findNth(5);
+
+	pet::GenericError ret = test.tree.relocateAll([&](Storage::Address addr) {
+		return addr == first || addr == fourth;
+	});
+
+	CHECK(!ret.failed() && ret == 2);
+	CHECK(test.tree.findNth(1) != first);
+	CHECK(test.tree.findNth(5) != fourth);
+
+	for(unsigned int i = 0; i < 9; i++) {
+		pet::FailPointer<void> page = test.tree.read(i);
+		CHECK(!page.failed());
+
+		for(unsigned int j=0; j<Storage::pageSize; j++)
+			CHECK(((unsigned char*)(void*)page)[j] == j);
+
+		test.tree.release(page);
+	}
+}
+
+TEST(NinePages, RewriteStopsAfterChange) {
+	Storage::Address first = test.tree.findNth(1);
+
+	Storage::diagnostics.nRead = 0;
+	CHECK(!test.tree.relocate(first).failed());
+	const unsigned int singleReads = Storage::diagnostics.nRead;
+
+	first = test.tree.findNth(1);
+
+	Storage::diagnostics.nRead = 0;
+	pet::GenericError ret = test.tree.relocateAll([&](Storage::Address addr) {
+		return addr == first;
+	});
+
+	CHECK(!ret.failed() && ret == 1);
+	CHECK(singleReads < Storage::diagnostics.nRead);
+}
+
+TEST(NinePages, ReadAhead) {
+	Storage::diagnostics.prefetched.clear();
+	Storage::diagnostics.nPrefetch = 0;
+
+	test.tree.release(test.tree.read(0, 3));
+
+	CHECK(Storage::diagnostics.nPrefetch == 3);
+	CHECK(Storage::diagnostics.prefetched.count(test.tree.findNth(2)));
+	CHECK(Storage::diagnostics.prefetched.count(test.tree.findNth(3)));
+	CHECK(Storage::diagnostics.prefetched.count(test.tree.findNth(8)));
+}
+
+TEST(NinePages, ReadAheadAtEnd) {
+	Storage::diagnostics.prefetched.clear();
+	Storage::diagnostics.nPrefetch = 0;
+
+	test.tree.release(test.tree.read(7, 5));
+
+	CHECK(Storage::diagnostics.nPrefetch == 1);
+	CHECK(Storage::diagnostics.prefetched.count(test.tree.findNth(11)));
+
+	test.tree.release(test.tree.read(8, 5));
+	CHECK(Storage::diagnostics.nPrefetch == 1);
+}
+
 TEST_GROUP(ManyPages) {
 	TestData test;
 
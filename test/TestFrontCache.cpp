@@ -0,0 +1,306 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2016, 2017 Seller Tamás. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *******************************************************************************/
+
+#include "CppUTest/TestHarness.h"
+#include "CppUTestExt/MockSupport.h"
+
+#include "Wtfs.h"
+
+#include "util/ObjectStream.h"
+#include "pet/test/MockAllocator.h"
+
+#include "MockFlashDriver.h"
+
+#include <iostream>
+#include <cstring>
+
+namespace {
+
+/*
+ * Mixed workload: a large file is read sequentially, while a handful of other
+ * files are looked up by name every now and then. The hit rate of the meta tree
+ * pages shows whether the upper levels of the tree survive the streaming.
+ */
+template <class Replacement, unsigned int builtinBuffers = 16, unsigned int addedBuffers = 0, unsigned int secondaryPages = 0>
+struct CacheBenchmark {
+	struct Config: public DefaultNolockConfig {
+		typedef MockFlashDriver<256, 16, 512> FlashDriver;
+		typedef ::Allocator Allocator;
+		typedef Replacement BufferReplacement;
+		typedef SecondaryPageCache SecondaryCache;
+
+		static constexpr unsigned int nBuffers = builtinBuffers;
+		static constexpr unsigned int maxBuffers = builtinBuffers + addedBuffers;
+		static constexpr unsigned int maxMeta = 5;
+		static constexpr unsigned int maxFile = 5;
+		static constexpr uint32_t maxFilenameLength = 15;
+	};
+
+	struct Fs: public Wtfs<Config> {
+		typename Wtfs<Config>::Buffers inlineBuffers;
+		void* secondaryRegion[secondaryPages * (Config::FlashDriver::pageSize + 64) / sizeof(void*) + 1];
+
+		inline Fs() {
+			if(secondaryPages)
+				CHECK(inlineBuffers.attachSecondaryCache(secondaryRegion, sizeof(secondaryRegion)) >= secondaryPages);
+
+
+			if(addedBuffers)
+				CHECK(this->bind(&inlineBuffers, addedBuffers) == addedBuffers);
+			else
+				this->bind(&inlineBuffers);
+
+			auto x = this->initialize(true);
+			x.failed(); // Nothing to do about it
+		}
+
+		inline ~Fs() {
+			while(inlineBuffers.template shrink<typename Config::Allocator>());
+		}
+	};
+
+	static constexpr unsigned int nFiles = 300;
+	static constexpr unsigned int nBigPages = 240;
+	static constexpr unsigned int pagesPerLookup = 24;
+
+	static void name(char* buffer, unsigned int i) {
+		sprintf(buffer, "file%03u", i);
+	}
+
+	/*
+	 * Hit rate of the meta tree pages in the buffers, and the ratio of
+	 * meta tree page accesses that actually needed reading the flash.
+	 */
+	struct Result {
+		double hitRate, readRate;
+	};
+
+	static Result run() {
+		Fs fs;
+		typename Fs::Node node, bigNode;
+		char buffer[16];
+
+		for(unsigned int i = 0; i < nFiles; i++) {
+			name(buffer, i);
+			CHECK(!fs.fetchRoot(node).failed());
+			CHECK(!fs.newFile(node, buffer, buffer + strlen(buffer)).failed());
+		}
+
+		const char* big = "big";
+		ObjectStream<typename Fs::Stream> stream;
+		CHECK(!fs.fetchRoot(bigNode).failed());
+		CHECK(!fs.newFile(bigNode, big, big + strlen(big)).failed());
+		CHECK(!fs.openStream(bigNode, stream).failed());
+
+		char page[Fs::Buffers::pageSize];
+		memset(page, 'x', sizeof(page));
+
+		for(unsigned int i = 0; i < nBigPages; i++)
+			CHECK(stream.writeCopy(page, sizeof(page)) == sizeof(page));
+
+		CHECK(!fs.flushStream(stream).failed());
+		CHECK(!stream.setPosition(Fs::Stream::Start, 0).failed());
+
+		typename Fs::Buffers::Statistics before = fs.buffers->getStatistics();
+
+		for(unsigned int i = 0; i < nBigPages; i++) {
+			CHECK(stream.readCopy(page, sizeof(page)) == sizeof(page));
+
+			if(i % pagesPerLookup == pagesPerLookup - 1) {
+				for(unsigned int j = 0; j < 4; j++) {
+					name(buffer, (i * 7 + j * 31) % nFiles);
+					CHECK(!fs.fetchRoot(node).failed());
+					CHECK(fs.fetchChildByName(node, buffer, buffer + strlen(buffer)));
+				}
+			}
+		}
+
+		CHECK(!fs.closeStream(stream).failed());
+
+		typename Fs::Buffers::Statistics after = fs.buffers->getStatistics();
+		uint32_t hits = after.metaHits - before.metaHits;
+		uint32_t misses = after.metaMisses - before.metaMisses;
+		uint32_t reads = misses - (after.metaSecondaryHits - before.metaSecondaryHits);
+		return Result{(double)hits / (hits + misses), (double)reads / (hits + misses)};
+	}
+};
+
+
+/*
+ * Name lookups of a small working set of files right after mounting, with or without
+ * warming up the cache using the list of pages recorded before unmounting.
+ */
+struct WarmUpBenchmark {
+	struct Config: public DefaultNolockConfig {
+		typedef MockFlashDriver<256, 16, 128> FlashDriver;
+		typedef ::Allocator Allocator;
+
+		static constexpr unsigned int nBuffers = 16;
+		static constexpr unsigned int maxMeta = 5;
+		static constexpr unsigned int maxFile = 5;
+		static constexpr uint32_t maxFilenameLength = 15;
+	};
+
+	struct Fs: public Wtfs<Config> {
+		typename Wtfs<Config>::Buffers inlineBuffers;
+		inline Fs(bool purge) {
+			this->bind(&inlineBuffers);
+			auto x = this->initialize(purge);
+			x.failed(); // Nothing to do about it
+		}
+	};
+
+	typedef typename Fs::template WarmUpList<12> List;
+
+	static constexpr unsigned int nFiles = 300;
+	static constexpr unsigned int nWorkingSet = 6;
+
+	static unsigned int workingSet(unsigned int i) {
+		return (i * 97 + 13) % nFiles;
+	}
+
+	static void lookup(Fs& fs, unsigned int i) {
+		char buffer[16];
+		typename Fs::Node node;
+		sprintf(buffer, "file%03u", i);
+		CHECK(!fs.fetchRoot(node).failed());
+		CHECK(fs.fetchChildByName(node, buffer, buffer + strlen(buffer)));
+	}
+
+	static List record() {
+		Fs fs(true);
+		typename Fs::Node node;
+		char buffer[16];
+
+		for(unsigned int i = 0; i < nFiles; i++) {
+			sprintf(buffer, "file%03u", i);
+			CHECK(!fs.fetchRoot(node).failed());
+			CHECK(!fs.newFile(node, buffer, buffer + strlen(buffer)).failed());
+		}
+
+		for(unsigned int j = 0; j < 3; j++)
+			for(unsigned int i = 0; i < nWorkingSet; i++)
+				lookup(fs, workingSet(i));
+
+		List ret;
+		fs.recordWarmUp(ret);
+		return ret;
+	}
+
+	static double run(const List* list) {
+		Fs fs(false);
+
+		if(list)
+			CHECK(fs.warmUp(*list) == list->count);
+
+		typename Fs::Buffers::Statistics before = fs.buffers->getStatistics();
+
+		for(unsigned int i = 0; i < nWorkingSet; i++)
+			lookup(fs, workingSet(i));
+
+		typename Fs::Buffers::Statistics after = fs.buffers->getStatistics();
+		uint32_t hits = after.metaHits - before.metaHits;
+		uint32_t misses = after.metaMisses - before.metaMisses;
+		return (double)hits / (hits + misses);
+	}
+};
+
+}
+
+TEST_GROUP(CacheBenchmark) {
+	TEST_SETUP() {
+		mock().disable();
+	}
+
+	TEST_TEARDOWN() {
+		mock().enable();
+	}
+};
+
+TEST(CacheBenchmark, MetaHitRateWhileStreaming) {
+	double lru = CacheBenchmark<LruReplacement>::run().hitRate;
+	double twoQueue = CacheBenchmark<TwoQueueReplacement>::run().hitRate;
+	double levelAware = CacheBenchmark<LevelAwareReplacement<>>::run().hitRate;
+	double partitioned = CacheBenchmark<PartitionedReplacement<>>::run().hitRate;
+
+	std::cout << std::endl << "meta tree hit rate while streaming: "
+			<< "lru " << (int)(lru * 100) << "%, "
+			<< "2q " << (int)(twoQueue * 100) << "%, "
+			<< "level aware " << (int)(levelAware * 100) << "%, "
+			<< "partitioned " << (int)(partitioned * 100) << "%" << std::endl;
+
+	CHECK(twoQueue > lru);
+	CHECK(levelAware > lru);
+	CHECK(partitioned > lru);
+}
+
+TEST(CacheBenchmark, RuntimePool) {
+	double builtin = CacheBenchmark<LruReplacement>::run().hitRate;
+	double allocated = CacheBenchmark<LruReplacement, 0, 16>::run().hitRate;
+	double grown = CacheBenchmark<LruReplacement, 16, 32>::run().hitRate;
+
+	std::cout << std::endl << "meta tree hit rate with run-time buffers: "
+			<< "16 built-in " << (int)(builtin * 100) << "%, "
+			<< "16 allocated " << (int)(allocated * 100) << "%, "
+			<< "16 + 32 allocated " << (int)(grown * 100) << "%" << std::endl;
+
+	CHECK(allocated == builtin);
+	CHECK(grown > builtin);
+}
+
+TEST(CacheBenchmark, SecondaryCache) {
+	auto primaryOnly = CacheBenchmark<LruReplacement>::run();
+	auto secondary = CacheBenchmark<LruReplacement, 16, 0, 64>::run();
+
+	std::cout << std::endl << "meta tree pages read from flash while streaming: "
+			<< "16 buffers " << (int)(primaryOnly.readRate * 100) << "%, "
+			<< "16 buffers + 64 second level " << (int)(secondary.readRate * 100) << "%" << std::endl;
+
+	CHECK(secondary.hitRate == primaryOnly.hitRate);
+	CHECK(secondary.readRate < primaryOnly.readRate);
+}
+
+TEST(CacheBenchmark, WarmUpAfterMount) {
+	WarmUpBenchmark::List list = WarmUpBenchmark::record();
+	CHECK(list.count == 12);
+
+	double cold = WarmUpBenchmark::run(0);
+	double warm = WarmUpBenchmark::run(&list);
+
+	std::cout << std::endl << "meta tree hit rate right after mount: "
+			<< "cold " << (int)(cold * 100) << "%, "
+			<< "warmed up " << (int)(warm * 100) << "%" << std::endl;
+
+	CHECK(warm > cold);
+
+	/*
+	 * The list is not used after the filesystem is modified.
+	 */
+	{
+		WarmUpBenchmark::Fs fs(false);
+		WarmUpBenchmark::Fs::Node node;
+		const char* name = "new";
+		CHECK(!fs.fetchRoot(node).failed());
+		CHECK(!fs.newFile(node, name, name + strlen(name)).failed());
+		fs.buffers->flush();
+	}
+
+	WarmUpBenchmark::Fs fs(false);
+	CHECK(fs.warmUp(list) == 0);
+}
@@ -12,41 +12,11 @@
 #include "Wtfs.h"
 #include "util/ObjectStream.h"
 #include "FrontPlainDummies.h"
+#include "PthreadWrappers.h"
 
 namespace {
 typedef PlainDummyFlashDriver<256, 4, 10> FlashDriver;
 
-struct PthreadMutexWrapper {
-	pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-	void lock() {
-		pthread_mutex_lock(&mutex);
-	}
-
-	void unlock() {
-		pthread_mutex_unlock(&mutex);
-	}
-};
-
-struct PthreadRWLockWrapper {
-	pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
-
-	void rlock() {
-		pthread_rwlock_rdlock(&lock);
-	}
-
-	void runlock() {
-		pthread_rwlock_unlock(&lock);
-	}
-
-	void wlock() {
-		pthread_rwlock_wrlock(&lock);
-	}
-
-	void wunlock() {
-		pthread_rwlock_unlock(&lock);
-	}
-};
-
 struct Config: public DefaultRwlockConfig<PthreadMutexWrapper, PthreadRWLockWrapper> {
 	typedef ::PlainDummyAllocator Allocator;
 	typedef ::FlashDriver FlashDriver;
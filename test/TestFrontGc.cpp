@@ -245,3 +245,278 @@ TEST(GcCombined, MultiplesLevelsGcTrigger) {
 	bar.pokeRead(times);
 	baz.pokeRead(times);
 }
+
+namespace {
+
+/*
+ * Steady state random updates of fixed size records in a file that takes up most of the
+ * device, where most of the updates hit a small part of the records. The number of blocks
+ * erased for the same updates shows the write amplification caused by the collector, the
+ * most pages written by a single update shows the worst case latency of the writes.
+ */
+template <class VictimSelection, uint32_t stepBudget = 0>
+struct UpdateBenchmark {
+	struct Config: public DefaultNolockConfig {
+		typedef MockFlashDriver<256, 8, 64> FlashDriver;
+		typedef ::Allocator Allocator;
+		typedef VictimSelection GcVictimSelection;
+
+		static constexpr unsigned int nBuffers = 16;
+		static constexpr unsigned int maxMeta = 3;
+		static constexpr unsigned int maxFile = 3;
+		static constexpr uint32_t maxFilenameLength = 15;
+		static constexpr uint32_t hotRewriteCount = -1u;
+	};
+
+	struct Fs: public Wtfs<Config> {
+		typename Wtfs<Config>::Buffers inlineBuffers;
+		inline Fs() {
+			this->bind(&inlineBuffers);
+			auto x = this->initialize(true);
+			x.failed(); // Nothing to do about it
+		}
+	};
+
+	static constexpr unsigned int recordSize = 64;
+	static constexpr unsigned int nRecords = 1200;
+	static constexpr unsigned int nHotRecords = nRecords / 10;
+	static constexpr unsigned int nWarmUp = 2000;
+	static constexpr unsigned int nUpdates = 4000;
+
+	static uint32_t erases(Fs& fs) {
+		uint32_t ret = 0;
+		for(unsigned int i = 0; i < Config::FlashDriver::deviceSize; i++)
+			ret += fs.getEraseCount(i);
+
+		return ret;
+	}
+
+	struct Result {
+		uint32_t erases, worstWrites;
+	};
+
+	static Result run() {
+		Fs fs;
+		typename Fs::Node node;
+		ObjectStream<typename Fs::Stream> stream;
+		char record[recordSize];
+		uint32_t random = 12345, before = 0;
+		Result ret{0, 0};
+
+		const char* name = "records";
+		CHECK(!fs.fetchRoot(node).failed());
+		CHECK(!fs.newFile(node, name, name + strlen(name)).failed());
+		CHECK(!fs.openStream(node, stream).failed());
+
+		memset(record, 'r', sizeof(record));
+		for(unsigned int i = 0; i < nRecords; i++)
+			CHECK(stream.writeCopy(record, sizeof(record)) == sizeof(record));
+
+		CHECK(!fs.flushStream(stream).failed());
+
+		for(unsigned int i = 0; i < nWarmUp + nUpdates; i++) {
+			if(i == nWarmUp)
+				before = erases(fs);
+
+			random = random * 1103515245 + 12345;
+			const uint32_t r = random >> 8;
+			const unsigned int idx = (r % 10) ? (r / 10 % nHotRecords) : (r / 10 % nRecords);
+
+			const uint32_t start = fs.getWriteClock();
+
+			memset(record, 'a' + i % 26, sizeof(record));
+			CHECK(!stream.setPosition(Fs::Stream::Start, idx * recordSize).failed());
+			CHECK(stream.writeCopy(record, sizeof(record)) == sizeof(record));
+			CHECK(!fs.flushStream(stream).failed());
+			fs.buffers->flush();
+
+			if(i >= nWarmUp && fs.getWriteClock() - start > ret.worstWrites)
+				ret.worstWrites = fs.getWriteClock() - start;
+
+			if(stepBudget)
+				CHECK(!fs.collectGarbageStep(stepBudget).failed());
+		}
+
+		CHECK(!fs.closeStream(stream).failed());
+
+		ret.erases = erases(fs) - before;
+		return ret;
+	}
+};
+
+
+/*
+ * Random updates of many small files, so that the blocks freed up by the collector hold
+ * pages of lots of different files (most of them garbage). The number of pages read shows
+ * the cost of finding out the owners of the pages to be moved.
+ */
+template <bool summaries>
+struct OwnerBenchmark {
+	struct Config: public DefaultNolockConfig {
+		struct FlashDriver: MockFlashDriver<256, 16, 64> {
+			static uint32_t& reads() {
+				static uint32_t count = 0;
+				return count;
+			}
+
+			static void read(unsigned int addr, void* data) {
+				reads()++;
+				MockFlashDriver<256, 16, 64>::read(addr, data);
+			}
+		};
+
+		typedef ::Allocator Allocator;
+
+		static constexpr unsigned int nBuffers = 64;
+		static constexpr unsigned int maxMeta = 3;
+		static constexpr unsigned int maxFile = 3;
+		static constexpr uint32_t maxFilenameLength = 15;
+		static constexpr uint32_t hotRewriteCount = -1u;
+		static constexpr bool blockSummary = summaries;
+	};
+
+	struct Fs: public Wtfs<Config> {
+		typename Wtfs<Config>::Buffers inlineBuffers;
+		inline Fs(bool purge = true) {
+			this->bind(&inlineBuffers);
+			auto x = this->initialize(purge);
+			x.failed(); // Nothing to do about it
+		}
+	};
+
+	static constexpr unsigned int recordSize = 200;
+	static constexpr unsigned int nRecords = 4;
+	static constexpr unsigned int nFiles = 120;
+	static constexpr unsigned int nUpdates = 3000;
+
+	static void open(Fs& fs, typename Fs::Node& node, ObjectStream<typename Fs::Stream>& stream, unsigned int i) {
+		char name[16];
+		sprintf(name, "f%03u", i);
+		CHECK(!fs.fetchRoot(node).failed());
+		CHECK(fs.fetchChildByName(node, name, name + strlen(name)));
+		CHECK(!fs.openStream(node, stream).failed());
+	}
+
+	static void verify(Fs& fs, const char (*expected)[nRecords]) {
+		typename Fs::Node node;
+		ObjectStream<typename Fs::Stream> stream;
+		char record[recordSize];
+
+		for(unsigned int i = 0; i < nFiles; i++) {
+			open(fs, node, stream, i);
+
+			for(unsigned int j = 0; j < nRecords; j++) {
+				CHECK(stream.readCopy(record, sizeof(record)) == sizeof(record));
+
+				for(unsigned int k = 0; k < recordSize; k++)
+					CHECK(record[k] == expected[i][j]);
+			}
+
+			CHECK(!fs.closeStream(stream).failed());
+		}
+	}
+
+	struct Result {
+		uint32_t reads, erases;
+	};
+
+	static Result run() {
+		Fs fs;
+		typename Fs::Node node;
+		ObjectStream<typename Fs::Stream> stream;
+		char record[recordSize], name[16];
+		char expected[nFiles][nRecords];
+		uint32_t random = 12345;
+
+		for(unsigned int i = 0; i < nFiles; i++) {
+			sprintf(name, "f%03u", i);
+			CHECK(!fs.fetchRoot(node).failed());
+			CHECK(!fs.newFile(node, name, name + strlen(name)).failed());
+			CHECK(!fs.openStream(node, stream).failed());
+
+			memset(record, 'r', sizeof(record));
+			for(unsigned int j = 0; j < nRecords; j++) {
+				CHECK(stream.writeCopy(record, sizeof(record)) == sizeof(record));
+				expected[i][j] = 'r';
+			}
+
+			CHECK(!fs.closeStream(stream).failed());
+		}
+
+		const uint32_t readsBefore = Config::FlashDriver::reads();
+		uint32_t erasesBefore = 0;
+		for(unsigned int i = 0; i < Config::FlashDriver::deviceSize; i++)
+			erasesBefore += fs.getEraseCount(i);
+
+		for(unsigned int i = 0; i < nUpdates; i++) {
+			random = random * 1103515245 + 12345;
+			const uint32_t r = random >> 8;
+			const unsigned int file = r % nFiles, idx = r / nFiles % nRecords;
+
+			open(fs, node, stream, file);
+			memset(record, 'a' + i % 26, sizeof(record));
+			expected[file][idx] = 'a' + i % 26;
+			CHECK(!stream.setPosition(Fs::Stream::Start, idx * recordSize).failed());
+			CHECK(stream.writeCopy(record, sizeof(record)) == sizeof(record));
+			CHECK(!fs.closeStream(stream).failed());
+			fs.buffers->flush();
+		}
+
+		Result ret{Config::FlashDriver::reads() - readsBefore, 0};
+		for(unsigned int i = 0; i < Config::FlashDriver::deviceSize; i++)
+			ret.erases += fs.getEraseCount(i);
+
+		ret.erases -= erasesBefore;
+
+		verify(fs, expected);
+		fs.buffers->flush();
+
+		Fs mounted(false);
+		verify(mounted, expected);
+		return ret;
+	}
+};
+}
+
+TEST_GROUP(GcBenchmark) {
+	TEST_SETUP() {
+		mock().disable();
+	}
+
+	TEST_TEARDOWN() {
+		mock().enable();
+	}
+};
+
+TEST(GcBenchmark, VictimSelection) {
+	uint32_t greedy = UpdateBenchmark<GreedyVictimSelection>::run().erases;
+	uint32_t costBenefit = UpdateBenchmark<CostBenefitVictimSelection>::run().erases;
+
+	std::cout << std::endl << "blocks erased for skewed updates: "
+			<< "greedy " << greedy << ", "
+			<< "cost-benefit " << costBenefit << std::endl;
+
+	CHECK(costBenefit < greedy);
+}
+
+TEST(GcBenchmark, BackgroundSteps) {
+	auto blocking = UpdateBenchmark<GreedyVictimSelection>::run();
+	auto background = UpdateBenchmark<GreedyVictimSelection, 16>::run();
+
+	std::cout << std::endl << "most pages written by an update (blocks erased): "
+			<< "blocking gc only " << blocking.worstWrites << " (" << blocking.erases << "), "
+			<< "with background steps " << background.worstWrites << " (" << background.erases << ")" << std::endl;
+
+	CHECK(background.worstWrites < blocking.worstWrites);
+}
+
+TEST(GcBenchmark, BlockSummary) {
+	auto plain = OwnerBenchmark<false>::run();
+	auto summarized = OwnerBenchmark<true>::run();
+
+	std::cout << std::endl << "pages read for updating small files (blocks erased): "
+			<< "without summaries " << plain.reads << " (" << plain.erases << "), "
+			<< "with block summaries " << summarized.reads << " (" << summarized.erases << ")" << std::endl;
+
+	CHECK(summarized.reads < plain.reads);
+}
@@ -71,3 +71,69 @@ TEST(MountWoGc, RereadThenWrite) {
 	bar.close();
 }
 
+
+TEST_GROUP(MountHot) {
+	using Helpers = GcTestHelpers<256, 4, 32, 4, 2, 2>;
+	using Fs = typename Helpers::Fs;
+	using NodeStream = typename Helpers::NodeStream;
+	using Config = typename Helpers::Config;
+
+	TEST_SETUP() {
+		mock().disable();
+	}
+};
+
+TEST(MountHot, HotHeadsRestored) {
+	using FlashDriver = typename Config::FlashDriver;
+
+	Fs::State before;
+
+	{
+		Fs fs;
+		typename Fs::Node node;
+		ObjectStream<typename Fs::Stream> stream;
+		char data[300];
+		memset(data, 'h', sizeof(data));
+
+		NodeStream bar(fs, "bar");
+		bar.pokeWrite(2);
+
+		CHECK(!fs.fetchRoot(node).failed());
+		CHECK(!fs.newFile(node, "foo", "foo" + 3, Fs::Hot).failed());
+		CHECK(!fs.openStream(node, stream).failed());
+		CHECK(stream.writeCopy(data, sizeof(data)) == sizeof(data));
+		CHECK(!fs.closeStream(stream).failed());
+
+		bar.pokeAppend(2);
+
+		fs.buffers->flush();
+		before = fs.gatherState();
+	}
+
+	Fs fs(false);
+	Fs::State after = fs.gatherState();
+	unsigned int hotHeads = 0;
+
+	auto check = [&](const typename Fs::State::BlockAllocation &head, unsigned int i) {
+		if(head.addr == -1u || !head.count || head.count == FlashDriver::blockSize)
+			return;
+
+		const typename Fs::State::BlockAllocation *restored =
+				(after.allocations[i].addr == head.addr) ? &after.allocations[i] :
+				(after.hotAllocations[i].addr == head.addr) ? &after.hotAllocations[i] : 0;
+
+		CHECK(restored);
+		CHECK(restored->count == head.count);
+		CHECK(after.registeredUsage[head.addr] == after.actualUsage[head.addr] + FlashDriver::blockSize - head.count);
+	};
+
+	for(unsigned int i = 0; i < Config::maxFile; i++) {
+		if(before.hotAllocations[i].addr != -1u && before.hotAllocations[i].count)
+			hotHeads++;
+
+		check(before.allocations[i], i);
+		check(before.hotAllocations[i], i);
+	}
+
+	CHECK(hotHeads);
+}
@@ -18,6 +18,7 @@
  *******************************************************************************/
 
 #include "CppUTest/TestHarness.h"
+#include "CppUTestExt/MockSupport.h"
 
 #include "Wtfs.h"
 
@@ -44,3 +45,52 @@ struct Fs: public Wtfs<Config> {
 };
 
 FS_STREAM_TEST_TEMPLATE(Fs)
+
+/*
+ * More streams kept open than there are buffers, the idle ones give back theirs.
+ */
+TEST_GROUP(StreamMany) {
+	TEST_SETUP() {
+		mock().disable();
+	}
+
+	TEST_TEARDOWN() {
+		mock().enable();
+	}
+};
+
+TEST(StreamMany, MoreThanBuffers) {
+	static constexpr unsigned int nStreams = 2 * Config::nBuffers;
+	Fs fs;
+	Fs::Node nodes[nStreams];
+	ObjectStream<Fs::Stream> streams[nStreams];
+	char name[8], data[8], buffer[8];
+
+	for(unsigned int i = 0; i < nStreams; i++) {
+		sprintf(name, "f%02u", i);
+		CHECK(!fs.fetchRoot(nodes[i]).failed());
+		CHECK(!fs.newFile(nodes[i], name, name + strlen(name)).failed());
+		CHECK(!fs.openStream(nodes[i], streams[i]).failed());
+	}
+
+	for(unsigned int j = 0; j < 2; j++) {
+		for(unsigned int i = 0; i < nStreams; i++) {
+			sprintf(data, "%03u-%03u", i, j);
+			CHECK(streams[i].writeCopy(data, sizeof(data)) == sizeof(data));
+		}
+	}
+
+	for(unsigned int i = 0; i < nStreams; i++)
+		CHECK(!streams[i].setPosition(Fs::Stream::Start, 0).failed());
+
+	for(unsigned int j = 0; j < 2; j++) {
+		for(unsigned int i = 0; i < nStreams; i++) {
+			sprintf(data, "%03u-%03u", i, j);
+			CHECK(streams[i].readCopy(buffer, sizeof(buffer)) == sizeof(buffer));
+			CHECK(memcmp(data, buffer, sizeof(data)) == 0);
+		}
+	}
+
+	for(unsigned int i = 0; i < nStreams; i++)
+		CHECK(!fs.closeStream(streams[i]).failed());
+}
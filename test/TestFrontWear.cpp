@@ -0,0 +1,287 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2016, 2017 Seller Tamás. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *******************************************************************************/
+
+#include "CppUTest/TestHarness.h"
+#include "CppUTestExt/MockSupport.h"
+
+#include "Wtfs.h"
+
+#include "util/ObjectStream.h"
+#include "pet/test/MockAllocator.h"
+
+#include "MockFlashDriver.h"
+
+#include <iostream>
+#include <cstring>
+
+namespace {
+
+/*
+ * Half of the device is filled with static files, then a small file is rewritten over
+ * and over again. The distribution of the erase counts of the blocks shows whether the
+ * blocks holding the static data take their share of the wear.
+ */
+template <unsigned int candidates, unsigned int interval, unsigned int spread>
+struct WearBenchmark {
+	struct Config: public DefaultNolockConfig {
+		typedef MockFlashDriver<256, 8, 64> FlashDriver;
+		typedef ::Allocator Allocator;
+
+		static constexpr unsigned int nBuffers = 16;
+		static constexpr unsigned int maxMeta = 3;
+		static constexpr unsigned int maxFile = 2;
+		static constexpr uint32_t maxFilenameLength = 15;
+
+		static constexpr uint32_t freeBlockCandidates = candidates;
+		static constexpr uint32_t wearCheckInterval = interval;
+		static constexpr uint32_t maxWearSpread = spread;
+	};
+
+	struct Fs: public Wtfs<Config> {
+		typename Wtfs<Config>::Buffers inlineBuffers;
+		inline Fs() {
+			this->bind(&inlineBuffers);
+			auto x = this->initialize(true);
+			x.failed(); // Nothing to do about it
+		}
+	};
+
+	static constexpr unsigned int nStaticFiles = 12;
+	static constexpr unsigned int staticPages = 20;
+	static constexpr unsigned int nUpdates = 3000;
+
+	/*
+	 * The highest erase count, and the number of blocks that were never reused.
+	 */
+	struct Result {
+		uint32_t max, unused;
+	};
+
+	static Result run() {
+		Fs fs;
+		typename Fs::Node node;
+		ObjectStream<typename Fs::Stream> stream;
+		char name[16], page[Fs::Buffers::pageSize];
+
+		for(unsigned int i = 0; i < nStaticFiles; i++) {
+			sprintf(name, "static%02u", i);
+			CHECK(!fs.fetchRoot(node).failed());
+			CHECK(!fs.newFile(node, name, name + strlen(name)).failed());
+			CHECK(!fs.openStream(node, stream).failed());
+
+			memset(page, 's', sizeof(page));
+			for(unsigned int j = 0; j < staticPages; j++)
+				CHECK(stream.writeCopy(page, sizeof(page)) == sizeof(page));
+
+			CHECK(!fs.closeStream(stream).failed());
+		}
+
+		const char* hot = "hot";
+		CHECK(!fs.fetchRoot(node).failed());
+		CHECK(!fs.newFile(node, hot, hot + strlen(hot)).failed());
+		CHECK(!fs.openStream(node, stream).failed());
+
+		for(unsigned int i = 0; i < nUpdates; i++) {
+			memset(page, 'a' + i % 26, 64);
+			CHECK(!stream.setPosition(Fs::Stream::Start, 0).failed());
+			CHECK(stream.writeCopy(page, 64) == 64);
+			CHECK(!fs.flushStream(stream).failed());
+			fs.buffers->flush();
+		}
+
+		CHECK(!fs.closeStream(stream).failed());
+
+		Result ret{0, 0};
+		for(unsigned int i = 0; i < Config::FlashDriver::deviceSize; i++) {
+			uint32_t count = fs.getEraseCount(i);
+
+			if(count <= 1)
+				ret.unused++;
+
+			if(count > ret.max)
+				ret.max = count;
+		}
+
+		return ret;
+	}
+};
+
+/*
+ * Static files are written while a small file is being rewritten all the time (like
+ * a log next to a firmware update), then the small file is rewritten some more. The
+ * number of blocks erased in the meantime shows how much the garbage collector had
+ * to copy around, as the user data written is the same in both cases.
+ */
+template <unsigned int rewrites, bool flagged = false>
+struct SeparationBenchmark {
+	struct Config: public DefaultNolockConfig {
+		typedef MockFlashDriver<256, 8, 64> FlashDriver;
+		typedef ::Allocator Allocator;
+
+		static constexpr unsigned int nBuffers = 16;
+		static constexpr unsigned int maxMeta = 3;
+		static constexpr unsigned int maxFile = 2;
+		static constexpr uint32_t maxFilenameLength = 15;
+
+		static constexpr uint32_t hotRewriteCount = rewrites;
+	};
+
+	struct Fs: public Wtfs<Config> {
+		typename Wtfs<Config>::Buffers inlineBuffers;
+		inline Fs() {
+			this->bind(&inlineBuffers);
+			auto x = this->initialize(true);
+			x.failed(); // Nothing to do about it
+		}
+	};
+
+	static constexpr unsigned int nStaticFiles = 12;
+	static constexpr unsigned int staticPages = 20;
+	static constexpr unsigned int nUpdates = 1500;
+
+	static void update(Fs& fs, ObjectStream<typename Fs::Stream>& stream, unsigned int i) {
+		char record[64];
+		memset(record, 'a' + i % 26, sizeof(record));
+		CHECK(!stream.setPosition(Fs::Stream::Start, 0).failed());
+		CHECK(stream.writeCopy(record, sizeof(record)) == sizeof(record));
+		CHECK(!fs.flushStream(stream).failed());
+		fs.buffers->flush();
+	}
+
+	static uint32_t run() {
+		Fs fs;
+		typename Fs::Node node, hotNode;
+		ObjectStream<typename Fs::Stream> stream, hotStream;
+		char name[16], page[Fs::Buffers::pageSize];
+		unsigned int n = 0;
+
+		const char* hot = "hot";
+		CHECK(!fs.fetchRoot(hotNode).failed());
+		CHECK(!fs.newFile(hotNode, hot, hot + strlen(hot)).failed());
+		CHECK(!fs.openStream(hotNode, hotStream, flagged ? Fs::Hot : Fs::Auto).failed());
+
+		uint32_t before = 0;
+		for(unsigned int i = 0; i < Config::FlashDriver::deviceSize; i++)
+			before += fs.getEraseCount(i);
+
+		for(unsigned int i = 0; i < nStaticFiles; i++) {
+			sprintf(name, "static%02u", i);
+			CHECK(!fs.fetchRoot(node).failed());
+			CHECK(!fs.newFile(node, name, name + strlen(name)).failed());
+			CHECK(!fs.openStream(node, stream).failed());
+
+			memset(page, 's', sizeof(page));
+			for(unsigned int j = 0; j < staticPages; j++) {
+				CHECK(stream.writeCopy(page, sizeof(page)) == sizeof(page));
+				update(fs, hotStream, n++);
+			}
+
+			CHECK(!fs.closeStream(stream).failed());
+		}
+
+		while(n < nUpdates)
+			update(fs, hotStream, n++);
+
+		CHECK(!fs.closeStream(hotStream).failed());
+
+		uint32_t after = 0;
+		for(unsigned int i = 0; i < Config::FlashDriver::deviceSize; i++)
+			after += fs.getEraseCount(i);
+
+		return after - before;
+	}
+};
+
+}
+
+TEST_GROUP(WearBenchmark) {
+	TEST_SETUP() {
+		mock().disable();
+	}
+
+	TEST_TEARDOWN() {
+		mock().enable();
+	}
+};
+
+TEST(WearBenchmark, EraseCountSpread) {
+	auto dynamic = WearBenchmark<8, -1u, -1u>::run();
+	auto leveled = WearBenchmark<8, 16, 8>::run();
+
+	std::cout << std::endl << "highest erase count (blocks never reused): "
+			<< "free blocks only " << dynamic.max << " (" << dynamic.unused << "), "
+			<< "with cold data migration " << leveled.max << " (" << leveled.unused << ")" << std::endl;
+
+	CHECK(leveled.max < dynamic.max);
+	CHECK(leveled.unused < dynamic.unused);
+}
+
+TEST(WearBenchmark, TemperatureFollowsTheFile) {
+	typedef WtfsTestHelper<SeparationBenchmark<-1u>::Config> Helper;
+
+	struct Fs: SeparationBenchmark<-1u>::Fs {
+		using SeparationBenchmark<-1u>::Fs::fetchById;
+	};
+
+	Fs fs;
+	typename Fs::Node node, other;
+	ObjectStream<typename Fs::Stream> stream, otherStream;
+
+	CHECK(!fs.fetchRoot(node).failed());
+	CHECK(!fs.newFile(node, "hot", "hot" + 3, Fs::Hot).failed());
+	const typename Fs::NodeId hotId = node.getId();
+	CHECK(Helper::allocationTemperature(node) == 1);
+
+	CHECK(!fs.fetchRoot(node).failed());
+	CHECK(!fs.newFile(node, "cold", "cold" + 4).failed());
+	CHECK(Helper::allocationTemperature(node) == 0);
+
+	CHECK(!fs.openStream(node, stream, Fs::Hot).failed());
+	CHECK(Helper::allocationTemperature(node) == 1);
+
+	/*
+	 * A failed open leaves the node alone.
+	 */
+	CHECK(!fs.fetchRoot(other).failed());
+	CHECK(!fs.fetchChildByName(other, "cold", "cold" + 4).failed());
+	CHECK(fs.openStream(other, otherStream, Fs::Hot).failed());
+	CHECK(Helper::allocationTemperature(other) == 0);
+
+	CHECK(!fs.closeStream(stream).failed());
+
+	/*
+	 * Fetching another file into the node forgets the flag of the previous one.
+	 */
+	CHECK(!fs.fetchById(node, 0, hotId).failed());
+	CHECK(Helper::allocationTemperature(node) == 0);
+}
+
+TEST(WearBenchmark, HotColdSeparation) {
+	uint32_t mixed = SeparationBenchmark<-1u>::run();
+	uint32_t flagged = SeparationBenchmark<-1u, true>::run();
+	uint32_t separated = SeparationBenchmark<2>::run();
+
+	std::cout << std::endl << "blocks erased for the same updates: "
+			<< "hot and cold data mixed " << mixed << ", "
+			<< "flagged as hot " << flagged << ", "
+			<< "detected as hot " << separated << std::endl;
+
+	CHECK(flagged < mixed);
+	CHECK(separated < mixed);
+}
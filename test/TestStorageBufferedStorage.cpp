@@ -21,11 +21,15 @@
 #include "CppUTestExt/MockSupport.h"
 
 #include "MockFlashDriver.h"
+#include "PthreadWrappers.h"
+#include "ThreadedFlashDriver.h"
+
+#include <cstdlib>
 
 #include "storage/BufferedStorage.h"
 #include "front/ConfigHelpers.h"
 
-typedef MockFlashDriver<1, 1, 1> FlashDriver;
+typedef MockFlashDriver<16, 1, 1024> FlashDriver;
 
 namespace {
 	struct MockStorageManager {
@@ -41,30 +45,42 @@ namespace {
 		}
 	};
 
-	typedef BufferedStorage<FlashDriver, MockStorageManager, DefaultNolockConfig::Mutex, 2> MockedBufferedStorage;
-
-	struct TestData: private MockedBufferedStorage::Initializer {
-		MockedBufferedStorage storage;
-		MockStorageManager manager;
-		TestData() {
-			MockedBufferedStorage::Initializer::initialize(&storage, &manager);
+	/*
+	 * The storage under test along with its storage manager.
+	 */
+	template<class Storage, class Manager = MockStorageManager>
+	struct StorageTestData: private Storage::Initializer {
+		Storage storage;
+		Manager manager;
+		StorageTestData() {
+			Storage::Initializer::initialize(&storage, &manager);
 		}
 	};
-}
 
-TEST_GROUP(BufferedStorageEmpty) {
-	TestData* test;
+	/*
+	 * Common base of the test groups, creates the test data for each
+	 * test and checks the expectations of the mocks afterwards.
+	 */
+	template<class Data>
+	struct StorageTestGroup: Utest {
+		Data* test;
 
-	TEST_SETUP() {
-		test = new TestData;
-	}
+		TEST_SETUP() {
+			test = new Data;
+		}
 
-	TEST_TEARDOWN() {
-		mock().checkExpectations();
-		mock().clear();
-		delete test;
-	}
-};
+		TEST_TEARDOWN() {
+			mock().checkExpectations();
+			mock().clear();
+			delete test;
+		}
+	};
+
+	typedef BufferedStorage<FlashDriver, MockStorageManager, DefaultNolockConfig::Mutex, 2> MockedBufferedStorage;
+	typedef StorageTestData<MockedBufferedStorage> TestData;
+}
+
+TEST_GROUP_BASE(BufferedStorageEmpty, StorageTestGroup<TestData>) {};
 
 TEST(BufferedStorageEmpty, Exhaust) {
 	CHECK(test->storage.find(FlashDriver::InvalidAddress) != 0);
@@ -193,12 +209,721 @@ TEST(BufferedStorageEmpty, evictCleanForEmpty) {
 	test->storage.flush();
 }
 
-TEST_GROUP(BufferedStorageFull) {
-	TestData* test;
+TEST(BufferedStorageEmpty, staleCopyWiped) {
+	mock("FlashDriver").expectOneCall("read").withIntParameter("addr", 0);
+	MockedBufferedStorage::Buffer* stale = test->storage.find(0);
+	test->storage.release(stale, BufferReleaseCondition::Clean);
+
+	MockedBufferedStorage::Buffer* buffer = test->storage.find(FlashDriver::InvalidAddress);
+	CHECK(buffer != stale);
+	buffer->data.level = 3;
+
+	mock("StorageManager").expectOneCall("allocate").withIntParameter("level", 3);
+	CHECK(test->storage.release(buffer, BufferReleaseCondition::Dirty) == 0);
+
+	CHECK(test->storage.find(0) == buffer);
+	CHECK(test->storage.find(FlashDriver::InvalidAddress) == stale);
+}
+
+namespace {
+	struct UnallocatingStorageManager: MockStorageManager {
+		bool unallocate(FlashDriver::Address addr) {
+			mock("StorageManager").actualCall("unallocate").withIntParameter("addr", addr);
+			return addr + 1 == this->addr;
+		}
+	};
+}
+
+TEST(BufferedStorageEmpty, purgedBeforeWrittenUnallocated) {
+	typedef BufferedStorage<FlashDriver, UnallocatingStorageManager, DefaultNolockConfig::Mutex, 2> UnallocatingBufferedStorage;
+
+	StorageTestData<UnallocatingBufferedStorage, UnallocatingStorageManager> data;
+
+	UnallocatingBufferedStorage::Buffer* buffer = data.storage.find(FlashDriver::InvalidAddress);
+	buffer->data.level = 0;
+	mock("StorageManager").expectOneCall("allocate").withIntParameter("level", 0);
+	CHECK(data.storage.release(buffer, BufferReleaseCondition::Dirty) == 0);
+
+	buffer = data.storage.find(0);
+	mock("StorageManager").expectOneCall("unallocate").withIntParameter("addr", 0);
+	data.storage.release(buffer, BufferReleaseCondition::Purge);
+	mock().checkExpectations();
+
+	/*
+	 * Once it is written it has to be reclaimed.
+	 */
+	buffer = data.storage.find(FlashDriver::InvalidAddress);
+	buffer->data.level = 0;
+	mock("StorageManager").expectOneCall("allocate").withIntParameter("level", 0);
+	CHECK(data.storage.release(buffer, BufferReleaseCondition::Dirty) == 1);
+
+	mock("FlashDriver").expectOneCall("write").withIntParameter("addr", 1);
+	data.storage.flush();
+
+	buffer = data.storage.find(1);
+	mock("StorageManager").expectOneCall("reclaim").withIntParameter("addr", 1);
+	data.storage.release(buffer, BufferReleaseCondition::Purge);
+}
+
+TEST(BufferedStorageEmpty, cleanLeaseRevoked) {
+	MockedBufferedStorage::Lease lease1, lease2;
+
+	mock("FlashDriver").expectOneCall("read").withIntParameter("addr", 100);
+	MockedBufferedStorage::Buffer* buffer1 = test->storage.find(100);
+	mock("FlashDriver").expectOneCall("read").withIntParameter("addr", 200);
+	MockedBufferedStorage::Buffer* buffer2 = test->storage.find(200);
+	CHECK(test->storage.getAvailableCount() == 0);
+
+	test->storage.lease(&lease1, buffer1, false);
+	test->storage.lease(&lease2, buffer2, false);
+	CHECK(test->storage.getAvailableCount() == 2);
+
+	/*
+	 * Resumed before being revoked.
+	 */
+	CHECK(test->storage.resume(&lease2) == buffer2);
+
+	/*
+	 * The other one is taken when needed, after which it can not be resumed.
+	 */
+	mock("FlashDriver").expectOneCall("read").withIntParameter("addr", 300);
+	CHECK(test->storage.find(300) == buffer1);
+	CHECK(test->storage.resume(&lease1) == 0);
+	CHECK(test->storage.find(FlashDriver::InvalidAddress) == 0);
+}
+
+TEST(BufferedStorageEmpty, dirtyLeaseNotRevoked) {
+	MockedBufferedStorage::Lease lease;
+	lease.owner = &lease;
+
+	MockedBufferedStorage::Buffer* buffer1 = test->storage.find(FlashDriver::InvalidAddress);
+	MockedBufferedStorage::Buffer* buffer2 = test->storage.find(FlashDriver::InvalidAddress);
+	test->storage.lease(&lease, buffer1, true);
+	CHECK(test->storage.getAvailableCount() == 0);
+	CHECK(test->storage.find(FlashDriver::InvalidAddress) == 0);
+
+	/*
+	 * Written back by the holder of the lease, like an idle stream would be.
+	 */
+	MockedBufferedStorage::Lease* taken = test->storage.takeDirtyLease();
+	CHECK(taken == &lease);
+	CHECK(taken->owner == &lease);
+	CHECK(test->storage.takeDirtyLease() == 0);
+
+	buffer1->data.level = -1;
+	mock("StorageManager").expectOneCall("allocate").withIntParameter("level", -1);
+	test->storage.release(buffer1, BufferReleaseCondition::Dirty);
+	test->storage.returnLease(taken);
+
+	CHECK(test->storage.resume(&lease) == 0);
+	CHECK(test->storage.getAvailableCount() == 1);
+
+	mock("FlashDriver").expectOneCall("write").withIntParameter("addr", 0);
+	test->storage.release(buffer2, BufferReleaseCondition::Clean);
+	test->storage.flush();
+}
+
+TEST(BufferedStorageEmpty, dirtyLeaseKeptIfNotWritten) {
+	MockedBufferedStorage::Lease lease;
+
+	MockedBufferedStorage::Buffer* buffer = test->storage.find(FlashDriver::InvalidAddress);
+	test->storage.lease(&lease, buffer, true);
+
+	/*
+	 * The holder could not write it back, so it stays a dirty lease.
+	 */
+	CHECK(test->storage.takeDirtyLease() == &lease);
+	test->storage.returnLease(&lease, false);
+	CHECK(test->storage.getAvailableCount() == 1);
+
+	CHECK(test->storage.takeDirtyLease() == &lease);
+	test->storage.returnLease(&lease, false);
+
+	CHECK(test->storage.resume(&lease) == buffer);
+	test->storage.release(buffer, BufferReleaseCondition::Clean);
+}
+
+namespace {
+	constexpr unsigned int nBuffers = 64;
+	typedef BufferedStorage<FlashDriver, MockStorageManager, DefaultNolockConfig::Mutex, nBuffers> LargeBufferedStorage;
+	typedef StorageTestData<LargeBufferedStorage> LargeTestData;
+}
+
+TEST_GROUP_BASE(BufferedStorageLarge, StorageTestGroup<LargeTestData>) {};
+
+TEST(BufferedStorageLarge, hitsWithoutIo) {
+	for(unsigned int i=0; i<nBuffers; i++) {
+		mock("FlashDriver").expectOneCall("read").withIntParameter("addr", 1000 + 7 * i);
+		test->storage.release(test->storage.find(1000 + 7 * i), BufferReleaseCondition::Clean);
+	}
+
+	mock().checkExpectations();
+
+	for(unsigned int i=0; i<nBuffers; i++) {
+		LargeBufferedStorage::Buffer* buffer = test->storage.find(1000 + 7 * i);
+		CHECK(test->storage.getAddress(buffer) == 1000 + 7 * i);
+		test->storage.release(buffer, BufferReleaseCondition::Clean);
+	}
+
+	mock("FlashDriver").expectOneCall("read").withIntParameter("addr", 1);
+	test->storage.release(test->storage.find(1), BufferReleaseCondition::Clean);
+
+	mock("FlashDriver").expectOneCall("read").withIntParameter("addr", 1000);
+	test->storage.release(test->storage.find(1000), BufferReleaseCondition::Clean);
+}
+
+TEST(BufferedStorageLarge, exhaust) {
+	for(unsigned int i=0; i<nBuffers; i++)
+		CHECK(test->storage.find(FlashDriver::InvalidAddress) != 0);
+
+	CHECK(test->storage.find(FlashDriver::InvalidAddress) == 0);
+}
+
+namespace {
+	struct BatchedFlashDriver: MockFlashDriver<16, 4, 64> {
+		static void writeMulti(Address addr, void* const* data, unsigned int count) {
+			mock("FlashDriver").actualCall("writeMulti").withIntParameter("addr", addr).withIntParameter("count", count);
+		}
+	};
+
+	struct BatchedStorageManager {
+		unsigned int addr=0;
+		BatchedFlashDriver::Address allocate(int) {
+			return addr;
+		}
+
+		void reclaim(BatchedFlashDriver::Address) {}
+	};
+}
+
+namespace {
+	typedef BufferedStorage<BatchedFlashDriver, BatchedStorageManager, DefaultNolockConfig::Mutex, 8> BatchedBufferedStorage;
+	typedef StorageTestData<BatchedBufferedStorage, BatchedStorageManager> BatchedTestData;
+}
+
+TEST_GROUP_BASE(BufferedStorageBatched, StorageTestGroup<BatchedTestData>) {
+	void writeAt(unsigned int addr) {
+		test->manager.addr = addr;
+		test->storage.release(test->storage.find(BatchedFlashDriver::InvalidAddress), BufferReleaseCondition::Dirty);
+	}
+};
+
+TEST(BufferedStorageBatched, runsWithinBlocks) {
+	writeAt(7);
+	writeAt(3);
+	writeAt(8);
+	writeAt(2);
+	writeAt(6);
+	writeAt(4);
+
+	mock().strictOrder();
+	mock("FlashDriver").expectOneCall("writeMulti").withIntParameter("addr", 2).withIntParameter("count", 2);
+	mock("FlashDriver").expectOneCall("write").withIntParameter("addr", 4);
+	mock("FlashDriver").expectOneCall("writeMulti").withIntParameter("addr", 6).withIntParameter("count", 2);
+	mock("FlashDriver").expectOneCall("write").withIntParameter("addr", 8);
+	test->storage.flush();
+
+	test->storage.flush();
+}
+
+TEST(BufferedStorageBatched, usedOnesIncluded) {
+	writeAt(1);
+	writeAt(3);
+
+	test->manager.addr = 2;
+	BatchedBufferedStorage::Buffer* used = test->storage.find(BatchedFlashDriver::InvalidAddress);
+	used = test->storage.find(test->storage.release(used, BufferReleaseCondition::Dirty));
+
+	mock("FlashDriver").expectOneCall("writeMulti").withIntParameter("addr", 1).withIntParameter("count", 3);
+	test->storage.flush();
+
+	test->storage.release(used, BufferReleaseCondition::Clean);
+}
+
+TEST(BufferedStorageBatched, evictionInProgramOrder) {
+	writeAt(7);
+	writeAt(4);
+	writeAt(5);
+	writeAt(9);
+
+	BatchedBufferedStorage::Buffer* used[4];
+	for(unsigned int i = 0; i < 4; i++)
+		used[i] = test->storage.find(BatchedFlashDriver::InvalidAddress);
+
+	/*
+	 * Page 7 is the least recently used one, but the dirty pages before it in
+	 * the same block need to be programmed first (page 9 is in the next one).
+	 */
+	mock("FlashDriver").expectOneCall("writeMulti").withIntParameter("addr", 4).withIntParameter("count", 2);
+	mock("FlashDriver").expectOneCall("write").withIntParameter("addr", 7);
+	BatchedBufferedStorage::Buffer* buffer = test->storage.find(BatchedFlashDriver::InvalidAddress);
+	CHECK(buffer != 0);
+	mock().checkExpectations();
+
+	test->storage.release(buffer, BufferReleaseCondition::Clean);
+
+	for(unsigned int i = 0; i < 4; i++)
+		test->storage.release(used[i], BufferReleaseCondition::Clean);
+}
+
+TEST(BufferedStorageBatched, usedPredecessorWrittenFirst) {
+	writeAt(7);
+	writeAt(4);
+	writeAt(5);
+	writeAt(9);
+
+	BatchedBufferedStorage::Buffer* predecessor = test->storage.find(4);
+
+	BatchedBufferedStorage::Buffer* used[4];
+	for(unsigned int i = 0; i < 4; i++)
+		used[i] = test->storage.find(BatchedFlashDriver::InvalidAddress);
+
+	/*
+	 * Page 4 is in use, but it still has to be programmed before page 7.
+	 */
+	mock("FlashDriver").expectOneCall("writeMulti").withIntParameter("addr", 4).withIntParameter("count", 2);
+	mock("FlashDriver").expectOneCall("write").withIntParameter("addr", 7);
+	BatchedBufferedStorage::Buffer* buffer = test->storage.find(BatchedFlashDriver::InvalidAddress);
+	CHECK(buffer != 0);
+	mock().checkExpectations();
+
+	test->storage.release(buffer, BufferReleaseCondition::Clean);
+	test->storage.release(predecessor, BufferReleaseCondition::Clean);
+
+	for(unsigned int i = 0; i < 4; i++)
+		test->storage.release(used[i], BufferReleaseCondition::Clean);
+}
+
+TEST(BufferedStorageBatched, singlePageFlushed) {
+	writeAt(7);
+	writeAt(4);
+	writeAt(5);
+	writeAt(9);
+
+	CHECK(!test->storage.isWrittenBack(7));
+	CHECK(test->storage.isWrittenBack(3));
+
+	/*
+	 * Only page 7 is asked for, but the pages before it in the same block go first.
+	 */
+	mock("FlashDriver").expectOneCall("writeMulti").withIntParameter("addr", 4).withIntParameter("count", 2);
+	mock("FlashDriver").expectOneCall("write").withIntParameter("addr", 7);
+	test->storage.flush(7);
+	mock().checkExpectations();
+
+	CHECK(test->storage.isWrittenBack(7));
+	CHECK(test->storage.isWrittenBack(4));
+	CHECK(!test->storage.isWrittenBack(9));
+
+	test->storage.flush(7);
+	test->storage.flush(3);
+}
+
+namespace {
+	typedef BufferedStorage<FlashDriver, MockStorageManager, DefaultNolockConfig::Mutex, 8, TwoQueueReplacement> TwoQueueBufferedStorage;
+	typedef StorageTestData<TwoQueueBufferedStorage> TwoQueueTestData;
+}
+
+TEST_GROUP_BASE(BufferedStorageTwoQueue, StorageTestGroup<TwoQueueTestData>) {
+	void access(unsigned int addr, bool expectRead) {
+		if(expectRead)
+			mock("FlashDriver").expectOneCall("read").withIntParameter("addr", addr);
+
+		test->storage.release(test->storage.find(addr), BufferReleaseCondition::Clean);
+		mock().checkExpectations();
+	}
+};
+
+TEST(BufferedStorageTwoQueue, scanResistant) {
+	access(1, true);
+	access(2, true);
+
+	for(unsigned int i = 0; i < 8; i++)
+		access(100 + i, true);
+
+	access(1, true);
+	access(2, true);
+
+	for(unsigned int i = 0; i < 32; i++)
+		access(200 + i, true);
+
+	access(1, false);
+	access(2, false);
+	access(200, true);
+
+	TwoQueueBufferedStorage::Statistics stats = test->storage.getStatistics();
+	CHECK(stats.metaHits + stats.blobHits == 2);
+	CHECK(stats.metaMisses + stats.blobMisses == 45);
+}
+
+TEST(BufferedStorageTwoQueue, emptyFirst) {
+	access(1, true);
+
+	TwoQueueBufferedStorage::Buffer* buffer = test->storage.find(1);
+	mock("StorageManager").expectOneCall("reclaim").withIntParameter("addr", 1);
+	test->storage.release(buffer, BufferReleaseCondition::Purge);
+	CHECK(test->storage.find(FlashDriver::InvalidAddress) == buffer);
+}
+
+namespace {
+	typedef BufferedStorage<FlashDriver, MockStorageManager, DefaultNolockConfig::Mutex, 8, LevelAwareReplacement<>> LevelAwareBufferedStorage;
+	typedef StorageTestData<LevelAwareBufferedStorage> LevelAwareTestData;
+}
+
+TEST_GROUP_BASE(BufferedStorageLevelAware, StorageTestGroup<LevelAwareTestData>) {
+	void access(unsigned int addr, int level, bool expectRead) {
+		if(expectRead)
+			mock("FlashDriver").expectOneCall("read").withIntParameter("addr", addr);
+
+		LevelAwareBufferedStorage::Buffer* buffer = test->storage.find(addr);
+		buffer->data.level = level;
+		test->storage.release(buffer, BufferReleaseCondition::Clean);
+		mock().checkExpectations();
+	}
+};
+
+TEST(BufferedStorageLevelAware, indexPagesStay) {
+	access(1, 2, true);
+	access(2, 1, true);
+	access(3, -2, true);
+
+	for(unsigned int i = 0; i < 20; i++)
+		access(100 + i, (i & 1) ? 0 : -1, true);
+
+	access(1, 2, false);
+	access(2, 1, false);
+	access(3, -2, false);
+	access(100, -1, true);
+}
+
+TEST(BufferedStorageLevelAware, indexQuota) {
+	for(unsigned int i = 0; i < 6; i++)
+		access(1 + i, 1, true);
+
+	access(100, -1, true);
+	access(101, 0, true);
+
+	access(102, -1, true);
+	access(103, -1, true);
+
+	access(100, -1, false);
+	access(101, 0, false);
+	access(1, 1, true);
+}
+
+TEST(BufferedStorageLarge, hotPages) {
+	const int levels[] = {-1, 0, 2, -2, 1, 0, -1, 2};
+
+	for(unsigned int i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+		mock("FlashDriver").expectOneCall("read").withIntParameter("addr", 100 + i);
+		LargeBufferedStorage::Buffer* buffer = test->storage.find(100 + i);
+		buffer->data.level = levels[i];
+		test->storage.release(buffer, BufferReleaseCondition::Clean);
+	}
+
+	FlashDriver::Address pages[5];
+	CHECK(test->storage.getHotPages(pages, 5) == 5);
+	CHECK(pages[0] == 107);
+	CHECK(pages[1] == 102);
+	CHECK(pages[2] == 104);
+	CHECK(pages[3] == 103);
+	CHECK(pages[4] == 105);
+
+	CHECK(test->storage.getHotPages(pages, 2) == 2);
+	CHECK(pages[0] == 107);
+	CHECK(pages[1] == 102);
+}
+
+TEST(BufferedStorageLarge, writeBackOldest) {
+	test->storage.setDirtyWatermarks(7, 4);		// 4 and 2 of the 64 buffers
+
+	for(unsigned int i=0; i<5; i++) {
+		LargeBufferedStorage::Buffer* buffer = test->storage.find(FlashDriver::InvalidAddress);
+		buffer->data.level = 0;
+		mock("StorageManager").expectOneCall("allocate").withIntParameter("level", 0);
+		test->storage.release(buffer, BufferReleaseCondition::Dirty);
+	}
+
+	test->storage.release(test->storage.find(0), BufferReleaseCondition::Clean);
+	LargeBufferedStorage::Buffer* used = test->storage.find(1);
+
+	mock().strictOrder();
+	mock("FlashDriver").expectOneCall("write").withIntParameter("addr", 2);
+	mock("FlashDriver").expectOneCall("write").withIntParameter("addr", 3);
+	mock("FlashDriver").expectOneCall("write").withIntParameter("addr", 4);
+	CHECK(test->storage.writeBack() == 3);
+	mock().checkExpectations();
+
+	CHECK(test->storage.writeBack() == 0);
+	test->storage.release(used, BufferReleaseCondition::Clean);
+}
+
+namespace {
+	typedef BufferedStorage<FlashDriver, MockStorageManager, DefaultNolockConfig::Mutex, 8, PartitionedReplacement<LruReplacement, 50, 0, 0>> PartitionedBufferedStorage;
+	typedef StorageTestData<PartitionedBufferedStorage> PartitionedTestData;
+}
+
+TEST_GROUP_BASE(BufferedStoragePartitioned, StorageTestGroup<PartitionedTestData>) {
+	void access(unsigned int addr, int level, bool expectRead) {
+		if(expectRead)
+			mock("FlashDriver").expectOneCall("read").withIntParameter("addr", addr);
+
+		PartitionedBufferedStorage::Buffer* buffer = test->storage.find(addr);
+		buffer->data.level = level;
+		test->storage.release(buffer, BufferReleaseCondition::Clean);
+		mock().checkExpectations();
+	}
+};
+
+TEST(BufferedStoragePartitioned, metaMinimumKept) {
+	for(unsigned int i = 0; i < 4; i++)
+		access(1 + i, 0, true);
+
+	for(unsigned int i = 0; i < 20; i++)
+		access(100 + i, (i & 1) ? -1 : -2, true);
+
+	for(unsigned int i = 0; i < 4; i++)
+		access(1 + i, 0, false);
+}
+
+TEST(BufferedStoragePartitioned, borrowedTakenBack) {
+	for(unsigned int i = 0; i < 8; i++)
+		access(1 + i, 0, true);
+
+	access(100, -1, true);
+	access(101, -1, true);
+
+	access(100, -1, false);
+	access(5, 0, false);
+	access(1, 0, true);
+	access(101, -1, true);
+}
+
+namespace {
+	struct CountingAllocator {
+		static unsigned int allocated;
+
+		static void* alloc(unsigned int size) {
+			allocated++;
+			return malloc(size);
+		}
+
+		static void free(void* ptr) {
+			allocated--;
+			::free(ptr);
+		}
+	};
+
+	unsigned int CountingAllocator::allocated = 0;
+}
+
+namespace {
+	typedef BufferedStorage<FlashDriver, MockStorageManager, DefaultNolockConfig::Mutex, 0, LruReplacement, NoSecondaryCache, 8> ResizableBufferedStorage;
+	typedef StorageTestData<ResizableBufferedStorage> ResizableTestData;
+}
+
+TEST_GROUP_BASE(BufferedStorageResizable, StorageTestGroup<ResizableTestData>) {
+	TEST_TEARDOWN() {
+		StorageTestGroup::teardown();
+		CHECK(CountingAllocator::allocated == 0);
+	}
+};
+
+TEST(BufferedStorageResizable, region) {
+	static void* region[ResizableBufferedStorage::regionSize(3) / sizeof(void*) + 1];
+
+	CHECK(test->storage.find(FlashDriver::InvalidAddress) == 0);
+	CHECK(test->storage.addBuffers(region, sizeof(region)) == 3);
+	CHECK(test->storage.getBufferCount() == 3);
+
+	ResizableBufferedStorage::Buffer* buffers[3];
+	for(unsigned int i = 0; i < 3; i++) {
+		buffers[i] = test->storage.find(FlashDriver::InvalidAddress);
+		CHECK((void*)buffers[i] > (void*)region && (void*)(buffers[i] + 1) <= (void*)(region + sizeof(region) / sizeof(void*)));
+	}
+
+	CHECK(test->storage.find(FlashDriver::InvalidAddress) == 0);
+
+	for(unsigned int i = 0; i < 3; i++)
+		test->storage.release(buffers[i], BufferReleaseCondition::Clean);
+
+	CHECK(test->storage.removeBuffers() == (void*)region);
+	CHECK(test->storage.getBufferCount() == 0);
+	CHECK(test->storage.removeBuffers() == 0);
+}
+
+TEST(BufferedStorageResizable, tooSmall) {
+	static void* region[ResizableBufferedStorage::regionSize(1) / sizeof(void*) - 1];
+	CHECK(test->storage.addBuffers(region, sizeof(region)) == 0);
+	CHECK(test->storage.getBufferCount() == 0);
+}
+
+TEST(BufferedStorageResizable, growAndShrink) {
+	CHECK(test->storage.grow<CountingAllocator>(2) == 2);
+	CHECK(test->storage.grow<CountingAllocator>(3) == 3);
+	CHECK(test->storage.getBufferCount() == 5);
+
+	mock("FlashDriver").expectOneCall("read").withIntParameter("addr", 12);
+	test->storage.release(test->storage.find(12), BufferReleaseCondition::Clean);
+
+	ResizableBufferedStorage::Buffer* buffer = test->storage.find(FlashDriver::InvalidAddress);
+	buffer->data.level = 0;
+	mock("StorageManager").expectOneCall("allocate").withIntParameter("level", 0);
+	CHECK(test->storage.release(buffer, BufferReleaseCondition::Dirty) == 0);
+	mock().checkExpectations();
+
+	/*
+	 * Empty buffers are used first, so both pages are in the last added region,
+	 * the dirty one is written back and both of them are forgotten when removed.
+	 */
+	mock("FlashDriver").expectOneCall("write").withIntParameter("addr", 0);
+	CHECK(test->storage.shrink<CountingAllocator>());
+	CHECK(test->storage.getBufferCount() == 2);
+	mock().checkExpectations();
+
+	mock("FlashDriver").expectOneCall("read").withIntParameter("addr", 12);
+	test->storage.release(test->storage.find(12), BufferReleaseCondition::Clean);
+
+	CHECK(test->storage.shrink<CountingAllocator>());
+	CHECK(test->storage.getBufferCount() == 0);
+	CHECK(test->storage.find(FlashDriver::InvalidAddress) == 0);
+}
+
+TEST(BufferedStorageResizable, limited) {
+	static void* region[ResizableBufferedStorage::regionSize(3) / sizeof(void*) + 1];
+
+	CHECK(test->storage.grow<CountingAllocator>(6) == 6);
+	CHECK(test->storage.addBuffers(region, sizeof(region)) == 2);
+	CHECK(test->storage.getBufferCount() == 8);
+	CHECK(test->storage.grow<CountingAllocator>(1) == 0);
+
+	CHECK(test->storage.removeBuffers() == (void*)region);
+	CHECK(test->storage.shrink<CountingAllocator>());
+	CHECK(test->storage.getBufferCount() == 0);
+}
+
+TEST(BufferedStorageResizable, shrinkWhileUsed) {
+	CHECK(test->storage.grow<CountingAllocator>(2) == 2);
+
+	ResizableBufferedStorage::Buffer* buffer = test->storage.find(FlashDriver::InvalidAddress);
+	CHECK(!test->storage.shrink<CountingAllocator>());
+	CHECK(test->storage.getBufferCount() == 2);
+
+	test->storage.release(buffer, BufferReleaseCondition::Clean);
+	CHECK(test->storage.shrink<CountingAllocator>());
+}
+
+namespace {
+	struct AlignedFlashDriver: MockFlashDriver<100, 1, 1> {
+		static constexpr uint32_t bufferAlignment = 64;
+	};
+}
+
+TEST(BufferedStorageResizable, aligned) {
+	typedef BufferedStorage<AlignedFlashDriver, MockStorageManager, DefaultNolockConfig::Mutex, 2, LruReplacement, NoSecondaryCache, 5> AlignedBufferedStorage;
+
+	StorageTestData<AlignedBufferedStorage> data;
+
+	static void* region[AlignedBufferedStorage::regionSize(3) / sizeof(void*) + 1];
+	CHECK(data.storage.addBuffers(region, sizeof(region)) == 3);
+
+	AlignedBufferedStorage::Buffer* buffers[5];
+	for(unsigned int i = 0; i < 5; i++) {
+		buffers[i] = data.storage.find(AlignedFlashDriver::InvalidAddress);
+		CHECK(((uintptr_t)buffers[i]->data.user & 63) == 0);
+		CHECK(((uintptr_t)&buffers[i]->management & 63) == 0);
+	}
+
+	for(unsigned int i = 0; i < 5; i++)
+		data.storage.release(buffers[i], BufferReleaseCondition::Clean);
+
+	CHECK(data.storage.removeBuffers() == (void*)region);
+}
+
+namespace {
+	typedef BufferedStorage<FlashDriver, MockStorageManager, DefaultNolockConfig::Mutex, 2, LruReplacement, SecondaryPageCache> SecondaryBufferedStorage;
+
+	struct SecondaryTestData: StorageTestData<SecondaryBufferedStorage> {
+		void* region[256];
+	};
+}
+
+TEST_GROUP_BASE(BufferedStorageSecondary, StorageTestGroup<SecondaryTestData>) {
+	TEST_SETUP() {
+		StorageTestGroup::setup();
+		CHECK(test->storage.attachSecondaryCache(test->region, sizeof(test->region)) >= 4);
+	}
+
+	TEST_TEARDOWN() {
+		CHECK(test->storage.detachSecondaryCache() == test->region);
+		StorageTestGroup::teardown();
+	}
+
+	void access(unsigned int addr, bool expectRead) {
+		if(expectRead)
+			mock("FlashDriver").expectOneCall("read").withIntParameter("addr", addr);
+
+		SecondaryBufferedStorage::Buffer* buffer = test->storage.find(addr);
+		buffer->data.level = 0;
+		test->storage.release(buffer, BufferReleaseCondition::Clean);
+		mock().checkExpectations();
+	}
+};
+
+TEST(BufferedStorageSecondary, evictedServed) {
+	access(1, true);
+	access(2, true);
+	access(3, true);
+	access(4, true);
+
+	access(1, false);
+	access(2, false);
+	access(2, false);
+
+	SecondaryBufferedStorage::Statistics stats = test->storage.getStatistics();
+	CHECK(stats.metaMisses == 6);
+	CHECK(stats.metaSecondaryHits == 2);
+	CHECK(stats.metaHits == 1);
+}
+
+TEST(BufferedStorageSecondary, reallocatedInvalidated) {
+	access(0, true);
+	access(10, true);
+	access(11, true);
+
+	/*
+	 * The old copy of page 0 is in the second level cache when it is allocated again,
+	 * after purging the new contents it can not be served from there anymore.
+	 */
+	SecondaryBufferedStorage::Buffer* buffer = test->storage.find(FlashDriver::InvalidAddress);
+	buffer->data.level = 0;
+	mock("StorageManager").expectOneCall("allocate").withIntParameter("level", 0);
+	CHECK(test->storage.release(buffer, BufferReleaseCondition::Dirty) == 0);
+
+	buffer = test->storage.find(0);
+	mock("StorageManager").expectOneCall("reclaim").withIntParameter("addr", 0);
+	test->storage.release(buffer, BufferReleaseCondition::Purge);
+	mock().checkExpectations();
+
+	access(0, true);
+}
+
+TEST(BufferedStorageSecondary, detached) {
+	access(1, true);
+	access(2, true);
+	access(3, true);
+
+	CHECK(test->storage.detachSecondaryCache() == test->region);
+	access(1, true);
+
+	CHECK(test->storage.attachSecondaryCache(test->region, sizeof(test->region)) >= 4);
+}
+
+TEST_GROUP_BASE(BufferedStorageFull, StorageTestGroup<TestData>) {
 	MockedBufferedStorage::Buffer *buffer1, *buffer2;
 
 	TEST_SETUP() {
-		test = new TestData;
+		StorageTestGroup::setup();
 
 		buffer1 = test->storage.find(FlashDriver::InvalidAddress);
 		buffer1->data.level = 1;
@@ -210,12 +935,6 @@ TEST_GROUP(BufferedStorageFull) {
 		mock("StorageManager").expectOneCall("allocate").withIntParameter("level", 2);
 		test->storage.release(buffer2, BufferReleaseCondition::Dirty);
 	}
-
-	TEST_TEARDOWN() {
-		mock().checkExpectations();
-		mock().clear();
-		delete test;
-	}
 };
 
 TEST(BufferedStorageFull, flushOrderSimple) {
@@ -225,14 +944,14 @@ TEST(BufferedStorageFull, flushOrderSimple) {
 	test->storage.flush();
 }
 
-TEST(BufferedStorageFull, flushOrderChanged) {
+TEST(BufferedStorageFull, flushOrderIsByAddress) {
 	MockedBufferedStorage::Buffer* buffer3 = test->storage.find(0);
 	CHECK(buffer3 == buffer1);
 	test->storage.release(buffer1, BufferReleaseCondition::Dirty);
 
 	mock().strictOrder();
-	mock("FlashDriver").expectOneCall("write").withIntParameter("addr", 1);
 	mock("FlashDriver").expectOneCall("write").withIntParameter("addr", 0);
+	mock("FlashDriver").expectOneCall("write").withIntParameter("addr", 1);
 	test->storage.flush();
 }
 
@@ -278,3 +997,351 @@ TEST(BufferedStorageFull, veryOldDirtyChoosen) {
 	mock("FlashDriver").expectOneCall("write").withIntParameter("addr", 2);
 	test->storage.find(FlashDriver::InvalidAddress);
 }
+
+namespace {
+	/*
+	 * Flash driver that blocks reads until it is opened by the test,
+	 * to be able to observe the buffers while a transfer is in progress.
+	 */
+	struct GatedFlashDriver {
+		typedef unsigned int Address;
+		static constexpr unsigned int InvalidAddress=-1u;
+		static constexpr unsigned int pageSize = 16;
+		static constexpr unsigned int blockSize = 1;
+		static constexpr unsigned int deviceSize = 1024;
+
+		static PthreadMutexWrapper gate;
+		static bool open;
+		static unsigned int reads, blocked;
+
+		static void read(Address addr, void* data) {
+			gate.lock();
+			reads++;
+			blocked++;
+			gate.notifyAll();
+
+			while(!open)
+				gate.wait();
+
+			blocked--;
+			gate.unlock();
+
+			for(unsigned int i=0; i<pageSize; i++)
+				((char*)data)[i] = addr;
+		}
+
+		static void write(Address addr, void* data) {}
+
+		static void setOpen(bool value) {
+			gate.lock();
+			open = value;
+			gate.notifyAll();
+			gate.unlock();
+		}
+
+		static void waitForBlocked(unsigned int n) {
+			gate.lock();
+			while(blocked < n)
+				gate.wait();
+			gate.unlock();
+		}
+	};
+
+	PthreadMutexWrapper GatedFlashDriver::gate;
+	bool GatedFlashDriver::open;
+	unsigned int GatedFlashDriver::reads, GatedFlashDriver::blocked;
+
+	typedef BufferedStorage<GatedFlashDriver, MockStorageManager, PthreadMutexWrapper, 3> ConcurrentBufferedStorage;
+
+	typedef StorageTestData<ConcurrentBufferedStorage> ConcurrentTestData;
+
+	struct Finder {
+		ConcurrentBufferedStorage &storage;
+		GatedFlashDriver::Address addr;
+		ConcurrentBufferedStorage::Buffer* result = 0;
+		pthread_t thread;
+
+		static void* run(void* self) {
+			((Finder*)self)->result = ((Finder*)self)->storage.find(((Finder*)self)->addr);
+			return 0;
+		}
+
+		Finder(ConcurrentBufferedStorage &storage, GatedFlashDriver::Address addr): storage(storage), addr(addr) {
+			pthread_create(&thread, 0, &Finder::run, this);
+		}
+
+		ConcurrentBufferedStorage::Buffer* join() {
+			pthread_join(thread, 0);
+			return result;
+		}
+	};
+}
+
+TEST_GROUP_BASE(BufferedStorageConcurrent, StorageTestGroup<ConcurrentTestData>) {
+	TEST_SETUP() {
+		GatedFlashDriver::open = true;
+		GatedFlashDriver::reads = GatedFlashDriver::blocked = 0;
+		StorageTestGroup::setup();
+	}
+
+	TEST_TEARDOWN() {
+		GatedFlashDriver::setOpen(true);
+		StorageTestGroup::teardown();
+	}
+};
+
+TEST(BufferedStorageConcurrent, hitWhileReading) {
+	test->storage.release(test->storage.find(5), BufferReleaseCondition::Clean);
+
+	GatedFlashDriver::setOpen(false);
+	Finder finder(test->storage, 7);
+	GatedFlashDriver::waitForBlocked(1);
+
+	ConcurrentBufferedStorage::Buffer* buffer = test->storage.find(5);
+	CHECK(buffer->data.user[0] == 5);
+	test->storage.release(buffer, BufferReleaseCondition::Clean);
+
+	GatedFlashDriver::setOpen(true);
+	buffer = finder.join();
+	CHECK(test->storage.getAddress(buffer) == 7);
+	CHECK(buffer->data.user[0] == 7);
+	test->storage.release(buffer, BufferReleaseCondition::Clean);
+}
+
+TEST(BufferedStorageConcurrent, waitForPageBeingRead) {
+	GatedFlashDriver::setOpen(false);
+	Finder first(test->storage, 9);
+	GatedFlashDriver::waitForBlocked(1);
+
+	Finder second(test->storage, 9);
+	Finder other(test->storage, 11);
+	GatedFlashDriver::waitForBlocked(2);
+
+	GatedFlashDriver::setOpen(true);
+	ConcurrentBufferedStorage::Buffer* buffer = first.join();
+	CHECK(second.join() == buffer);
+	CHECK(other.join() != buffer);
+	CHECK(buffer->data.user[0] == 9);
+	CHECK(GatedFlashDriver::reads == 2);
+}
+
+namespace {
+	struct SimpleStorageManager {
+		unsigned int addr=0;
+		unsigned int allocate(int level) {
+			return addr++;
+		}
+
+		void reclaim(unsigned int addr) {}
+	};
+
+	typedef ThreadedFlashDriver<16, 4, 4> QueuedFlashDriver;
+	typedef BufferedStorage<QueuedFlashDriver, SimpleStorageManager, PthreadMutexWrapper, 4> QueuedBufferedStorage;
+
+	struct QueuedTestData: StorageTestData<QueuedBufferedStorage, SimpleStorageManager> {
+		void fill(unsigned int n) {
+			for(unsigned int i=0; i<n; i++) {
+				QueuedBufferedStorage::Buffer* buffer = storage.find(QueuedFlashDriver::InvalidAddress);
+
+				for(unsigned int j=0; j<sizeof(buffer->data.user); j++)
+					buffer->data.user[j] = 'a' + i;
+
+				buffer->data.level = 0;
+				storage.release(buffer, BufferReleaseCondition::Dirty);
+			}
+		}
+	};
+
+	struct Flusher {
+		QueuedBufferedStorage &storage;
+		pthread_t thread;
+
+		static void* run(void* self) {
+			((Flusher*)self)->storage.flush();
+			return 0;
+		}
+
+		Flusher(QueuedBufferedStorage &storage): storage(storage) {
+			pthread_create(&thread, 0, &Flusher::run, this);
+		}
+
+		void join() {
+			pthread_join(thread, 0);
+		}
+	};
+
+	struct BackgroundWriter {
+		QueuedBufferedStorage &storage;
+		pthread_t thread;
+
+		static void* run(void* self) {
+			QueuedBufferedStorage &storage = ((BackgroundWriter*)self)->storage;
+
+			while(storage.waitForWriteBack())
+				storage.writeBack();
+
+			return 0;
+		}
+
+		BackgroundWriter(QueuedBufferedStorage &storage): storage(storage) {
+			pthread_create(&thread, 0, &BackgroundWriter::run, this);
+		}
+
+		void stop() {
+			storage.stopWriteBack();
+			pthread_join(thread, 0);
+		}
+	};
+
+	/*
+	 * Flash driver without a thread of its own, requests
+	 * are only processed when it is polled.
+	 */
+	struct PolledFlashDriver: MockFlashDriver<16, 1, 1024> {
+		typedef FlashTransfer<Address> Transfer;
+		static Transfer* pending;
+		static unsigned int polls;
+
+		static void submit(Transfer* transfer) {
+			for(; transfer; transfer = transfer->batch) {
+				transfer->next = pending;
+				pending = transfer;
+			}
+		}
+
+		static void poll() {
+			polls++;
+
+			while(Transfer* transfer = pending) {
+				pending = transfer->next;
+
+				if(transfer->operation == Transfer::Read)
+					read(transfer->address, transfer->data);
+				else
+					write(transfer->address, transfer->data);
+
+				transfer->complete();
+			}
+		}
+	};
+
+	PolledFlashDriver::Transfer* PolledFlashDriver::pending;
+	unsigned int PolledFlashDriver::polls;
+
+	typedef BufferedStorage<PolledFlashDriver, MockStorageManager, DefaultNolockConfig::Mutex, 2> PolledBufferedStorage;
+
+	typedef StorageTestData<PolledBufferedStorage> PolledTestData;
+}
+
+TEST_GROUP_BASE(BufferedStorageQueued, StorageTestGroup<QueuedTestData>) {
+	TEST_SETUP() {
+		for(unsigned int i=0; i<QueuedFlashDriver::deviceSize; i++)
+			QueuedFlashDriver::ensureErased(i);
+
+		QueuedFlashDriver::hold(false);
+		QueuedFlashDriver::getMaxQueued();
+		StorageTestGroup::setup();
+	}
+
+	TEST_TEARDOWN() {
+		QueuedFlashDriver::hold(false);
+		StorageTestGroup::teardown();
+	}
+};
+
+TEST(BufferedStorageQueued, flushKeepsWritesInFlight) {
+	test->fill(3);
+
+	QueuedFlashDriver::hold(true);
+	Flusher flusher(test->storage);
+	QueuedFlashDriver::waitForQueued(3);
+	QueuedFlashDriver::hold(false);
+	flusher.join();
+
+	CHECK(QueuedFlashDriver::getMaxQueued() == 3);
+
+	for(unsigned int i=0; i<3; i++) {
+		char page[QueuedFlashDriver::pageSize];
+		QueuedFlashDriver::readNow(i, page);
+		CHECK(page[0] == (char)('a' + i));
+	}
+}
+
+TEST(BufferedStorageQueued, backgroundWriteBack) {
+	test->storage.setDirtyWatermarks(50, 0);
+	BackgroundWriter writer(test->storage);
+
+	QueuedFlashDriver::hold(true);
+	test->fill(3);
+	QueuedFlashDriver::waitForQueued(3);
+	QueuedFlashDriver::hold(false);
+	writer.stop();
+
+	test->storage.flush();
+	CHECK(QueuedFlashDriver::getMaxQueued() == 3);
+
+	for(unsigned int i=0; i<3; i++) {
+		char page[QueuedFlashDriver::pageSize];
+		QueuedFlashDriver::readNow(i, page);
+		CHECK(page[0] == (char)('a' + i));
+	}
+}
+
+TEST(BufferedStorageQueued, evictAndReadBack) {
+	test->fill(8);
+	test->storage.flush();
+
+	for(unsigned int i=0; i<8; i++) {
+		QueuedBufferedStorage::Buffer* buffer = test->storage.find(i);
+		CHECK(buffer->data.user[0] == (int8_t)('a' + i));
+		CHECK(buffer->data.user[sizeof(buffer->data.user) - 1] == (int8_t)('a' + i));
+		test->storage.release(buffer, BufferReleaseCondition::Clean);
+	}
+}
+
+TEST_GROUP_BASE(BufferedStoragePolled, StorageTestGroup<PolledTestData>) {
+	TEST_SETUP() {
+		PolledFlashDriver::pending = 0;
+		PolledFlashDriver::polls = 0;
+		StorageTestGroup::setup();
+	}
+};
+
+TEST(BufferedStoragePolled, readWrite) {
+	PolledBufferedStorage::Buffer* buffer = test->storage.find(PolledFlashDriver::InvalidAddress);
+	buffer->data.level = 3;
+	mock("StorageManager").expectOneCall("allocate").withIntParameter("level", 3);
+	test->storage.release(buffer, BufferReleaseCondition::Dirty);
+
+	mock("FlashDriver").expectOneCall("write").withIntParameter("addr", 0);
+	test->storage.flush();
+	CHECK(PolledFlashDriver::polls == 1);
+
+	mock("FlashDriver").expectOneCall("read").withIntParameter("addr", 100);
+	test->storage.release(test->storage.find(100), BufferReleaseCondition::Clean);
+	CHECK(PolledFlashDriver::polls == 2);
+}
+
+TEST(BufferedStoragePolled, prefetch) {
+	test->storage.prefetch(100);
+	CHECK(PolledFlashDriver::pending != 0);
+
+	mock("FlashDriver").expectOneCall("read").withIntParameter("addr", 100);
+	PolledBufferedStorage::Buffer* buffer = test->storage.find(100);
+	CHECK(test->storage.getAddress(buffer) == 100);
+	test->storage.release(buffer, BufferReleaseCondition::Clean);
+
+	test->storage.prefetch(100);
+	CHECK(PolledFlashDriver::pending == 0);
+}
+
+TEST(BufferedStoragePolled, prefetchDoesNotClaim) {
+	test->storage.prefetch(100);
+	test->storage.prefetch(200);
+	test->storage.prefetch(300);
+
+	mock("FlashDriver").expectOneCall("read").withIntParameter("addr", 100);
+	mock("FlashDriver").expectOneCall("read").withIntParameter("addr", 200);
+	CHECK(test->storage.find(PolledFlashDriver::InvalidAddress) != 0);
+	CHECK(test->storage.find(PolledFlashDriver::InvalidAddress) != 0);
+}
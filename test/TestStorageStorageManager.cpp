@@ -20,15 +20,16 @@
 #include "MockFlashDriver.h"
 
 #include "storage/StorageManager.h"
+#include "storage/VictimSelection.h"
 
 #include "CppUTest/TestHarness.h"
 #include "CppUTestExt/MockSupport.h"
 
 namespace {
-	template<unsigned int pageSize, unsigned int blockSize, unsigned int deviceSize, unsigned int maxMeta, unsigned int maxFile>
-	struct ParametricTestData: public StorageManager<MockFlashDriver<pageSize, blockSize, deviceSize>, maxMeta, maxFile>{
+	template<unsigned int pageSize, unsigned int blockSize, unsigned int deviceSize, unsigned int maxMeta, unsigned int maxFile, class WearLeveling = DefaultWearLeveling>
+	struct ParametricTestData: public StorageManager<MockFlashDriver<pageSize, blockSize, deviceSize>, maxMeta, maxFile, WearLeveling>{
 		typedef MockFlashDriver<pageSize, blockSize, deviceSize> FlashDriver;
-		typedef StorageManager<FlashDriver, maxMeta, maxFile> Super;
+		typedef StorageManager<FlashDriver, maxMeta, maxFile, WearLeveling> Super;
 
 		static constexpr unsigned int nFileLevels = maxFile;
 		static constexpr unsigned int nMetaLevels = maxMeta;
@@ -137,6 +138,36 @@ TEST(StorageManagerSimple, ReclaimBlock)
 	CHECK(test->getState(0) == TestData::BlockState::Partial);
 }
 
+TEST(StorageManagerSimple, Unallocate)
+{
+	CHECK(test->allocate(-1) == 0);
+	CHECK(test->allocate(-1) == 1);
+
+	CHECK(!test->unallocate(0));
+	CHECK(test->unallocate(1));
+	CHECK(test->getState(0) == TestData::BlockState::Full);
+
+	CHECK(test->allocate(-1) == 1);
+	CHECK(test->unallocate(1));
+	CHECK(test->unallocate(0));
+	CHECK(!test->unallocate(0));
+
+	CHECK(test->allocate(-1) == 0);
+}
+
+TEST(StorageManagerSimple, LeastWornFreeBlockTaken)
+{
+	const unsigned int expected[] = {0, 4, 6, 7, 8, 9, 5};
+	test->restoreEraseCount(5, 10);
+
+	for(unsigned int i=0; i < sizeof(expected)/sizeof(expected[0]); i++)
+		for(unsigned int j=0; j < TestData::FlashDriver::blockSize; j++)
+			CHECK(test->allocate(-1) == expected[i] * TestData::FlashDriver::blockSize + j);
+
+	CHECK(test->getEraseCount(4) == 1);
+	CHECK(test->getEraseCount(5) == 11);
+}
+
 TEST(StorageManagerSimple, DontTriggerGc) {
 	int level;
 
@@ -157,17 +188,16 @@ TEST(StorageManagerSimple, Iterator)
 
 	TestData::Iterator iterator(*test);
 
-	int last = 1, lastIdx = TestData::FlashDriver::deviceSize;
+	bool seen[TestData::FlashDriver::deviceSize] = {false};
+	int last = 1;
 	int n=0;
 	for(;iterator.currentCount(*test) != -1; iterator.step(*test)) {
 		int curr = iterator.currentCount(*test);
 		CHECK(curr >= last);
 
-		if(curr == last) {
-			CHECK(iterator.currentBlock() < lastIdx);
-		}
+		CHECK(!seen[iterator.currentBlock()]);
+		seen[iterator.currentBlock()] = true;
 
-		lastIdx = iterator.currentBlock();
 		last = curr;
 		n++;
 	}
@@ -247,3 +277,284 @@ TEST(StorageManagerBarelyEnough, AllocFailIndep) {
 	CHECK(test->allocate(-1) == TestData::FlashDriver::InvalidAddress);
 	CHECK(test->allocate(1) == TestData::FlashDriver::InvalidAddress);
 }
+
+namespace {
+	struct AgingWearLeveling: DefaultWearLeveling {
+		typedef CostBenefitVictimSelection GcVictimSelection;
+	};
+}
+
+TEST_GROUP(StorageManagerLarge) {
+	typedef ParametricTestData<256, 2, 4096, 2, 2, AgingWearLeveling> TestData;
+	TestData* test;
+
+	TEST_SETUP() {
+		test = new TestData;
+		CHECK(test->init());
+	}
+
+	TEST_TEARDOWN() {
+		delete test;
+	}
+};
+
+TEST(StorageManagerLarge, LowestFreeBlockFound) {
+	const unsigned int blockSize = TestData::FlashDriver::blockSize;
+
+	while(test->allocate(-1) != TestData::FlashDriver::InvalidAddress);
+
+	test->reclaim(3000 * blockSize);
+	test->reclaim(3000 * blockSize + 1);
+	CHECK(test->allocate(-1) == 3000 * blockSize);
+
+	test->reclaim(2000 * blockSize);
+	test->reclaim(2000 * blockSize + 1);
+	test->reclaim(1000 * blockSize + 1);
+	test->reclaim(1000 * blockSize);
+
+	CHECK(test->allocate(-1) == 3000 * blockSize + 1);
+	CHECK(test->allocate(-1) == 1000 * blockSize);
+	CHECK(test->allocate(-1) == 1000 * blockSize + 1);
+	CHECK(test->allocate(-1) == 2000 * blockSize);
+	CHECK(test->allocate(-1) == 2000 * blockSize + 1);
+	CHECK(test->allocate(-1) == TestData::FlashDriver::InvalidAddress);
+}
+
+TEST(StorageManagerLarge, IteratorFollowsCounters) {
+	const unsigned int blockSize = TestData::FlashDriver::blockSize;
+
+	while(test->allocate(-1) != TestData::FlashDriver::InvalidAddress);
+
+	test->reclaim(4000 * blockSize);
+	test->reclaim(2000 * blockSize);
+	test->reclaim(2000 * blockSize + 1);
+	test->reclaim(3000 * blockSize);
+	test->claim(4000 * blockSize);
+
+	TestData::Iterator iterator(*test);
+	CHECK(iterator.currentBlock() == 3000);
+	CHECK(iterator.currentCount(*test) == 1);
+
+	iterator.step(*test);
+	CHECK(iterator.currentCount(*test) == 2);
+
+	unsigned int n = 1;
+	for(; iterator.currentCount(*test) != -1; iterator.step(*test)) {
+		CHECK(iterator.currentCount(*test) == 2);
+		CHECK(iterator.currentBlock() != 2000 && iterator.currentBlock() != 3000);
+		n++;
+	}
+
+	CHECK(n == TestData::FlashDriver::deviceSize - 1);
+}
+
+TEST(StorageManagerLarge, HotDataSeparated) {
+	const unsigned int blockSize = TestData::FlashDriver::blockSize;
+	const int used = test->used();
+
+	TestData::FlashDriver::Address cold = test->allocate(-1);
+	TestData::FlashDriver::Address hot = test->allocate(-1, 1);
+	CHECK(hot != TestData::FlashDriver::InvalidAddress);
+	CHECK(hot / blockSize != cold / blockSize);
+	CHECK(test->used() == used + 1);
+
+	CHECK(test->allocate(-1) == cold + 1);
+	CHECK(test->allocate(-1, 1) == hot + 1);
+
+	TestData::FlashDriver::Address meta = test->allocate(0);
+	CHECK(test->allocate(0, 1) == meta + 1);
+}
+
+TEST(StorageManagerLarge, VictimSelection) {
+	const unsigned int blockSize = TestData::FlashDriver::blockSize;
+
+	while(test->allocate(-1) != TestData::FlashDriver::InvalidAddress);
+
+	CHECK(GreedyVictimSelection::select<TestData::FlashDriver>(*test) == -1);
+	CHECK(CostBenefitVictimSelection::select<TestData::FlashDriver>(*test) == -1);
+
+	test->reclaim(3000 * blockSize);
+	test->reclaim(1000 * blockSize);
+
+	CHECK(GreedyVictimSelection::select<TestData::FlashDriver>(*test) == 3000);
+	CHECK(CostBenefitVictimSelection::select<TestData::FlashDriver>(*test) == 1000);
+}
+
+namespace {
+	struct NarrowWearLeveling: DefaultWearLeveling {
+		typedef uint8_t EraseCount;
+	};
+
+	struct NarrowCountTestData: StorageManager<MockFlashDriver<256, 2, 8>, 2, 2, NarrowWearLeveling> {
+		void mount(const unsigned int (&counts)[8]) {
+			this->resetEraseCounts();
+
+			for(unsigned int i=0; i<8; i++) {
+				this->usageCounters[i] = 0;
+				this->restoreEraseCount(i, counts[i]);
+			}
+
+			this->rebuildBlockIndex();
+		}
+
+		void erased(unsigned int block) {
+			this->countErase(block);
+		}
+	};
+}
+
+TEST_GROUP(StorageManagerEraseCounts) {};
+
+TEST(StorageManagerEraseCounts, RecoveredBelowBase) {
+	NarrowCountTestData test;
+	test.mount({1000, 1100, -1u, 850, 1000, 1000, 1000, 1000});
+
+	CHECK(test.getEraseCount(0) == 1000);
+	CHECK(test.getEraseCount(1) == 1100);
+	CHECK(test.getEraseCount(2) == 992);
+	CHECK(test.getEraseCount(3) == 850);
+}
+
+TEST(StorageManagerEraseCounts, BaseMovedUp) {
+	NarrowCountTestData test;
+	test.mount({1000, 1127, 1000, 1000, 1000, 1000, 1000, 1000});
+	CHECK(test.getEraseCount(1) == 1127);
+
+	test.erased(1);
+	CHECK(test.getEraseCount(1) == 1128);
+	CHECK(test.getEraseCount(0) == 1000);
+}
+
+namespace {
+	struct CountingFlashDriver: MockFlashDriver<256, 2, 16> {
+		static unsigned int erases;
+
+		static void ensureErased(unsigned int blockAddress) {
+			erases++;
+			MockFlashDriver::ensureErased(blockAddress);
+		}
+	};
+
+	unsigned int CountingFlashDriver::erases;
+
+	/*
+	 * Queued driver that completes the erase requests only when told to.
+	 */
+	struct QueuedEraseFlashDriver: CountingFlashDriver {
+		static constexpr bool queuedErase = true;
+		static FlashTransfer<unsigned int>* first;
+
+		static void submit(FlashTransfer<unsigned int>* transfer) {
+			transfer->next = first;
+			first = transfer;
+		}
+
+		static void finish() {
+			while(FlashTransfer<unsigned int>* transfer = first) {
+				first = transfer->next;
+				CHECK(transfer->operation == FlashTransfer<unsigned int>::Erase);
+				ensureErased(transfer->address);
+				transfer->complete();
+			}
+		}
+	};
+
+	FlashTransfer<unsigned int>* QueuedEraseFlashDriver::first;
+
+	/*
+	 * Queued driver that completes the erase requests when polled.
+	 */
+	struct PolledEraseFlashDriver: QueuedEraseFlashDriver {
+		static unsigned int polls;
+
+		static void poll() {
+			polls++;
+			finish();
+		}
+	};
+
+	unsigned int PolledEraseFlashDriver::polls;
+
+	template<class Driver>
+	struct PoolTestData: StorageManager<Driver, 2, 2> {
+		bool init() {
+			Driver::erases = 0;
+			return this->initWithDefaultAssignment();
+		}
+	};
+}
+
+TEST_GROUP(StorageManagerErasedPool) {};
+
+TEST(StorageManagerErasedPool, NoEraseOnAllocation) {
+	const unsigned int blockSize = CountingFlashDriver::blockSize;
+	PoolTestData<CountingFlashDriver> test;
+	CHECK(test.init());
+	CHECK(CountingFlashDriver::erases == 4);
+
+	CHECK(test.refillErasedPool() == 1);
+	CHECK(CountingFlashDriver::erases == 5);
+	CHECK(test.refillErasedPool() == 1);
+	CHECK(test.refillErasedPool() == 0);
+	CHECK(CountingFlashDriver::erases == 6);
+
+	const unsigned int first = test.allocate(-1);
+	CHECK(test.allocate(-1) == first + 1);
+
+	for(unsigned int i=0; i<2 * blockSize; i++)
+		CHECK(test.allocate(-1) == 4 * blockSize + i);
+
+	CHECK(CountingFlashDriver::erases == 6);
+
+	CHECK(test.allocate(-1) == 6 * blockSize);
+	CHECK(CountingFlashDriver::erases == 7);
+	CHECK(test.getEraseCount(4) == 1);
+	CHECK(test.getEraseCount(6) == 1);
+}
+
+TEST(StorageManagerErasedPool, PendingEraseNotUsed) {
+	const unsigned int blockSize = QueuedEraseFlashDriver::blockSize;
+	PoolTestData<QueuedEraseFlashDriver> test;
+	CHECK(test.init());
+
+	CHECK(test.refillErasedPool() == 2);
+	CHECK(QueuedEraseFlashDriver::erases == 4);
+
+	const unsigned int first = test.allocate(-1);
+	CHECK(test.allocate(-1) == first + 1);
+
+	CHECK(test.allocate(-1) == 6 * blockSize);
+	CHECK(test.allocate(-1) == 6 * blockSize + 1);
+	CHECK(QueuedEraseFlashDriver::erases == 5);
+
+	QueuedEraseFlashDriver::finish();
+	CHECK(QueuedEraseFlashDriver::erases == 7);
+
+	CHECK(test.allocate(-1) == 4 * blockSize);
+	CHECK(QueuedEraseFlashDriver::erases == 7);
+}
+
+TEST(StorageManagerErasedPool, PendingEraseWaitedFor) {
+	const unsigned int blockSize = PolledEraseFlashDriver::blockSize;
+	PoolTestData<PolledEraseFlashDriver> test;
+	CHECK(test.init());
+
+	PolledEraseFlashDriver::polls = 0;
+	CHECK(test.refillErasedPool() == 2);
+
+	const unsigned int first = test.allocate(-1);
+	CHECK(test.allocate(-1) == first + 1);
+
+	/*
+	 * The free blocks not in the pool get used up while the erases are still pending.
+	 */
+	for(unsigned int i=0; i<(PolledEraseFlashDriver::deviceSize - 6) * blockSize; i++)
+		CHECK(test.allocate(-1) == 6 * blockSize + i);
+
+	CHECK(PolledEraseFlashDriver::polls == 0);
+
+	const unsigned int waited = test.allocate(-1);
+	CHECK(waited == 4 * blockSize || waited == 5 * blockSize);
+	CHECK(PolledEraseFlashDriver::polls == 1);
+	CHECK(PolledEraseFlashDriver::erases == 4 + PolledEraseFlashDriver::deviceSize - 4);
+}
@@ -0,0 +1,173 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2017 Seller Tamás. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *******************************************************************************/
+
+#ifndef THREADEDFLASHDRIVER_H_
+#define THREADEDFLASHDRIVER_H_
+
+#include <pthread.h>
+
+#include "storage/FlashTransfer.h"
+
+/**
+ * Simulated queued flash driver, the requests are processed in order by a
+ * worker thread, like a DMA capable controller would do it in the background.
+ *
+ * The processing can be held back to be able to observe the queue.
+ */
+template<unsigned int bytesPerPage, unsigned int pagesPerBlock, unsigned int nBlocks>
+class ThreadedFlashDriver {
+	typedef char Page[bytesPerPage];
+	typedef Page Block[pagesPerBlock];
+
+	static Block blocks[nBlocks];
+public:
+	typedef unsigned int Address;
+	static constexpr unsigned int InvalidAddress=-1u;
+	static constexpr unsigned int pageSize = bytesPerPage;
+	static constexpr unsigned int blockSize = pagesPerBlock;
+	static constexpr unsigned int deviceSize = nBlocks;
+
+	typedef FlashTransfer<Address> Transfer;
+
+private:
+	static pthread_mutex_t mutex;
+	static pthread_cond_t cond;
+	static pthread_t worker;
+	static bool started, held;
+	static Transfer *first, *last;
+	static unsigned int queued, maxQueued;
+
+	static void* work(void*) {
+		pthread_mutex_lock(&mutex);
+
+		while(true) {
+			while(!first || held)
+				pthread_cond_wait(&cond, &mutex);
+
+			Transfer* transfer = first;
+			first = transfer->next;
+
+			if(!first)
+				last = 0;
+
+			pthread_mutex_unlock(&mutex);
+
+			if(transfer->operation == Transfer::Read)
+				readNow(transfer->address, transfer->data);
+			else
+				writeNow(transfer->address, transfer->data);
+
+			pthread_mutex_lock(&mutex);
+			queued--;
+			pthread_cond_broadcast(&cond);
+			pthread_mutex_unlock(&mutex);
+
+			transfer->complete();
+
+			pthread_mutex_lock(&mutex);
+		}
+
+		return 0;
+	}
+
+public:
+	static void ensureErased(unsigned int blockAddress) {
+		for(unsigned int i=0; i<blockSize; i++)
+			for(unsigned int j=0; j<pageSize; j++)
+				blocks[blockAddress][i][j] = 0xff;
+	}
+
+	static void readNow(Address addr, void* data) {
+		for(unsigned int i=0; i<pageSize; i++)
+			((char*)data)[i] = blocks[addr / blockSize][addr % blockSize][i];
+	}
+
+	static void writeNow(Address addr, void* data) {
+		for(unsigned int i=0; i<pageSize; i++)
+			blocks[addr / blockSize][addr % blockSize][i] &= ((char*)data)[i];
+	}
+
+	static void submit(Transfer* transfer) {
+		pthread_mutex_lock(&mutex);
+
+		if(!started) {
+			pthread_create(&worker, 0, &ThreadedFlashDriver::work, 0);
+			pthread_detach(worker);
+			started = true;
+		}
+
+		for(; transfer; transfer = transfer->batch) {
+			transfer->next = 0;
+
+			if(last)
+				last->next = transfer;
+			else
+				first = transfer;
+
+			last = transfer;
+
+			if(++queued > maxQueued)
+				maxQueued = queued;
+		}
+
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&mutex);
+	}
+
+	static void hold(bool value) {
+		pthread_mutex_lock(&mutex);
+		held = value;
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&mutex);
+	}
+
+	static void waitForQueued(unsigned int n) {
+		pthread_mutex_lock(&mutex);
+		while(queued < n)
+			pthread_cond_wait(&cond, &mutex);
+		pthread_mutex_unlock(&mutex);
+	}
+
+	static unsigned int getMaxQueued() {
+		pthread_mutex_lock(&mutex);
+		unsigned int ret = maxQueued;
+		maxQueued = queued;
+		pthread_mutex_unlock(&mutex);
+		return ret;
+	}
+};
+
+#define TFD_TEMPLATE template<unsigned int bytesPerPage, unsigned int pagesPerBlock, unsigned int nBlocks>
+#define TFD ThreadedFlashDriver<bytesPerPage, pagesPerBlock, nBlocks>
+
+TFD_TEMPLATE typename TFD::Block TFD::blocks[nBlocks];
+TFD_TEMPLATE pthread_mutex_t TFD::mutex = PTHREAD_MUTEX_INITIALIZER;
+TFD_TEMPLATE pthread_cond_t TFD::cond = PTHREAD_COND_INITIALIZER;
+TFD_TEMPLATE pthread_t TFD::worker;
+TFD_TEMPLATE bool TFD::started = false;
+TFD_TEMPLATE bool TFD::held = false;
+TFD_TEMPLATE typename TFD::Transfer* TFD::first = 0;
+TFD_TEMPLATE typename TFD::Transfer* TFD::last = 0;
+TFD_TEMPLATE unsigned int TFD::queued = 0;
+TFD_TEMPLATE unsigned int TFD::maxQueued = 0;
+
+#undef TFD
+#undef TFD_TEMPLATE
+
+#endif /* THREADEDFLASHDRIVER_H_ */
@@ -42,6 +42,7 @@ struct ObjectStream: public Stream {
 			n -= ret;
 		}
 
+		Stream::park();
 		return size;
 	}
 
@@ -65,6 +66,7 @@ struct ObjectStream: public Stream {
 			n -= ret;
 		}
 
+		Stream::park();
 		return size;
 	}
 };